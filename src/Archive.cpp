@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "Archive.h"
+
+/*
+ * Each message is one line of tab separated fields:
+ *   time \t with \t < or > \t nick \t body
+ * with backslash escapes for tabs, newlines and backslashes.
+ */
+
+static void _escape(CString &sOutput, const CString &sData) {
+	for (char c : sData) {
+		switch (c) {
+			case '\\': sOutput += "\\\\"; break;
+			case '\t': sOutput += "\\t"; break;
+			case '\n': sOutput += "\\n"; break;
+			case '\r': sOutput += "\\r"; break;
+			default: sOutput += c;
+		}
+	}
+}
+
+static CString _unescape(const char *szData, size_t uSize) {
+	CString sResult;
+	sResult.reserve(uSize);
+
+	for (size_t i = 0; i < uSize; i++) {
+		if (szData[i] != '\\' || i + 1 == uSize) {
+			sResult += szData[i];
+			continue;
+		}
+
+		switch (szData[++i]) {
+			case 't': sResult += '\t'; break;
+			case 'n': sResult += '\n'; break;
+			case 'r': sResult += '\r'; break;
+			default: sResult += szData[i];
+		}
+	}
+
+	return sResult;
+}
+
+/* Split a line into at most uFields tab separated fields, false if it has fewer */
+static bool _split(const char *szLine, size_t uSize, const char **aszFields, size_t *auSizes, size_t uFields) {
+	const char *szEnd = szLine + uSize;
+
+	for (size_t i = 0; i < uFields; i++) {
+		const char *szTab = (i + 1 < uFields) ? (const char *)memchr(szLine, '\t', szEnd - szLine) : szEnd;
+		if (!szTab) {
+			return false;
+		}
+
+		aszFields[i] = szLine;
+		auSizes[i] = szTab - szLine;
+		szLine = szTab + 1;
+	}
+
+	return true;
+}
+
+/* Peers are kept as a 64-bit FNV-1a hash in the index, 0 means none */
+static uint64_t _hash_with(const char *szWith, size_t uSize) {
+	if (!uSize) {
+		return 0;
+	}
+
+	uint64_t uHash = 14695981039346656037ull;
+	for (size_t i = 0; i < uSize; i++) {
+		uHash = (uHash ^ (unsigned char)szWith[i]) * 1099511628211ull;
+	}
+
+	return uHash ? uHash : 1;
+}
+
+static bool _pread_all(int iFD, void *pData, size_t uSize, off_t iOffset) {
+	char *pBuffer = (char *)pData;
+	while (uSize) {
+		ssize_t iRead = pread(iFD, pBuffer, uSize, iOffset);
+		if (iRead <= 0) {
+			if (iRead < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		pBuffer += iRead;
+		uSize -= iRead;
+		iOffset += iRead;
+	}
+
+	return true;
+}
+
+static ssize_t _write_all(int iFD, const char *szData, size_t uSize) {
+	size_t uWritten = 0;
+	while (uWritten < uSize) {
+		ssize_t iWritten = write(iFD, szData + uWritten, uSize - uWritten);
+		if (iWritten < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		uWritten += iWritten;
+	}
+
+	return uWritten;
+}
+
+CXMPPArchive::CXMPPArchive(const CString &sPath) {
+	m_sPath = sPath;
+	m_iLog = -1;
+	m_iIndex = -1;
+	m_iSize = 0;
+	m_uRecords = 0;
+	m_uLastTime = 0;
+	m_bPartialLine = false;
+	m_tLastUsed = time(NULL);
+}
+
+CXMPPArchive::~CXMPPArchive() {
+	Close();
+}
+
+void CXMPPArchive::Close() {
+	if (m_iLog >= 0) {
+		close(m_iLog);
+		m_iLog = -1;
+	}
+
+	if (m_iIndex >= 0) {
+		close(m_iIndex);
+		m_iIndex = -1;
+	}
+}
+
+bool CXMPPArchive::Open() {
+	m_tLastUsed = time(NULL);
+
+	if (IsOpen()) {
+		return true;
+	}
+
+	/* pread() and O_APPEND writes share each descriptor, there is no file position to keep track of */
+	m_iLog = open(m_sPath.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	m_iIndex = open((m_sPath + ".idx").c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+	struct stat log, index;
+	if (m_iLog < 0 || m_iIndex < 0 || fstat(m_iLog, &log) != 0 || fstat(m_iIndex, &index) != 0) {
+		Close();
+		return false;
+	}
+
+	m_iSize = log.st_size;
+	m_uRecords = index.st_size / sizeof(SIndexRecord);
+	m_uLastTime = 0;
+
+	char cLast = '\n';
+	m_bPartialLine = m_iSize > 0 && _pread_all(m_iLog, &cLast, 1, m_iSize - 1) && cLast != '\n';
+
+	/* Find where the index stops, a crash may have cut its last record short
+	 * or kept it from catching up with the log */
+	off_t iIndexed = 0;
+	SIndexRecord last;
+	if (m_uRecords && ReadRecords(m_uRecords - 1, 1, &last) && (off_t)last.uOffset < m_iSize) {
+		m_uLastTime = last.uTime;
+
+		char acBuffer[4096];
+		iIndexed = last.uOffset;
+		while (iIndexed < m_iSize) {
+			size_t uRead = std::min((off_t)sizeof(acBuffer), m_iSize - iIndexed);
+			if (!_pread_all(m_iLog, acBuffer, uRead, iIndexed)) {
+				break;
+			}
+
+			const char *szNewline = (const char *)memchr(acBuffer, '\n', uRead);
+			iIndexed += szNewline ? szNewline - acBuffer + 1 : uRead;
+			if (szNewline) {
+				break;
+			}
+		}
+	} else {
+		/* No usable index, as for archives written before it existed */
+		m_uRecords = 0;
+	}
+
+	if ((off_t)(m_uRecords * sizeof(SIndexRecord)) != index.st_size && ftruncate(m_iIndex, m_uRecords * sizeof(SIndexRecord)) != 0) {
+		Close();
+		return false;
+	}
+
+	if (iIndexed < m_iSize && !IndexFrom(iIndexed)) {
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+bool CXMPPArchive::IndexFrom(off_t iOffset) {
+	char acBuffer[65536];
+	off_t iLineStart = iOffset;
+	CString sPartial;
+
+	while (iOffset < m_iSize) {
+		ssize_t iRead = pread(m_iLog, acBuffer, sizeof(acBuffer), iOffset);
+		if (iRead <= 0) {
+			if (iRead < 0 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		const char *szData = acBuffer;
+		const char *szEnd = acBuffer + iRead;
+
+		while (szData < szEnd) {
+			const char *szNewline = (const char *)memchr(szData, '\n', szEnd - szData);
+			if (!szNewline) {
+				sPartial.append(szData, szEnd - szData);
+				break;
+			}
+
+			bool bAdded;
+			if (sPartial.empty()) {
+				bAdded = AddRecord(szData, szNewline - szData, iLineStart);
+			} else {
+				/* A line split across reads */
+				sPartial.append(szData, szNewline - szData);
+				bAdded = AddRecord(sPartial.data(), sPartial.size(), iLineStart);
+				sPartial.clear();
+			}
+
+			if (!bAdded) {
+				return false;
+			}
+
+			szData = szNewline + 1;
+			iLineStart = iOffset + (szData - acBuffer);
+		}
+
+		iOffset += iRead;
+	}
+
+	/* A trailing partial line is left unindexed, the next append ends it */
+	return true;
+}
+
+bool CXMPPArchive::AddRecord(const char *szLine, size_t uSize, off_t iOffset) {
+	/* Only the time and the peer are indexed, the rest is read on demand */
+	const char *aszFields[3];
+	size_t auSizes[3];
+
+	if (!_split(szLine, uSize, aszFields, auSizes, 3) || !auSizes[0]) {
+		/* Not a message, skipped rather than failing the whole archive */
+		return true;
+	}
+
+	SIndexRecord record;
+	record.uTime = CString(aszFields[0], auSizes[0]).ToULongLong();
+	record.uOffset = iOffset;
+	record.uWith = 0;
+
+	/* Keep the index sorted even if the clock went backwards */
+	if (record.uTime < m_uLastTime) {
+		record.uTime = m_uLastTime;
+	}
+
+	if (auSizes[1]) {
+		CString sWith = _unescape(aszFields[1], auSizes[1]);
+		record.uWith = _hash_with(sWith.data(), sWith.size());
+	}
+
+	if (_write_all(m_iIndex, (const char *)&record, sizeof(record)) != sizeof(record)) {
+		/* Never leave a short record behind */
+		if (ftruncate(m_iIndex, m_uRecords * sizeof(SIndexRecord)) != 0) {
+			Close();
+		}
+		return false;
+	}
+
+	m_uRecords++;
+	m_uLastTime = record.uTime;
+	return true;
+}
+
+bool CXMPPArchive::ReadRecords(size_t uFirst, size_t uCount, SIndexRecord *pRecords) {
+	if (uFirst + uCount > m_uRecords) {
+		return false;
+	}
+
+	return _pread_all(m_iIndex, pRecords, uCount * sizeof(SIndexRecord), uFirst * sizeof(SIndexRecord));
+}
+
+size_t CXMPPArchive::FindTime(unsigned long long uTime, bool bAfter) {
+	size_t uLow = 0;
+	size_t uHigh = m_uRecords;
+
+	while (uLow < uHigh) {
+		size_t uMiddle = uLow + (uHigh - uLow) / 2;
+		SIndexRecord record;
+		if (!ReadRecords(uMiddle, 1, &record)) {
+			return m_uRecords;
+		}
+
+		if (bAfter ? record.uTime <= uTime : record.uTime < uTime) {
+			uLow = uMiddle + 1;
+		} else {
+			uHigh = uMiddle;
+		}
+	}
+
+	return uLow;
+}
+
+size_t CXMPPArchive::GetSize() {
+	return Open() ? m_uRecords : 0;
+}
+
+bool CXMPPArchive::Append(const SXMPPArchivedMessage &Message) {
+	if (!Open()) {
+		return false;
+	}
+
+	CString sLine;
+	if (m_bPartialLine) {
+		sLine = "\n";
+	}
+
+	size_t uPrefix = sLine.size();
+	off_t iOffset = m_iSize + uPrefix;
+
+	sLine += CString(Message.uTime) + "\t";
+	_escape(sLine, Message.sWith);
+	sLine += Message.bOutgoing ? "\t>\t" : "\t<\t";
+	_escape(sLine, Message.sNick);
+	sLine += "\t";
+	_escape(sLine, Message.sBody);
+	sLine += "\n";
+
+	size_t uWritten = _write_all(m_iLog, sLine.data(), sLine.size());
+
+	m_iSize += uWritten;
+	if (uWritten != sLine.size()) {
+		m_bPartialLine = true;
+		return false;
+	}
+
+	m_bPartialLine = false;
+	/* The log is written first, an index record missing after a crash is rebuilt on open */
+	return AddRecord(sLine.data() + uPrefix, sLine.size() - uPrefix - 1, iOffset);
+}
+
+bool CXMPPArchive::ParseId(const CString &sId, size_t &uId) const {
+	if (sId.empty() || sId.find_first_not_of("0123456789") != CString::npos) {
+		return false;
+	}
+
+	uId = sId.ToULongLong();
+	return uId < m_uRecords;
+}
+
+bool CXMPPArchive::Query(const SXMPPArchiveQuery &Query, SXMPPArchivePage &Page) {
+	Page.vuIds.clear();
+	Page.uFirstIndex = 0;
+	Page.uCount = 0;
+	Page.bComplete = true;
+
+	if (!Open()) {
+		return Query.sAfter.empty() && Query.sBefore.empty();
+	}
+
+	/* The time range, by binary search */
+	size_t uLow = FindTime(Query.uStart, false);
+	size_t uHigh = std::max(uLow, FindTime(Query.uEnd, true));
+
+	/* Filtering by peer has to look at each record in the range */
+	bool bFiltered = !Query.sWith.empty();
+	std::vector<size_t> vuMatches;
+	if (bFiltered) {
+		uint64_t uWith = _hash_with(Query.sWith.data(), Query.sWith.size());
+		SIndexRecord aRecords[512];
+
+		for (size_t i = uLow; i < uHigh; i += 512) {
+			size_t uChunk = std::min(uHigh - i, (size_t)512);
+			if (!ReadRecords(i, uChunk, aRecords)) {
+				return false;
+			}
+
+			for (size_t j = 0; j < uChunk; j++) {
+				if (aRecords[j].uWith == uWith) {
+					vuMatches.push_back(i + j);
+				}
+			}
+		}
+	}
+
+	size_t uCount = bFiltered ? vuMatches.size() : uHigh - uLow;
+
+	/* Number of matches before an id */
+	auto Rank = [&](size_t uId) -> size_t {
+		if (bFiltered) {
+			return std::lower_bound(vuMatches.begin(), vuMatches.end(), uId) - vuMatches.begin();
+		}
+		return std::min(std::max(uId, uLow), uHigh) - uLow;
+	};
+
+	size_t uBegin = 0;
+	size_t uEnd = uCount;
+	size_t uId;
+
+	if (!Query.sAfter.empty()) {
+		if (!ParseId(Query.sAfter, uId)) {
+			return false;
+		}
+		uBegin = Rank(uId + 1);
+	}
+
+	if (!Query.sBefore.empty()) {
+		if (!ParseId(Query.sBefore, uId)) {
+			return false;
+		}
+		uEnd = Rank(uId);
+	}
+
+	if (uEnd < uBegin) {
+		uEnd = uBegin;
+	}
+
+	size_t uPage = std::min(Query.uMax, uEnd - uBegin);
+	size_t uFirst = Query.bBackwards ? uEnd - uPage : uBegin;
+
+	for (size_t i = uFirst; i < uFirst + uPage; i++) {
+		Page.vuIds.push_back(bFiltered ? vuMatches[i] : uLow + i);
+	}
+
+	Page.uFirstIndex = uFirst;
+	Page.uCount = uCount;
+	Page.bComplete = Query.bBackwards ? uFirst == 0 : uFirst + uPage == uCount;
+	return true;
+}
+
+bool CXMPPArchive::Read(const std::vector<size_t> &vuIds, std::vector<SXMPPArchivedMessage> &vMessages) {
+	vMessages.clear();
+
+	if (vuIds.empty()) {
+		return true;
+	}
+
+	if (!Open()) {
+		return false;
+	}
+
+	CString sLine;
+	for (size_t uId : vuIds) {
+		/* A message ends where the next one starts */
+		SIndexRecord aRecords[2];
+		bool bLast = uId + 1 == m_uRecords;
+		if (!ReadRecords(uId, bLast ? 1 : 2, aRecords)) {
+			return false;
+		}
+
+		off_t iBegin = aRecords[0].uOffset;
+		off_t iEnd = bLast ? m_iSize : aRecords[1].uOffset;
+
+		sLine.resize(iEnd - iBegin);
+		if (!_pread_all(m_iLog, &sLine[0], sLine.size(), iBegin)) {
+			return false;
+		}
+
+		size_t uNewline = sLine.find('\n');
+		const char *aszFields[5];
+		size_t auSizes[5];
+		if (!_split(sLine.data(), uNewline == CString::npos ? sLine.size() : uNewline, aszFields, auSizes, 5)) {
+			return false;
+		}
+
+		SXMPPArchivedMessage message;
+		message.uTime = aRecords[0].uTime;
+		message.sWith = _unescape(aszFields[1], auSizes[1]);
+		message.bOutgoing = auSizes[2] == 1 && aszFields[2][0] == '>';
+		message.sNick = _unescape(aszFields[3], auSizes[3]);
+		message.sBody = _unescape(aszFields[4], auSizes[4]);
+		vMessages.push_back(message);
+	}
+
+	return true;
+}
+
+bool XMPPParseDateTime(const CString &sDateTime, unsigned long long &uTime) {
+	struct tm tm;
+	int iConsumed = 0;
+	memset(&tm, 0, sizeof(tm));
+
+	if (sscanf(sDateTime.c_str(), "%4d-%2d-%2dT%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &iConsumed) != 6) {
+		return false;
+	}
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+
+	const char *szRest = sDateTime.c_str() + iConsumed;
+	unsigned long long uMicroseconds = 0;
+
+	if (*szRest == '.') {
+		/* Fractions of a second, only the first six digits matter */
+		unsigned long long uScale = 100000;
+		for (szRest++; *szRest >= '0' && *szRest <= '9'; szRest++) {
+			uMicroseconds += (*szRest - '0') * uScale;
+			uScale /= 10;
+		}
+	}
+
+	long lOffset = 0;
+	if (*szRest == '+' || *szRest == '-') {
+		int iHours, iMinutes;
+		if (sscanf(szRest + 1, "%2d:%2d", &iHours, &iMinutes) != 2) {
+			return false;
+		}
+		lOffset = (iHours * 60 + iMinutes) * 60;
+		if (*szRest == '-') {
+			lOffset = -lOffset;
+		}
+	} else if (*szRest != 'Z') {
+		return false;
+	}
+
+	time_t tTime = timegm(&tm) - lOffset;
+	if (tTime < 0) {
+		return false;
+	}
+
+	uTime = (unsigned long long)tTime * 1000000 + uMicroseconds;
+	return true;
+}
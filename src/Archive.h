@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _ARCHIVE_H
+#define _ARCHIVE_H
+
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <cstdint>
+#include <ctime>
+#include <vector>
+
+#include <znc/ZNCString.h>
+
+/* Times are microseconds since the epoch */
+struct SXMPPArchivedMessage {
+	unsigned long long uTime;
+	CString sWith;   /* the other side of a private conversation, "nick!network+irc" */
+	bool bOutgoing;
+	CString sNick;   /* who said it */
+	CString sBody;
+};
+
+struct SXMPPArchiveQuery {
+	unsigned long long uStart;
+	unsigned long long uEnd;
+	CString sWith;   /* empty for everything */
+	/* Result Set Management, ids from earlier pages */
+	CString sAfter;
+	CString sBefore;
+	bool bBackwards; /* the page ending at sBefore, or at the end */
+	size_t uMax;
+};
+
+struct SXMPPArchivePage {
+	std::vector<size_t> vuIds;  /* oldest first */
+	size_t uFirstIndex;         /* of vuIds[0] among all matches */
+	size_t uCount;              /* all matches, not just this page */
+	bool bComplete;             /* nothing further in the direction paged */
+};
+
+/*
+ * Append-only message archive of one conversation (XEP-0313). Messages
+ * are lines in a log file. A sidecar index file ("<log>.idx") holds one
+ * fixed size record of time, offset and peer per message, so a query is
+ * a binary search over the index on disk followed by reading only the
+ * lines on the requested page. Nothing is loaded up front. A message's id
+ * is its position in the archive.
+ *
+ * Both files are kept open between calls until Close(), the module
+ * closes archives that have not been used for a while.
+ */
+class CXMPPArchive {
+public:
+	CXMPPArchive(const CString &sPath);
+	~CXMPPArchive();
+
+	CXMPPArchive(const CXMPPArchive&) = delete;
+	CXMPPArchive& operator=(const CXMPPArchive&) = delete;
+
+	bool Append(const SXMPPArchivedMessage &Message);
+	size_t GetSize();
+
+	/* False when an id the query pages from is not in this archive */
+	bool Query(const SXMPPArchiveQuery &Query, SXMPPArchivePage &Page);
+	bool Read(const std::vector<size_t> &vuIds, std::vector<SXMPPArchivedMessage> &vMessages);
+
+	/* Release the files, they are opened again on next use. */
+	void Close();
+	bool IsOpen() const { return m_iLog >= 0; }
+	time_t GetLastUsed() const { return m_tLastUsed; }
+
+protected:
+	/* In host byte order, the index never leaves the machine */
+	struct SIndexRecord {
+		uint64_t uTime;
+		uint64_t uOffset;
+		uint64_t uWith;  /* hash of the peer, 0 for none */
+	};
+
+	bool Open();
+	/* Index the complete lines from iOffset on, the index is missing them */
+	bool IndexFrom(off_t iOffset);
+	bool AddRecord(const char *szLine, size_t uSize, off_t iOffset);
+	bool ReadRecords(size_t uFirst, size_t uCount, SIndexRecord *pRecords);
+	/* First record at or after uTime, or after it when bAfter */
+	size_t FindTime(unsigned long long uTime, bool bAfter);
+	bool ParseId(const CString &sId, size_t &uId) const;
+
+	CString m_sPath;
+	int m_iLog;
+	int m_iIndex;
+	off_t m_iSize;
+	size_t m_uRecords;
+	unsigned long long m_uLastTime;
+	/* A crash can leave half a line behind, the next append starts afresh */
+	bool m_bPartialLine;
+	time_t m_tLastUsed;
+};
+
+inline unsigned long long XMPPArchiveTime(const timeval &tv) {
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+inline unsigned long long XMPPArchiveTime() {
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return XMPPArchiveTime(tv);
+}
+
+/* Parse an XEP-0082 date and time into microseconds since the epoch */
+bool XMPPParseDateTime(const CString &sDateTime, unsigned long long &uTime);
+
+#endif
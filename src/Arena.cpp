@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+
+#include "Arena.h"
+
+bool CXMPPStringRef::Equals(const CXMPPStringRef &other) const {
+	return m_uSize == other.m_uSize && strncasecmp(m_szData, other.m_szData, m_uSize) == 0;
+}
+
+bool CXMPPStringRef::Equals(const char *szOther) const {
+	return Equals(CXMPPStringRef(szOther, strlen(szOther)));
+}
+
+CXMPPArena::CXMPPArena(size_t uBlockSize) {
+	m_pHead = NULL;
+	m_uBlockSize = uBlockSize;
+	m_uBytesAllocated = 0;
+}
+
+CXMPPArena::~CXMPPArena() {
+	while (m_pHead) {
+		SBlock *pNext = m_pHead->pNext;
+		free(m_pHead);
+		m_pHead = pNext;
+	}
+}
+
+CXMPPArena::SBlock* CXMPPArena::NewBlock(size_t uMinSize) {
+	size_t uSize = m_uBlockSize;
+	if (uSize < uMinSize) {
+		uSize = uMinSize;
+	}
+
+	SBlock *pBlock = (SBlock*)malloc(sizeof(SBlock) + uSize);
+	if (!pBlock) {
+		throw std::bad_alloc();
+	}
+
+	pBlock->uSize = uSize;
+	pBlock->uUsed = 0;
+	return pBlock;
+}
+
+void* CXMPPArena::Allocate(size_t uSize, size_t uAlign) {
+	if (m_pHead) {
+		char *pBase = (char*)(m_pHead + 1);
+		size_t uOffset = (m_pHead->uUsed + uAlign - 1) & ~(uAlign - 1);
+
+		if (uOffset + uSize <= m_pHead->uSize) {
+			m_pHead->uUsed = uOffset + uSize;
+			m_uBytesAllocated += uSize;
+			return pBase + uOffset;
+		}
+	}
+
+	SBlock *pBlock = NewBlock(uSize);
+
+	if (m_pHead && uSize > m_uBlockSize / 2) {
+		/* Oversized allocations get a private block behind the head so the
+		 * remainder of the current block is not wasted. */
+		pBlock->pNext = m_pHead->pNext;
+		m_pHead->pNext = pBlock;
+	} else {
+		pBlock->pNext = m_pHead;
+		m_pHead = pBlock;
+	}
+
+	pBlock->uUsed = uSize;
+	m_uBytesAllocated += uSize;
+	return (char*)(pBlock + 1);
+}
+
+bool CXMPPArena::Extend(const void *pData, size_t uSize, size_t uExtra) {
+	if (!m_pHead) {
+		return false;
+	}
+
+	char *pTop = (char*)(m_pHead + 1) + m_pHead->uUsed;
+	if ((const char*)pData + uSize != pTop || m_pHead->uUsed + uExtra > m_pHead->uSize) {
+		return false;
+	}
+
+	m_pHead->uUsed += uExtra;
+	m_uBytesAllocated += uExtra;
+	return true;
+}
+
+CXMPPStringRef CXMPPArena::Copy(const char *szData, size_t uSize) {
+	char *szCopy = (char*)Allocate(uSize + 1, 1);
+	memcpy(szCopy, szData, uSize);
+	szCopy[uSize] = '\0';
+	return CXMPPStringRef(szCopy, uSize);
+}
+
+size_t CXMPPArena::GetBytesReserved() const {
+	size_t uReserved = 0;
+	for (SBlock *pBlock = m_pHead; pBlock; pBlock = pBlock->pNext) {
+		uReserved += pBlock->uSize;
+	}
+
+	return uReserved;
+}
+
+void CXMPPArena::Reset() {
+	if (!m_pHead) {
+		return;
+	}
+
+	/* Keep a single standard sized block, oversized ones are not worth holding */
+	SBlock *pKeep = NULL;
+	while (m_pHead) {
+		SBlock *pNext = m_pHead->pNext;
+		if (!pKeep && m_pHead->uSize == m_uBlockSize) {
+			pKeep = m_pHead;
+		} else {
+			free(m_pHead);
+		}
+		m_pHead = pNext;
+	}
+
+	if (pKeep) {
+		pKeep->pNext = NULL;
+		pKeep->uUsed = 0;
+	}
+
+	m_pHead = pKeep;
+	m_uBytesAllocated = 0;
+}
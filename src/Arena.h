@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+#include <znc/ZNCString.h>
+
+/* A length-delimited view of a string owned by an arena (or a literal). */
+class CXMPPStringRef {
+public:
+	CXMPPStringRef() : m_szData(""), m_uSize(0) {}
+	CXMPPStringRef(const char *szData, size_t uSize) : m_szData(szData), m_uSize(uSize) {}
+
+	const char *GetData() const { return m_szData; }
+	size_t GetSize() const { return m_uSize; }
+	bool IsEmpty() const { return m_uSize == 0; }
+
+	bool Equals(const CXMPPStringRef &other) const;
+	bool Equals(const char *szOther) const;
+
+	CString ToString() const { return CString(m_szData, m_uSize); }
+
+protected:
+	const char *m_szData;
+	size_t m_uSize;
+};
+
+/*
+ * Bump allocator owning a whole stanza tree. Memory is handed out from
+ * large blocks and is only released all at once by Reset() or when the
+ * arena is destroyed, so nothing allocated here may need a destructor.
+ */
+class CXMPPArena {
+public:
+	CXMPPArena(size_t uBlockSize = 4096);
+	~CXMPPArena();
+
+	CXMPPArena(const CXMPPArena&) = delete;
+	CXMPPArena& operator=(const CXMPPArena&) = delete;
+
+	void* Allocate(size_t uSize, size_t uAlign = alignof(std::max_align_t));
+
+	template <typename T, typename... Args>
+	T* New(Args&&... args) {
+		return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	/* Grow the most recent allocation (pData, uSize) by uExtra bytes in
+	 * place, only possible while nothing has been allocated after it. */
+	bool Extend(const void *pData, size_t uSize, size_t uExtra);
+
+	/* Copy a string into the arena, the copy is NUL terminated. */
+	CXMPPStringRef Copy(const char *szData, size_t uSize);
+	CXMPPStringRef Copy(const CString &sData) { return Copy(sData.data(), sData.size()); }
+
+	/* Release everything, keeping the first block around for reuse. */
+	void Reset();
+
+	size_t GetBytesAllocated() const { return m_uBytesAllocated; }
+	/* Size of the blocks currently held, used or not */
+	size_t GetBytesReserved() const;
+
+protected:
+	/* Aligned so the payload following the header is suitably aligned too */
+	struct alignas(std::max_align_t) SBlock {
+		SBlock *pNext;
+		size_t uSize;
+		size_t uUsed;
+	};
+
+	SBlock* NewBlock(size_t uMinSize);
+
+	SBlock *m_pHead;
+	size_t  m_uBlockSize;
+	size_t  m_uBytesAllocated;
+};
+
+#endif
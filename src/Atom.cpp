@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <unordered_set>
+
+#include "Atom.h"
+#include "Arena.h"
+
+/* Names beyond this many are not interned, so even an authenticated peer cannot grow the table without bound */
+static const size_t MAX_DYNAMIC_ATOMS = 4096;
+
+enum {
+#define XMPP_ATOM_INDEX(name, value) ATOM_##name,
+	XMPP_ATOMS(XMPP_ATOM_INDEX)
+#undef XMPP_ATOM_INDEX
+	ATOM_COUNT
+};
+
+static const CXMPPAtom s_aWellKnown[ATOM_COUNT] = {
+#define XMPP_ATOM_VALUE(name, value) {value, sizeof(value) - 1, true},
+	XMPP_ATOMS(XMPP_ATOM_VALUE)
+#undef XMPP_ATOM_VALUE
+};
+
+#define XMPP_ATOM_DEFINE(name, value) const CXMPPAtom* const CXMPPAtom::name = &s_aWellKnown[ATOM_##name];
+XMPP_ATOMS(XMPP_ATOM_DEFINE)
+#undef XMPP_ATOM_DEFINE
+
+struct SAtomHash {
+	size_t operator()(const CXMPPAtom *pAtom) const {
+		/* FNV-1a */
+		size_t uHash = 2166136261u;
+		for (size_t i = 0; i < pAtom->GetSize(); i++) {
+			uHash = (uHash ^ (unsigned char)pAtom->GetData()[i]) * 16777619u;
+		}
+		return uHash;
+	}
+};
+
+struct SAtomEqual {
+	bool operator()(const CXMPPAtom *pLeft, const CXMPPAtom *pRight) const {
+		return pLeft->GetSize() == pRight->GetSize() && memcmp(pLeft->GetData(), pRight->GetData(), pLeft->GetSize()) == 0;
+	}
+};
+
+class CXMPPAtomTable {
+public:
+	CXMPPAtomTable() {
+		for (const auto &atom : s_aWellKnown) {
+			m_sAtoms.insert(&atom);
+		}
+	}
+
+	~CXMPPAtomTable() {
+		for (const auto &pAtom : m_vDynamic) {
+			free((void*)pAtom);
+		}
+	}
+
+	std::unordered_set<const CXMPPAtom*, SAtomHash, SAtomEqual> m_sAtoms;
+	std::vector<const CXMPPAtom*> m_vDynamic;
+};
+
+static CXMPPAtomTable& AtomTable() {
+	static CXMPPAtomTable table;
+	return table;
+}
+
+bool CXMPPAtom::Equals(const CXMPPAtom *pOther) const {
+	if (this == pOther) {
+		return true;
+	}
+
+	/* Two interned atoms are distinct names, but an uninterned one may have
+	 * been copied before its name was interned by another stream */
+	if (!pOther || (m_bInterned && pOther->m_bInterned)) {
+		return false;
+	}
+
+	return Equals(pOther->m_szData, pOther->m_uSize);
+}
+
+bool CXMPPAtom::Equals(const char *szData, size_t uSize) const {
+	return m_uSize == uSize && memcmp(m_szData, szData, uSize) == 0;
+}
+
+const CXMPPAtom* CXMPPAtom::Find(const char *szData, size_t uSize) {
+	CXMPPAtom key = {szData, uSize, false};
+
+	CXMPPAtomTable &table = AtomTable();
+	std::unordered_set<const CXMPPAtom*, SAtomHash, SAtomEqual>::const_iterator it = table.m_sAtoms.find(&key);
+	if (it == table.m_sAtoms.end()) {
+		return NULL;
+	}
+
+	return *it;
+}
+
+/* An uninterned copy that lives and dies with the stanza's arena */
+static const CXMPPAtom* CopyAtom(const char *szData, size_t uSize, CXMPPArena &Arena) {
+	CXMPPStringRef sCopy = Arena.Copy(szData, uSize);
+	CXMPPAtom *pCopy = Arena.New<CXMPPAtom>();
+	pCopy->m_szData = sCopy.GetData();
+	pCopy->m_uSize = uSize;
+	pCopy->m_bInterned = false;
+	return pCopy;
+}
+
+const CXMPPAtom* CXMPPAtom::Lookup(const char *szData, size_t uSize, CXMPPArena &Arena) {
+	const CXMPPAtom *pAtom = Find(szData, uSize);
+	if (pAtom) {
+		return pAtom;
+	}
+
+	return CopyAtom(szData, uSize, Arena);
+}
+
+size_t CXMPPAtom::GetDynamicCount() {
+	return AtomTable().m_vDynamic.size();
+}
+
+const CXMPPAtom* CXMPPAtom::Intern(const char *szData, size_t uSize, CXMPPArena &Arena) {
+	const CXMPPAtom *pAtom = Find(szData, uSize);
+	if (pAtom) {
+		return pAtom;
+	}
+
+	CXMPPAtomTable &table = AtomTable();
+	if (table.m_vDynamic.size() >= MAX_DYNAMIC_ATOMS) {
+		/* Table is full, keep an uninterned copy alongside the stanza */
+		return CopyAtom(szData, uSize, Arena);
+	}
+
+	/* Name and atom share one allocation */
+	CXMPPAtom *pNew = (CXMPPAtom*)malloc(sizeof(CXMPPAtom) + uSize + 1);
+	if (!pNew) {
+		throw std::bad_alloc();
+	}
+
+	char *szCopy = (char*)(pNew + 1);
+	memcpy(szCopy, szData, uSize);
+	szCopy[uSize] = '\0';
+
+	pNew->m_szData = szCopy;
+	pNew->m_uSize = uSize;
+	pNew->m_bInterned = true;
+
+	table.m_sAtoms.insert(pNew);
+	table.m_vDynamic.push_back(pNew);
+	return pNew;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _ATOM_H
+#define _ATOM_H
+
+#include <cstddef>
+
+#include <znc/ZNCString.h>
+
+class CXMPPArena;
+
+/* Well known element names, attribute names, values and namespaces */
+#define XMPP_ATOMS(ATOM) \
+	ATOM(Stream,            "stream:stream") \
+	ATOM(StreamFeatures,    "stream:features") \
+	ATOM(StreamError,       "stream:error") \
+	ATOM(Message,           "message") \
+	ATOM(Presence,          "presence") \
+	ATOM(IQ,                "iq") \
+	ATOM(Auth,              "auth") \
+	ATOM(StartTLS,          "starttls") \
+	ATOM(Body,              "body") \
+	ATOM(Subject,           "subject") \
+	ATOM(Thread,            "thread") \
+	ATOM(Status,            "status") \
+	ATOM(Show,              "show") \
+	ATOM(Priority,          "priority") \
+	ATOM(Error,             "error") \
+	ATOM(Text,              "text") \
+	ATOM(Query,             "query") \
+	ATOM(Item,              "item") \
+	ATOM(Identity,          "identity") \
+	ATOM(Feature,           "feature") \
+	ATOM(Bind,              "bind") \
+	ATOM(Session,           "session") \
+	ATOM(Resource,          "resource") \
+	ATOM(Ping,              "ping") \
+	ATOM(VCard,             "vCard") \
+	ATOM(XElement,          "x") \
+	ATOM(History,           "history") \
+	ATOM(Delay,             "delay") \
+	ATOM(Invite,            "invite") \
+	ATOM(Reason,            "reason") \
+	ATOM(Photo,             "photo") \
+	ATOM(Username,          "username") \
+	ATOM(Password,          "password") \
+	ATOM(Active,            "active") \
+	ATOM(Inactive,          "inactive") \
+	ATOM(CSI,               "csi") \
+	ATOM(SM,                "sm") \
+	ATOM(Enable,            "enable") \
+	ATOM(Enabled,           "enabled") \
+	ATOM(Resume,            "resume") \
+	ATOM(Resumed,           "resumed") \
+	ATOM(Failed,            "failed") \
+	ATOM(AckRequest,        "r") \
+	ATOM(AckAnswer,         "a") \
+	ATOM(Compress,          "compress") \
+	ATOM(Compressed,        "compressed") \
+	ATOM(Compression,       "compression") \
+	ATOM(Method,            "method") \
+	ATOM(Fin,               "fin") \
+	ATOM(Forwarded,         "forwarded") \
+	ATOM(Field,             "field") \
+	ATOM(Value,             "value") \
+	ATOM(After,             "after") \
+	ATOM(Before,            "before") \
+	ATOM(First,             "first") \
+	ATOM(Last,              "last") \
+	ATOM(Count,             "count") \
+	ATOM(Caps,              "c") \
+	ATOM(Xmlns,             "xmlns") \
+	ATOM(To,                "to") \
+	ATOM(From,              "from") \
+	ATOM(Id,                "id") \
+	ATOM(Type,              "type") \
+	ATOM(Jid,               "jid") \
+	ATOM(Name,              "name") \
+	ATOM(Var,               "var") \
+	ATOM(Category,          "category") \
+	ATOM(Code,              "code") \
+	ATOM(Stamp,             "stamp") \
+	ATOM(Affiliation,       "affiliation") \
+	ATOM(Role,              "role") \
+	ATOM(Mechanism,         "mechanism") \
+	ATOM(MaxStanzas,        "maxstanzas") \
+	ATOM(XmlLang,           "xml:lang") \
+	ATOM(Handled,           "h") \
+	ATOM(PrevId,            "previd") \
+	ATOM(Max,               "max") \
+	ATOM(QueryId,           "queryid") \
+	ATOM(Index,             "index") \
+	ATOM(Complete,          "complete") \
+	ATOM(Hash,              "hash") \
+	ATOM(Node,              "node") \
+	ATOM(Ver,               "ver") \
+	ATOM(Get,               "get") \
+	ATOM(Set,               "set") \
+	ATOM(Result,            "result") \
+	ATOM(Chat,              "chat") \
+	ATOM(GroupChat,         "groupchat") \
+	ATOM(Normal,            "normal") \
+	ATOM(Headline,          "headline") \
+	ATOM(Unavailable,       "unavailable") \
+	ATOM(Available,         "available") \
+	ATOM(NSClient,          "jabber:client") \
+	ATOM(NSStream,          "http://etherx.jabber.org/streams") \
+	ATOM(NSSASL,            "urn:ietf:params:xml:ns:xmpp-sasl") \
+	ATOM(NSTLS,             "urn:ietf:params:xml:ns:xmpp-tls") \
+	ATOM(NSBind,            "urn:ietf:params:xml:ns:xmpp-bind") \
+	ATOM(NSSession,         "urn:ietf:params:xml:ns:xmpp-session") \
+	ATOM(NSStanzas,         "urn:ietf:params:xml:ns:xmpp-stanzas") \
+	ATOM(NSStreams,         "urn:ietf:params:xml:ns:xmpp-streams") \
+	ATOM(NSIQAuth,          "jabber:iq:auth") \
+	ATOM(NSRoster,          "jabber:iq:roster") \
+	ATOM(NSPing,            "urn:xmpp:ping") \
+	ATOM(NSVCard,           "vcard-temp") \
+	ATOM(NSVCardUpdate,     "vcard-temp:x:update") \
+	ATOM(NSDiscoInfo,       "http://jabber.org/protocol/disco#info") \
+	ATOM(NSDiscoItems,      "http://jabber.org/protocol/disco#items") \
+	ATOM(NSMUC,             "http://jabber.org/protocol/muc") \
+	ATOM(NSMUCUser,         "http://jabber.org/protocol/muc#user") \
+	ATOM(NSDelay,           "urn:xmpp:delay") \
+	ATOM(NSCSI,             "urn:xmpp:csi:0") \
+	ATOM(NSSM,              "urn:xmpp:sm:3") \
+	ATOM(NSCompress,        "http://jabber.org/protocol/compress") \
+	ATOM(NSMAM,             "urn:xmpp:mam:2") \
+	ATOM(NSRSM,             "http://jabber.org/protocol/rsm") \
+	ATOM(NSForward,         "urn:xmpp:forward:0") \
+	ATOM(NSData,            "jabber:x:data") \
+	ATOM(NSCompressFeature, "http://jabber.org/features/compress") \
+	ATOM(NSCaps,            "http://jabber.org/protocol/caps") \
+	ATOM(NSXDelay,          "jabber:x:delay")
+
+/*
+ * An interned name. Two interned atoms are equal only if they are the same
+ * pointer, so comparing against one of the well known atoms below is a
+ * pointer comparison. Names seen on authenticated streams are interned on
+ * demand up to a fixed bound. Anything else is stored uninterned in the
+ * stanza's arena and compared by content.
+ */
+class CXMPPAtom {
+public:
+	const char *GetData() const { return m_szData; }
+	size_t GetSize() const { return m_uSize; }
+	bool IsInterned() const { return m_bInterned; }
+	CString ToString() const { return CString(m_szData, m_uSize); }
+
+	bool Equals(const CXMPPAtom *pOther) const;
+	bool Equals(const char *szData, size_t uSize) const;
+
+	/* Look up an atom without interning it, NULL when unknown. */
+	static const CXMPPAtom* Find(const char *szData, size_t uSize);
+	static const CXMPPAtom* Find(const CString &sData) { return Find(sData.data(), sData.size()); }
+
+	/* Intern a name, falling back to an uninterned copy in Arena once the table is full. */
+	static const CXMPPAtom* Intern(const char *szData, size_t uSize, CXMPPArena &Arena);
+	/* Like Intern(), but never grows the table: unknown names are copied into Arena. */
+	static const CXMPPAtom* Lookup(const char *szData, size_t uSize, CXMPPArena &Arena);
+	/* Names interned on demand so far, for tests and statistics */
+	static size_t GetDynamicCount();
+
+#define XMPP_ATOM_DECLARE(name, value) static const CXMPPAtom* const name;
+	XMPP_ATOMS(XMPP_ATOM_DECLARE)
+#undef XMPP_ATOM_DECLARE
+
+	/* Public only so the well known atoms can be statically initialized */
+	const char *m_szData;
+	size_t m_uSize;
+	bool m_bInterned;
+};
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+
+#include <algorithm>
+
+#include "Caps.h"
+
+/* SHA-1 (RFC 3174), ZNC only offers MD5 and SHA-256 */
+static uint32_t _rotate(uint32_t uValue, int iBits) {
+	return (uValue << iBits) | (uValue >> (32 - iBits));
+}
+
+static void _sha1_block(uint32_t *auState, const unsigned char *pBlock) {
+	uint32_t auWords[80];
+
+	for (int i = 0; i < 16; i++) {
+		auWords[i] = (uint32_t)pBlock[i * 4] << 24 | (uint32_t)pBlock[i * 4 + 1] << 16 | (uint32_t)pBlock[i * 4 + 2] << 8 | pBlock[i * 4 + 3];
+	}
+	for (int i = 16; i < 80; i++) {
+		auWords[i] = _rotate(auWords[i - 3] ^ auWords[i - 8] ^ auWords[i - 14] ^ auWords[i - 16], 1);
+	}
+
+	uint32_t a = auState[0], b = auState[1], c = auState[2], d = auState[3], e = auState[4];
+
+	for (int i = 0; i < 80; i++) {
+		uint32_t f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+
+		uint32_t t = _rotate(a, 5) + f + e + k + auWords[i];
+		e = d;
+		d = c;
+		c = _rotate(b, 30);
+		b = a;
+		a = t;
+	}
+
+	auState[0] += a;
+	auState[1] += b;
+	auState[2] += c;
+	auState[3] += d;
+	auState[4] += e;
+}
+
+static CString _sha1(const CString &sData) {
+	uint32_t auState[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+	/* The message, a 1 bit, zeros up to 8 bytes short of a block, then the length in bits */
+	CString sPadded = sData;
+	sPadded += (char)0x80;
+	while (sPadded.size() % 64 != 56) {
+		sPadded += (char)0;
+	}
+
+	unsigned long long uBits = (unsigned long long)sData.size() * 8;
+	for (int i = 7; i >= 0; i--) {
+		sPadded += (char)(uBits >> (i * 8));
+	}
+
+	for (size_t i = 0; i < sPadded.size(); i += 64) {
+		_sha1_block(auState, (const unsigned char *)sPadded.data() + i);
+	}
+
+	CString sDigest;
+	for (int i = 0; i < 5; i++) {
+		for (int j = 3; j >= 0; j--) {
+			sDigest += (char)(auState[i] >> (j * 8));
+		}
+	}
+
+	return sDigest;
+}
+
+/* Generation Method: https://xmpp.org/extensions/xep-0115.html#ver-gen */
+CString XMPPCapsVer(const std::vector<SXMPPIdentity> &vIdentities, const std::vector<CString> &vsFeatures) {
+	/* category/type/lang/name, none of ours have a language */
+	std::vector<CString> vsIdentities;
+	for (const SXMPPIdentity &identity : vIdentities) {
+		vsIdentities.push_back(identity.sCategory + "/" + identity.sType + "//" + identity.sName);
+	}
+	std::sort(vsIdentities.begin(), vsIdentities.end());
+
+	std::vector<CString> vsSorted(vsFeatures);
+	std::sort(vsSorted.begin(), vsSorted.end());
+
+	CString sInput;
+	for (const CString &sIdentity : vsIdentities) {
+		sInput += sIdentity + "<";
+	}
+	for (const CString &sFeature : vsSorted) {
+		sInput += sFeature + "<";
+	}
+
+	return _sha1(sInput).Base64Encode_n();
+}
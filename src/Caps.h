@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _CAPS_H
+#define _CAPS_H
+
+#include <vector>
+
+#include <znc/ZNCString.h>
+
+struct SXMPPIdentity {
+	CString sCategory;
+	CString sType;
+	CString sName;
+};
+
+/*
+ * Entity Capabilities (XEP-0115) verification string of a disco#info
+ * answer with these identities and features, the base64 SHA-1 of their
+ * canonical form. The order they are given in does not matter.
+ */
+CString XMPPCapsVer(const std::vector<SXMPPIdentity> &vIdentities, const std::vector<CString> &vsFeatures);
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include "Channels.h"
+
+CXMPPChannelKey CXMPPChannelKeys::Intern(const CString &sChannel) {
+	return &*m_ssKeys.insert(sChannel.AsLower()).first;
+}
+
+CXMPPChannelKey CXMPPChannelKeys::Find(const CString &sChannel) const {
+	std::unordered_set<CString, std::hash<std::string>>::const_iterator it = m_ssKeys.find(sChannel.AsLower());
+	if (it == m_ssKeys.end()) {
+		return NULL;
+	}
+
+	return &*it;
+}
+
+const CXMPPChannel* CXMPPChannelMembership::Find(const CString &sChannel) const {
+	CXMPPChannelKey Channel = m_Keys.Find(sChannel);
+	if (!Channel) {
+		return NULL;
+	}
+
+	std::unordered_map<CXMPPChannelKey, CXMPPChannel>::const_iterator it = m_mChannels.find(Channel);
+	if (it == m_mChannels.end()) {
+		return NULL;
+	}
+
+	return &it->second;
+}
+
+CXMPPChannelKey CXMPPChannelMembership::Add(const CXMPPChannel &Channel) {
+	CXMPPChannelKey Key = m_Keys.Intern(Channel.GetJID().GetUser());
+	return m_mChannels.emplace(Key, Channel).second ? Key : NULL;
+}
+
+CXMPPChannelKey CXMPPChannelMembership::Remove(const CString &sChannel) {
+	CXMPPChannelKey Channel = m_Keys.Find(sChannel);
+	return Channel && m_mChannels.erase(Channel) ? Channel : NULL;
+}
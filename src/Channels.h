@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _CHANNELS_H
+#define _CHANNELS_H
+
+#include <unordered_map>
+#include <unordered_set>
+
+#include <znc/ZNCString.h>
+
+#include "JID.h"
+
+class CChan;
+
+/* An interned, case folded "#chan!network+irc", compared and hashed by pointer */
+typedef const CString *CXMPPChannelKey;
+
+class CXMPPChannel {
+public:
+	CXMPPChannel() {}
+	CXMPPChannel(const CXMPPJID &jid, CChan *const &pChan, int historyMaxStanzas = 25) {
+		m_Jid = jid;
+		m_pChan = pChan;
+		// Used for callback joins
+		m_historyMaxStanzas = historyMaxStanzas;
+	}
+
+	CXMPPJID GetJID() const { return m_Jid; }
+	CChan *GetChannel() const { return m_pChan; }
+	int GetHistoryMaxStanzas() { return m_historyMaxStanzas; }
+
+protected:
+	CXMPPJID m_Jid;
+	CChan *m_pChan;
+	int m_historyMaxStanzas;
+};
+
+/* The module's channel keys. Keys are interned on join, lookups never grow the table. */
+class CXMPPChannelKeys {
+public:
+	CXMPPChannelKey Intern(const CString &sChannel);
+	CXMPPChannelKey Find(const CString &sChannel) const;
+	size_t GetSize() const { return m_ssKeys.size(); }
+
+protected:
+	std::unordered_set<CString, std::hash<std::string>> m_ssKeys;
+};
+
+/*
+ * The channels one client has joined, keyed by the room JID's user part.
+ * Only Add() inserts, so looking up channels the client is not in (as
+ * messages and presence from every channel on the network do) leaves
+ * both the membership and the key table as they were.
+ */
+class CXMPPChannelMembership {
+public:
+	CXMPPChannelMembership(CXMPPChannelKeys &Keys) : m_Keys(Keys) {}
+
+	const CXMPPChannel* Find(const CString &sChannel) const;
+	bool Has(const CString &sChannel) const { return Find(sChannel) != NULL; }
+	/* The channel's key if it was newly joined, NULL if it already was */
+	CXMPPChannelKey Add(const CXMPPChannel &Channel);
+	/* The channel's key if it was left, NULL if it had not been joined */
+	CXMPPChannelKey Remove(const CString &sChannel);
+	void Clear() { m_mChannels.clear(); }
+
+	const std::unordered_map<CXMPPChannelKey, CXMPPChannel>& GetChannels() const { return m_mChannels; }
+
+protected:
+	CXMPPChannelKeys &m_Keys;
+	std::unordered_map<CXMPPChannelKey, CXMPPChannel> m_mChannels;
+};
+
+#endif
@@ -6,11 +6,19 @@
  * by the Free Software Foundation.
  */
 
+#include <algorithm>
+#include <climits>
+
 #include <znc/IRCNetwork.h>
 #include <znc/Chan.h>
 #include <znc/Utils.h>
 
+#if ZNC_HAVE_ARGON
+#include <argon2.h>
+#endif
+
 #include "Client.h"
+#include "Session.h"
 #include "xmpp.h"
 
 #define SUPPORT_RFC_3921
@@ -21,13 +29,84 @@ public:
 	CMessage GetMessage() const { return m_Message; }
 };
 
-CXMPPClient::CXMPPClient(CModule *pModule) : CXMPPSocket(pModule) {
+#ifdef HAVE_PTHREAD
+/* Password hashing is slow on purpose, so it is kept off the event loop.
+ * The CUser belongs to the main thread, so everything CUser::CheckPass
+ * reads is copied here and the same comparison is made on the thread. */
+class CXMPPAuthJob : public CModuleJob {
+public:
+	CXMPPAuthJob(CModule *pModule, CXMPPClient *pClient, CUser *pUser, const CString &sPassword)
+		: CModuleJob(pModule, "CXMPPAuth", "Checks an XMPP client's password") {
+		m_pClient = pClient;
+		m_sPassword = sPassword;
+		m_sHash = pUser->GetPass();
+		m_sSalt = pUser->GetPassSalt();
+		m_eHashType = pUser->GetPassHashType();
+		m_bModuleOnly = pUser->AuthOnlyViaModule() || CZNC::Get().GetAuthOnlyViaModule();
+		m_bSuccess = false;
+	}
+
+	virtual void runThread() override {
+		if (m_bModuleOnly) {
+			return;
+		}
+
+		switch (m_eHashType) {
+			case CUser::HASH_MD5:
+				m_bSuccess = m_sHash.Equals(CUtils::SaltedMD5Hash(m_sPassword, m_sSalt));
+				break;
+			case CUser::HASH_SHA256:
+				m_bSuccess = m_sHash.Equals(CUtils::SaltedSHA256Hash(m_sPassword, m_sSalt));
+				break;
+#if ZNC_HAVE_ARGON
+			case CUser::HASH_ARGON2ID:
+				m_bSuccess = argon2id_verify(m_sHash.c_str(), m_sPassword.data(), m_sPassword.length()) == ARGON2_OK;
+				break;
+#endif
+			case CUser::HASH_NONE:
+			default:
+				m_bSuccess = (m_sPassword == m_sHash);
+				break;
+		}
+	}
+
+	virtual void runMain() override {
+		/* A client going away, or its user being deleted, cancels the job first */
+		m_pClient->PasswordChecked(m_bSuccess);
+	}
+
+protected:
+	CXMPPClient *m_pClient;
+	CString m_sPassword;
+	CString m_sHash;
+	CString m_sSalt;
+	CUser::eHashType m_eHashType;
+	bool m_bModuleOnly;
+	bool m_bSuccess;
+};
+#endif
+
+CXMPPClient::CXMPPClient(CModule *pModule) : CXMPPSocket(pModule), m_Channels(GetModule()->GetChannelKeys()) {
 	m_pUser = NULL;
+	m_uiPriority = 0;
+	m_bInactive = false;
+	m_pSession = NULL;
+
+	m_pAuthJob = NULL;
+	m_pAuthStanza = NULL;
+	m_pAuthUser = NULL;
+	m_pAuthResult = NULL;
 
 	GetModule()->ClientConnected(*this);
 }
 
 CXMPPClient::~CXMPPClient() {
+	CancelAuth();
+
+	if (m_pSession) {
+		GetModule()->DetachSession(*this, *m_pSession);
+	}
+
 	GetModule()->ClientDisconnected(*this);
 }
 
@@ -47,6 +126,20 @@ CString CXMPPClient::GetJID() const {
 	return sResult;
 }
 
+void CXMPPClient::AddChannel(const CXMPPJID &jid, CChan *pChan, int historyMaxStanzas) {
+	CXMPPChannelKey Channel = m_Channels.Add(CXMPPChannel(jid, pChan, historyMaxStanzas));
+	if (Channel) {
+		GetModule()->ClientJoinedChannel(*this, Channel);
+	}
+}
+
+void CXMPPClient::RemoveChannel(const CString &sChannel) {
+	CXMPPChannelKey Channel = m_Channels.Remove(sChannel);
+	if (Channel) {
+		GetModule()->ClientPartedChannel(*this, Channel);
+	}
+}
+
 bool CXMPPClient::Write(CString sData) {
 	return CXMPPSocket::Write(sData);
 }
@@ -55,14 +148,18 @@ bool CXMPPClient::Write(const CXMPPStanza& Stanza) {
 	return CXMPPSocket::Write(Stanza);
 }
 
+bool CXMPPClient::Write(const CXMPPSerializedStanza& Stanza, const CString &sTo, const CString &sFrom, const CString &sId) {
+	return CXMPPSocket::Write(Stanza, sTo, sFrom, sId);
+}
+
 bool CXMPPClient::Write(CXMPPStanza &Stanza, const CXMPPStanza *pStanza) {
-	if (!Stanza.HasAttribute("to") && m_pUser) {
-		Stanza.SetAttribute("to", GetJID());
+	if (!Stanza.HasAttribute(CXMPPAtom::To) && m_pUser) {
+		Stanza.SetAttribute(CXMPPAtom::To, GetJID());
 	}
-	if (!Stanza.HasAttribute("id") && pStanza && pStanza->HasAttribute("id")) {
-		Stanza.SetAttribute("id", pStanza->GetAttribute("id"));
+	if (!Stanza.HasAttribute(CXMPPAtom::Id) && pStanza && pStanza->HasAttribute(CXMPPAtom::Id)) {
+		Stanza.SetAttribute(CXMPPAtom::Id, pStanza->GetAttribute(CXMPPAtom::Id));
 	}
-	return Write(Stanza.ToString());
+	return CXMPPSocket::Write(Stanza);
 }
 
 void CXMPPClient::Error(const CString &tag, const CString &type, const CString &code, const CXMPPStanza *pStanza, const CString &text) {
@@ -88,42 +185,241 @@ void CXMPPClient::Error(const CString &tag, const CString &type, const CString &
 }
 
 void CXMPPClient::Presence(const CXMPPJID &from, const CString &type, const CString &status,  const CXMPPStanza *pStanza) {
-	CXMPPStanza presence("presence");
-	presence.SetAttribute("id", "znc_" + CString::RandomString(8));
-	presence.SetAttribute("from", from.ToString());
-	if (!type.empty())
-		presence.SetAttribute("type", type);
-	if (!status.empty())
-		presence.NewChild("status").NewChild().SetText(status);
-	/* Hash stolen from iChat vCard update */
-	presence.NewChild("x", "vcard-temp:x:update").NewChild("photo").NewChild().SetText("341f80f531fbce7a0441b5983e2ebf9fa84868d0");
+	CXMPPStanza presence(CXMPPAtom::Presence);
+	GetModule()->BuildPresence(presence, from, type, status);
+
+	if (!pStanza && HoldPresence(presence, from.ToString())) {
+		return;
+	}
 
 	Write(presence, pStanza);
 }
 
 void CXMPPClient::ChannelPresence(const CXMPPJID &from, const CXMPPJID &jid, const CString &type, const CString &status, const std::vector<CString> &codes,  const CXMPPStanza *pStanza) {
-	CXMPPStanza presence("presence");
-	presence.SetAttribute("id", "znc_" + CString::RandomString(8));
-	presence.SetAttribute("from", from.ToString());
-	if (!type.empty())
-		presence.SetAttribute("type", type);
-	if (!status.empty())
-		presence.NewChild("status").NewChild().SetText(status);
-	CXMPPStanza &x = presence.NewChild("x", "http://jabber.org/protocol/muc#user");
-	CXMPPStanza &item = x.NewChild("item");
-	// TODO: check permissions
-	if (!jid.Equals(GetJID()))
-		item.SetAttribute("jid", jid.ToString());
-	item.SetAttribute("affiliation", "member");
-	item.SetAttribute("role", "participant");
-	for (const auto& it : codes) {
-		presence.NewChild("status").SetAttribute("code", it);
+	CXMPPStanza presence(CXMPPAtom::Presence);
+	GetModule()->BuildChannelPresence(presence, from, jid, GetJID(), type, status, codes);
+
+	if (!pStanza && HoldPresence(presence, from.ToString())) {
+		return;
 	}
 
 	Write(presence, pStanza);
 }
 
+bool CXMPPClient::HoldPresence(CXMPPStanza &Presence, const CString &sFrom) {
+	if (!m_bInactive) {
+		return false;
+	}
+
+	if (!Presence.HasAttribute(CXMPPAtom::To)) {
+		Presence.SetAttribute(CXMPPAtom::To, GetJID());
+	}
+
+	CString sPresence;
+	Presence.Serialize(sPresence);
+
+	/* A newer presence replaces the held one, keeping its place */
+	std::unordered_map<CString, size_t, std::hash<std::string>>::const_iterator it = m_mHeldPresenceIndex.find(sFrom);
+	if (it != m_mHeldPresenceIndex.end()) {
+		m_vHeldPresence[it->second] = sPresence;
+	} else {
+		m_mHeldPresenceIndex[sFrom] = m_vHeldPresence.size();
+		m_vHeldPresence.push_back(sPresence);
+	}
+
+	return true;
+}
+
+void CXMPPClient::ReleasePresence() {
+	CXMPPWriteBatch batch(*this);
+
+	for (const CString &sPresence : m_vHeldPresence) {
+		CXMPPSocket::Write(sPresence, true);
+	}
+
+	m_vHeldPresence.clear();
+	m_mHeldPresenceIndex.clear();
+}
+
+/* Client State Indication: https://xmpp.org/extensions/xep-0352.html */
+void CXMPPClient::HandleActive(CXMPPStanza &Stanza) {
+	if (!Stanza.IsNamespace(CXMPPAtom::NSCSI)) {
+		return;
+	}
+
+	m_bInactive = false;
+	ReleasePresence();
+}
+
+void CXMPPClient::HandleInactive(CXMPPStanza &Stanza) {
+	if (!Stanza.IsNamespace(CXMPPAtom::NSCSI)) {
+		return;
+	}
+
+	m_bInactive = true;
+}
+
+/* Stream Management: https://xmpp.org/extensions/xep-0198.html */
+void CXMPPClient::SMFailed(const CString &sCondition) {
+	CXMPPStanza failed(CXMPPAtom::Failed, CXMPPAtom::NSSM);
+	failed.NewChild(sCondition, "urn:ietf:params:xml:ns:xmpp-stanzas");
+	Write(failed);
+}
+
+void CXMPPClient::Supersede() {
+	GetModule()->DetachSession(*this, *m_pSession);
+	m_pSession = NULL;
+
+	/* Deleting a socket from inside another's callback is not safe, so it
+	 * stays around closed until the manager reaps it, routed to by nothing */
+	GetModule()->UnindexClient(*this);
+	m_Channels.Clear();
+	m_sResource.clear();
+
+	Close(Csock::CLT_NOW);
+}
+
+void CXMPPClient::StanzaSent(const char *szData, size_t uSize) {
+	if (m_pSession) {
+		m_pSession->Sent(szData, uSize);
+	}
+}
+
+void CXMPPClient::RequestAck() {
+	if (!m_pSession || m_pSession->IsAckRequested() || m_pSession->GetUnacked().empty()) {
+		return;
+	}
+
+	m_pSession->SetAckRequested(true);
+	Write(CXMPPStanza(CXMPPAtom::AckRequest, CXMPPAtom::NSSM));
+}
+
+void CXMPPClient::HandleSMEnable(CXMPPStanza &Stanza) {
+	if (!Stanza.IsNamespace(CXMPPAtom::NSSM)) {
+		return;
+	}
+
+	if (m_pSession || m_sResource.empty()) {
+		/* Only once per stream, and only after binding */
+		SMFailed("unexpected-request");
+		return;
+	}
+
+	CString sResume = Stanza.GetAttribute(CXMPPAtom::Resume);
+	m_pSession = GetModule()->CreateSession(*this, sResume.Equals("true") || sResume.Equals("1"));
+
+	CXMPPStanza enabled(CXMPPAtom::Enabled, CXMPPAtom::NSSM);
+	if (m_pSession->IsResumable()) {
+		enabled.SetAttribute(CXMPPAtom::Id, m_pSession->GetId());
+		enabled.SetAttribute(CXMPPAtom::Resume, "true");
+		enabled.SetAttribute(CXMPPAtom::Max, CString(GetModule()->GetSessionTimeout()));
+	}
+
+	Write(enabled);
+	XMPPTRACE(this, XMPP_TRACE_ROUTING, "stream management enabled" << (m_pSession->IsResumable() ? " with resumption" : ""));
+}
+
+void CXMPPClient::HandleSMResume(CXMPPStanza &Stanza) {
+	if (!Stanza.IsNamespace(CXMPPAtom::NSSM)) {
+		return;
+	}
+
+	if (m_pSession || !m_sResource.empty()) {
+		/* Resuming takes the place of binding */
+		SMFailed("unexpected-request");
+		return;
+	}
+
+	CString sId = Stanza.GetAttribute(CXMPPAtom::PrevId);
+	unsigned int uiHandled = Stanza.GetAttribute(CXMPPAtom::Handled).ToUInt();
+
+	CXMPPSession *pSession = GetModule()->FindSession(sId);
+	if (!pSession || pSession->GetUser() != m_pUser || !pSession->IsResumable() || !pSession->IsHeldSince(uiHandled)) {
+		XMPPTRACE(this, XMPP_TRACE_ROUTING, "cannot resume session [" << sId << "]");
+		SMFailed("item-not-found");
+		return;
+	}
+
+	CXMPPClient *pOld = pSession->GetClient();
+	if (pOld) {
+		/* The old connection is gone, we just have not noticed yet */
+		pOld->Supersede();
+	}
+
+	/* The old connection is unindexed, but skipped anyway until the manager deletes it */
+	CXMPPClient *pBound = GetModule()->Client(*m_pUser, pSession->GetResource());
+	if (pBound && pBound != pOld) {
+		/* Someone bound the resource in the meantime */
+		SMFailed("item-not-found");
+		return;
+	}
+
+	std::vector<CXMPPChannel> vChannels = pSession->GetChannels();
+
+	m_pSession = pSession;
+	m_sResource = pSession->GetResource();
+	GetModule()->ResumeSession(*this, *pSession);
+	pSession->Acknowledge(uiHandled);
+
+	/* Channels may have gone away while we were detached */
+	for (CXMPPChannel &channel : vChannels) {
+		CXMPPJID jid = channel.GetJID();
+		CIRCNetwork *network = m_pUser->FindNetwork(jid.GetIRCNetwork());
+		CChan *pChan = network ? network->FindChan(jid.GetIRCChannel()) : NULL;
+
+		if (pChan) {
+			AddChannel(jid, pChan, channel.GetHistoryMaxStanzas());
+		}
+	}
+
+	CXMPPStanza resumed(CXMPPAtom::Resumed, CXMPPAtom::NSSM);
+	resumed.SetAttribute(CXMPPAtom::Handled, CString(pSession->GetReceived()));
+	resumed.SetAttribute(CXMPPAtom::PrevId, sId);
+	Write(resumed);
+
+	/* Resent as they are, they were counted when first sent or held while detached */
+	for (const CString &sStanza : pSession->GetUnacked()) {
+		Write(sStanza);
+	}
+
+	XMPPTRACE(this, XMPP_TRACE_ROUTING, "resumed session [" << sId << "] as " << GetJID() << ", resent " << pSession->GetUnacked().size() << " stanzas");
+}
+
+void CXMPPClient::HandleSMRequest(CXMPPStanza &Stanza) {
+	if (!Stanza.IsNamespace(CXMPPAtom::NSSM) || !m_pSession) {
+		return;
+	}
+
+	CXMPPStanza answer(CXMPPAtom::AckAnswer, CXMPPAtom::NSSM);
+	answer.SetAttribute(CXMPPAtom::Handled, CString(m_pSession->GetReceived()));
+	Write(answer);
+}
+
+void CXMPPClient::HandleSMAnswer(CXMPPStanza &Stanza) {
+	if (!Stanza.IsNamespace(CXMPPAtom::NSSM) || !m_pSession) {
+		return;
+	}
+
+	unsigned int uiHandled = Stanza.GetAttribute(CXMPPAtom::Handled).ToUInt();
+	m_pSession->SetAckRequested(false);
+
+	if (!m_pSession->Acknowledge(uiHandled)) {
+		CXMPPStanza error(CXMPPAtom::StreamError);
+		error.NewChild("undefined-condition", "urn:ietf:params:xml:ns:xmpp-streams");
+		CXMPPStanza &count = error.NewChild("handled-count-too-high", "urn:xmpp:sm:3");
+		count.SetAttribute(CXMPPAtom::Handled, CString(uiHandled));
+		count.SetAttribute("send-count", CString(m_pSession->GetSent()));
+		Write(error);
+
+		Write("</stream:stream>");
+		Flush();
+		Close(Csock::CLT_AFTERWRITE);
+	}
+}
+
 void CXMPPClient::StreamStart(CXMPPStanza &Stanza) {
+	CXMPPWriteBatch batch(*this);
+
 	Write("<?xml version='1.0' ?>");
 	Write("<stream:stream from='" + GetServerName() + "' version='1.0' xml:lang='en' xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>");
 
@@ -135,6 +431,7 @@ void CXMPPClient::StreamStart(CXMPPStanza &Stanza) {
 		Write(error);
 
 		Write("</stream:stream>");
+		Flush();
 		Close(Csock::CLT_AFTERWRITE);
 		return;
 	}
@@ -150,6 +447,13 @@ void CXMPPClient::StreamStart(CXMPPStanza &Stanza) {
 
 	if (m_pUser) {
 		features.NewChild("bind", "urn:ietf:params:xml:ns:xmpp-bind");
+		features.NewChild(CXMPPAtom::CSI, CXMPPAtom::NSCSI);
+		features.NewChild(CXMPPAtom::SM, CXMPPAtom::NSSM);
+
+		if (!IsCompressed() && GetModule()->GetCompressionLimits().bEnabled) {
+			CXMPPStanza &compression = features.NewChild(CXMPPAtom::Compression, CXMPPAtom::NSCompressFeature);
+			compression.NewChild(CXMPPAtom::Method).NewChild().SetText("zlib");
+		}
 	} else if (!((CXMPPModule*)m_pModule)->IsTLSAvailible() || GetSSL()) {
 		CXMPPStanza& mechanisms = features.NewChild("mechanisms", "urn:ietf:params:xml:ns:xmpp-sasl");
 
@@ -162,737 +466,1094 @@ void CXMPPClient::StreamStart(CXMPPStanza &Stanza) {
 	Write(features);
 }
 
+void CXMPPClient::StreamEnd() {
+	/* A cleanly closed stream is not resumable */
+	if (m_pSession) {
+		GetModule()->DeleteSession(m_pSession);
+		m_pSession = NULL;
+	}
+
+	CXMPPSocket::StreamEnd();
+}
+
 void AddDelay(CXMPPStanza &in, CString from, timeval t) {
-	CXMPPStanza &delay = in.NewChild("delay", "urn:xmpp:delay");
-	delay.SetAttribute("from", from);
-	delay.SetAttribute("stamp", CUtils::FormatTime(t, "%Y-%m-%dT%H:%M:%SZ", "UTC"));
-	CXMPPStanza &x = in.NewChild("x", "jabber:x:delay");
-	x.SetAttribute("from", from);
-	x.SetAttribute("stamp", CUtils::FormatTime(t, "%Y%m%dT%H:%M:%S", "UTC"));
+	CXMPPStanza &delay = in.NewChild(CXMPPAtom::Delay, CXMPPAtom::NSDelay);
+	delay.SetAttribute(CXMPPAtom::From, from);
+	delay.SetAttribute(CXMPPAtom::Stamp, CUtils::FormatTime(t, "%Y-%m-%dT%H:%M:%SZ", "UTC"));
+	CXMPPStanza &x = in.NewChild(CXMPPAtom::XElement, CXMPPAtom::NSXDelay);
+	x.SetAttribute(CXMPPAtom::From, from);
+	x.SetAttribute(CXMPPAtom::Stamp, CUtils::FormatTime(t, "%Y%m%dT%H:%M:%S", "UTC"));
 }
 
 void AddDelay(CXMPPStanza &in, CString from, time_t t) {
 	AddDelay(in, from, timeval{.tv_sec = t});
 }
 
+/*
+ * Stanza handlers are looked up by (element name, payload namespace, type),
+ * falling back to the element name alone. Supporting another XEP only needs
+ * a new entry in this table.
+ */
+struct SStanzaHandlerKey {
+	const CXMPPAtom *pName;
+	const CXMPPAtom *pNamespace;
+	const CXMPPAtom *pType;
+
+	bool operator==(const SStanzaHandlerKey &other) const {
+		return pName == other.pName && pNamespace == other.pNamespace && pType == other.pType;
+	}
+};
+
+struct SStanzaHandlerKeyHash {
+	size_t operator()(const SStanzaHandlerKey &key) const {
+		std::hash<const CXMPPAtom*> hash;
+		return hash(key.pName) ^ (hash(key.pNamespace) * 31) ^ (hash(key.pType) * 131);
+	}
+};
+
+struct SStanzaHandler {
+	void (CXMPPClient::*pHandler)(CXMPPStanza &Stanza);
+	bool bRequiresAuth;
+};
+
+typedef std::unordered_map<SStanzaHandlerKey, SStanzaHandler, SStanzaHandlerKeyHash> TStanzaHandlers;
+
+struct SStanzaHandlerTable {
+	static const TStanzaHandlers& Get();
+};
+
+const TStanzaHandlers& SStanzaHandlerTable::Get() {
+	static const TStanzaHandlers handlers = {
+		/* Stream negotiation */
+		{{CXMPPAtom::Auth, NULL, NULL}, {&CXMPPClient::HandleSASLAuth, false}},
+		{{CXMPPAtom::StartTLS, NULL, NULL}, {&CXMPPClient::HandleStartTLS, false}},
+		{{CXMPPAtom::Compress, NULL, NULL}, {&CXMPPClient::HandleCompress, true}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSIQAuth, CXMPPAtom::Get}, {&CXMPPClient::HandleIQAuthGet, false}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSIQAuth, CXMPPAtom::Set}, {&CXMPPClient::HandleIQAuthSet, false}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSBind, CXMPPAtom::Set}, {&CXMPPClient::HandleBind, true}},
+#ifdef SUPPORT_RFC_3921
+		{{CXMPPAtom::IQ, CXMPPAtom::NSSession, CXMPPAtom::Set}, {&CXMPPClient::HandleSession, true}},
+#endif
+
+		/* Queries */
+		{{CXMPPAtom::IQ, CXMPPAtom::NSPing, CXMPPAtom::Get}, {&CXMPPClient::HandlePing, true}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSDiscoItems, CXMPPAtom::Get}, {&CXMPPClient::HandleDiscoItems, true}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSDiscoInfo, CXMPPAtom::Get}, {&CXMPPClient::HandleDiscoInfo, true}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSRoster, CXMPPAtom::Get}, {&CXMPPClient::HandleRoster, true}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSVCard, CXMPPAtom::Get}, {&CXMPPClient::HandleVCardGet, true}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSVCard, CXMPPAtom::Set}, {&CXMPPClient::HandleVCardSet, true}},
+		{{CXMPPAtom::IQ, CXMPPAtom::NSMAM, CXMPPAtom::Set}, {&CXMPPClient::HandleMAMQuery, true}},
+		{{CXMPPAtom::IQ, NULL, NULL}, {&CXMPPClient::HandleUnsupportedIQ, true}},
+
+		/* Routing */
+		{{CXMPPAtom::Message, NULL, NULL}, {&CXMPPClient::HandleMessage, true}},
+		{{CXMPPAtom::Presence, NULL, NULL}, {&CXMPPClient::HandlePresence, true}},
+
+		/* Client state */
+		{{CXMPPAtom::Active, NULL, NULL}, {&CXMPPClient::HandleActive, true}},
+		{{CXMPPAtom::Inactive, NULL, NULL}, {&CXMPPClient::HandleInactive, true}},
+
+		/* Stream management */
+		{{CXMPPAtom::Enable, NULL, NULL}, {&CXMPPClient::HandleSMEnable, true}},
+		{{CXMPPAtom::Resume, NULL, NULL}, {&CXMPPClient::HandleSMResume, true}},
+		{{CXMPPAtom::AckRequest, NULL, NULL}, {&CXMPPClient::HandleSMRequest, true}},
+		{{CXMPPAtom::AckAnswer, NULL, NULL}, {&CXMPPClient::HandleSMAnswer, true}},
+	};
+
+	return handlers;
+}
+
 void CXMPPClient::ReceiveStanza(CXMPPStanza &Stanza) {
-	if (Stanza.GetName().Equals("auth")) {
-		if (Stanza.GetAttribute("mechanism").Equals("plain")) {
-			CString sSASL;
-			CXMPPStanza *pStanza = Stanza.GetTextChild();
-
-			if (pStanza)
-				sSASL = pStanza->GetText().Base64Decode_n();
-
-			const char *sasl = sSASL.c_str();
-			unsigned int y = 0;
-			for (unsigned int x = 0; x < sSASL.size(); x++) {
-				if (sasl[x] == 0) {
-					y++;
-				}
-			}
+	if (m_pAuthStanza) {
+		/* Parsed along with the stanza whose password is being checked */
+		m_dpDeferred.push_back(Stanza.Clone());
+		return;
+	}
 
-			CString sUsername = "unknown";
+	const TStanzaHandlers &handlers = SStanzaHandlerTable::Get();
+	/* Whatever a handler writes goes out in one piece when it returns */
+	CXMPPWriteBatch batch(*this);
 
-			if (y > 1) {
-				const char *username = &sasl[strlen(sasl) + 1];
-				const char *password = &username[strlen(username) + 1];
-				sUsername = username;
+	if (m_pSession && (Stanza.IsName(CXMPPAtom::Message) || Stanza.IsName(CXMPPAtom::Presence) || Stanza.IsName(CXMPPAtom::IQ))) {
+		m_pSession->Received();
+	}
+
+	SStanzaHandlerKey key = {Stanza.GetNameAtom(), NULL, NULL};
+	TStanzaHandlers::const_iterator it = handlers.end();
 
-				CUser *pUser = CZNC::Get().FindUser(sUsername);
+	const CXMPPAtom *pType = Stanza.GetAttributeAtom(CXMPPAtom::Type);
 
-				if (pUser && pUser->CheckPass(password)) {
-					Write(CXMPPStanza("success", "urn:ietf:params:xml:ns:xmpp-sasl"));
+	if (pType) {
+		/* The namespace of the payload decides between iq handlers */
+		CXMPPStanza *pPayload = Stanza.GetFirstChild();
+		while (pPayload && !pPayload->IsTag()) {
+			pPayload = pPayload->GetNextSibling();
+		}
 
-					m_pUser = pUser;
-					DEBUG("XMPPClient SASL::PLAIN for [" << sUsername << "] success.");
+		if (pPayload) {
+			SStanzaHandlerKey specific = {key.pName, pPayload->GetNamespace(), pType};
+			it = handlers.find(specific);
+		}
+	}
 
-					/* Restart the stream */
-					m_bResetParser = true;
+	if (it == handlers.end()) {
+		it = handlers.find(key);
+	}
 
-					return;
-				}
+	XMPPTRACE(this, XMPP_TRACE_ROUTING, "dispatch [" << Stanza.GetName() << "] " << (it != handlers.end() ? "handled" : "unhandled"));
+
+	if (it != handlers.end() && (m_pUser || !it->second.bRequiresAuth)) {
+		if (it->second.bRequiresAuth) {
+			Stanza.SetAttribute(CXMPPAtom::From, GetJID());
+		}
+
+		(this->*it->second.pHandler)(Stanza);
+		return;
+	}
+
+	if (!m_pUser) {
+		Error("forbidden", "auth", "403", &Stanza);
+		return; /* everything else requires auth */
+	}
+
+	XMPPTRACE(this, XMPP_TRACE_ROUTING, "unsupported stanza [" << Stanza.GetName() << "]");
+}
+
+void CXMPPClient::HandleSASLAuth(CXMPPStanza &Stanza) {
+	if (Stanza.GetAttribute("mechanism").Equals("plain")) {
+		CString sSASL;
+		CXMPPStanza *pStanza = Stanza.GetTextChild();
+
+		if (pStanza)
+			sSASL = pStanza->GetText().Base64Decode_n();
+
+		const char *sasl = sSASL.c_str();
+		unsigned int y = 0;
+		for (unsigned int x = 0; x < sSASL.size(); x++) {
+			if (sasl[x] == 0) {
+				y++;
 			}
+		}
 
-			DEBUG("XMPPClient SASL::PLAIN for [" << sUsername << "] failed.");
+		CString sUsername = "unknown";
 
-			CXMPPStanza failure("failure", "urn:ietf:params:xml:ns:xmpp-sasl");
-			failure.NewChild("not-authorized");
-			Write(failure);
+		if (y > 1) {
+			const char *username = &sasl[strlen(sasl) + 1];
+			const char *password = &username[strlen(username) + 1];
+			sUsername = username;
+
+			CUser *pUser = CZNC::Get().FindUser(sUsername);
+
+			CheckPassword(Stanza, pUser, password, &CXMPPClient::SASLAuthResult);
 			return;
 		}
 
-		CXMPPStanza failure("failure", "urn:ietf:params:xml:ns:xmpp-sasl");
-		failure.NewChild("invalid-mechanism");
-		Write(failure);
+		SASLAuthResult(Stanza, NULL, false);
 		return;
-	} else if (Stanza.GetName().Equals("iq")) {
-		/* Non-SASL Authentication: https://xmpp.org/extensions/xep-0078.html */
-		CXMPPStanza iq("iq");
-		iq.SetAttribute("id", Stanza.GetAttribute("id"));
+	}
 
-		CXMPPStanza *pQuery = Stanza.GetChildByName("query");
-		if (pQuery && pQuery->GetAttribute("xmlns").Equals("jabber:iq:auth")) {
-			if (Stanza.GetAttribute("type").Equals("get")) {
-				iq.SetAttribute("type", "result");
-				CXMPPStanza &query = iq.NewChild("query", "jabber:iq:auth");
-				query.NewChild("username");
-				query.NewChild("password");
-				query.NewChild("resource");
-				Write(iq);
-				return;
-			} else if (Stanza.GetAttribute("type").Equals("set")) {
-				CXMPPStanza *pUsername = pQuery->GetChildByName("username");
-				CXMPPStanza *pPassword = pQuery->GetChildByName("password");
-				CXMPPStanza *pResource = pQuery->GetChildByName("resource");
-
-				if (pUsername && pPassword) {
-					pUsername = pUsername->GetTextChild();
-					pPassword = pPassword->GetTextChild();
-					pResource = pResource->GetTextChild();
-				}
+	CXMPPStanza failure("failure", "urn:ietf:params:xml:ns:xmpp-sasl");
+	failure.NewChild("invalid-mechanism");
+	Write(failure);
+}
 
-				CString sUsername = "unknown";
+void CXMPPClient::SASLAuthResult(CXMPPStanza &Stanza, CUser *pUser, bool bSuccess) {
+	if (bSuccess) {
+		Write(CXMPPStanza("success", "urn:ietf:params:xml:ns:xmpp-sasl"));
 
-				if (pUsername && pPassword) {
-					sUsername = pUsername->GetText();
-					CString sPassword = pPassword->GetText();
+		m_pUser = pUser;
+		GetModule()->ClientAuthenticated(*this);
+		XMPPTRACE(this, XMPP_TRACE_AUTH, "SASL::PLAIN for [" << pUser->GetUserName() << "] success.");
 
-					CUser *pUser = CZNC::Get().FindUser(sUsername);
+		/* Restart the stream */
+		m_bResetParser = true;
 
-					if (pUser && pUser->CheckPass(sPassword)) {
-						iq.SetAttribute("type", "result");
-						Write(iq);
+		return;
+	}
 
-						m_pUser = pUser;
-						if (pResource) {
-							m_sResource = pResource->GetText();
-						}
-						DEBUG("XMPPClient jabber:iq:auth for [" << sUsername << "] success.");
+	XMPPTRACE(this, XMPP_TRACE_AUTH, "SASL::PLAIN for [" << (pUser ? pUser->GetUserName() : CString("unknown")) << "] failed.");
 
-						return;
-					}
+	CXMPPStanza failure("failure", "urn:ietf:params:xml:ns:xmpp-sasl");
+	failure.NewChild("not-authorized");
+	Write(failure);
+}
 
-					DEBUG("XMPPClient jabber:iq:auth for [" << sUsername << "] failed: incorrect credentials.");
+void CXMPPClient::CheckPassword(CXMPPStanza &Stanza, CUser *pUser, const CString &sPassword, TAuthResult pResult) {
+#ifdef HAVE_PTHREAD
+	if (pUser) {
+		m_pAuthStanza = Stanza.Clone();
+		m_pAuthUser = pUser;
+		m_pAuthResult = pResult;
+		m_pAuthJob = new CXMPPAuthJob(GetModule(), this, pUser, sPassword);
 
-					/* Incorrect Credentials */
-					Error("not-authorized", "auth", "401", &Stanza);
-					return;
-				}
+		PauseRead();
+		GetModule()->AddJob(m_pAuthJob);
+		return;
+	}
+#endif
 
-				DEBUG("XMPPClient jabber:iq:auth for [" << sUsername << "] failed: required information not provided.");
+	(this->*pResult)(Stanza, pUser, pUser && pUser->CheckPass(sPassword));
+}
 
-				/* Required Information Not Provided */
-				Error("not-acceptable", "modify", "406", &Stanza);
-				return;
-			}
-		}
-		/* Other iq stanzas are handled further down */
-	} else if (Stanza.GetName().Equals("starttls")) {
+void CXMPPClient::PasswordChecked(bool bSuccess) {
+	CXMPPStanza *pStanza = m_pAuthStanza;
+	CUser *pUser = m_pAuthUser;
+
+	/* The job is deleted once this returns */
+	m_pAuthJob = NULL;
+	m_pAuthStanza = NULL;
+	m_pAuthUser = NULL;
+
+	{
+		CXMPPWriteBatch batch(*this);
+		(this->*m_pAuthResult)(*pStanza, pUser, bSuccess);
+	}
+	delete pStanza;
+
+	/* Catch up on what arrived meanwhile, unless it starts another check */
+	while (!m_pAuthStanza && !m_dpDeferred.empty() && !IsClosed()) {
+		CXMPPStanza *pDeferred = m_dpDeferred.front();
+		m_dpDeferred.pop_front();
+
+		ReceiveStanza(*pDeferred);
+		delete pDeferred;
+	}
+
+	if (!m_pAuthStanza) {
+		UnPauseRead();
+	}
+}
+
+void CXMPPClient::CancelAuth() {
+#ifdef HAVE_PTHREAD
+	if (m_pAuthJob) {
+		GetModule()->CancelJob(m_pAuthJob);
+		m_pAuthJob = NULL;
+	}
+#endif
+
+	delete m_pAuthStanza;
+	m_pAuthStanza = NULL;
+	m_pAuthUser = NULL;
+
+	for (CXMPPStanza *pDeferred : m_dpDeferred) {
+		delete pDeferred;
+	}
+	m_dpDeferred.clear();
+}
+
+void CXMPPClient::HandleStartTLS(CXMPPStanza &Stanza) {
 #ifdef HAVE_LIBSSL
-		if (!GetSSL() && ((CXMPPModule*)m_pModule)->IsTLSAvailible()) {
-			Write(CXMPPStanza("proceed", "urn:ietf:params:xml:ns:xmpp-tls"));
+	if (!GetSSL() && ((CXMPPModule*)m_pModule)->IsTLSAvailible()) {
+		Write(CXMPPStanza("proceed", "urn:ietf:params:xml:ns:xmpp-tls"));
 
-			/* Restart the stream */
-			m_bResetParser = true;
+		/* Restart the stream */
+		m_bResetParser = true;
 
-			SetPemLocation(CZNC::Get().GetPemLocation());
-			StartTLS();
+		/* <proceed/> has to go out in the clear */
+		Flush();
 
-			return;
-		}
+		SetPemLocation(CZNC::Get().GetPemLocation());
+		StartTLS();
+
+		return;
+	}
 #endif
 
-		Write(CXMPPStanza("failure", "urn:ietf:params:xml:ns:xmpp-tls"));
-		Write("</stream:stream>");
-		Close(Csock::CLT_AFTERWRITE);
+	Write(CXMPPStanza("failure", "urn:ietf:params:xml:ns:xmpp-tls"));
+	Write("</stream:stream>");
+	Flush();
+	Close(Csock::CLT_AFTERWRITE);
+}
+
+/* Stream Compression: https://xmpp.org/extensions/xep-0138.html */
+void CXMPPClient::CompressFailed(const CString &sCondition) {
+	CXMPPStanza failure("failure", "http://jabber.org/protocol/compress");
+	failure.NewChild(sCondition);
+	Write(failure);
+}
+
+void CXMPPClient::HandleCompress(CXMPPStanza &Stanza) {
+	if (!Stanza.IsNamespace(CXMPPAtom::NSCompress)) {
 		return;
 	}
 
-	if (!m_pUser) {
-		Error("forbidden", "auth", "403", &Stanza);
-		return; /* the following stanzas require auth */
+	const SXMPPCompressionLimits &limits = GetModule()->GetCompressionLimits();
+	if (!limits.bEnabled || IsCompressed()) {
+		CompressFailed("setup-failed");
+		return;
 	}
 
-	Stanza.SetAttribute("from", GetJID());
+	CXMPPStanza *pMethod = Stanza.GetChildByName(CXMPPAtom::Method);
+	CXMPPStanza *pMethodText = pMethod ? pMethod->GetTextChild() : NULL;
+	if (!pMethodText || !pMethodText->GetText().Equals("zlib")) {
+		CompressFailed("unsupported-method");
+		return;
+	}
 
-	if (Stanza.GetName().Equals("iq")) {
-		CXMPPStanza iq("iq");
+	CXMPPCompression *pCompression = new CXMPPCompression();
+	if (!pCompression->Init(limits)) {
+		delete pCompression;
+		CompressFailed("setup-failed");
+		return;
+	}
 
-		if (Stanza.GetAttribute("type").Equals("get")) {
-			if (Stanza.GetChildByName("ping")) {
-				iq.SetAttribute("type", "result");
-			}
+	Write(CXMPPStanza(CXMPPAtom::Compressed, CXMPPAtom::NSCompress));
 
-			CXMPPStanza *pQuery = Stanza.GetChildByName("query");
-			if (pQuery) {
-				CXMPPJID to(Stanza.GetAttribute("to"));
-
-				/* Service Discovery: https://xmpp.org/extensions/xep-0030.html */
-				/* MUC: Discovering Rooms: https://xmpp.org/extensions/xep-0045.html#disco-rooms */
-				if (pQuery->GetAttribute("xmlns").Equals("http://jabber.org/protocol/disco#items")) {
-					if (Stanza.GetAttribute("to").Equals(GetServerName())) {
-						iq.SetAttribute("type", "result");
-						CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#items");
-
-						/* List directories as separate servers */
-						CXMPPStanza &item = query.NewChild("item");
-						item.SetAttribute("jid", "channels." + GetServerName());
-						item.SetAttribute("name", "Directory of IRC Channels");
-						item = query.NewChild("item");
-						item.SetAttribute("jid", "users." + GetServerName());
-						item.SetAttribute("name", "Directory of IRC Users");
-
-						Write(iq, &Stanza);
-						return;
-					}
+	/* Restart the stream, <compressed/> itself goes out in the clear */
+	m_bResetParser = true;
+	StartCompression(pCompression);
 
-					/* User Directory */
-					if (Stanza.GetAttribute("to").Equals("users." + GetServerName())) {
-						iq.SetAttribute("type", "result");
-						CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#items");
-
-						// Enumerate networks
-						const std::vector<CIRCNetwork*> &networks = m_pUser->GetNetworks();
-						for (const auto& network : networks) {
-							if (!network->IsIRCConnected())
-								continue;
-
-							// Enumerate channels
-							std::set<CString> unicks;
-							const std::vector<CChan*> &channels = network->GetChans();
-							for (const auto &channel : channels) {
-								if (!channel->IsOn())
-									continue;
-
-								const std::map<CString, CNick> &nicks = channel->GetNicks();
-								for (const auto &entry : nicks) {
-									unicks.insert(entry.second.GetNick());
-								}
-							}
-
-							// Present each unique nick on the network as a user
-							for (const auto &nick : unicks) {
-								// JID grammar: https://xmpp.org/extensions/xep-0029.html#sect-idm45406366945648
-								CString jid = nick + "!" + network->GetName() + "+irc@" + GetServerName();
-								CString name = nick + " on " + network->GetName();
-
-								CXMPPStanza &item = query.NewChild("item");
-								item.SetAttribute("jid", jid);
-								item.SetAttribute("name", name);
-							}
-						}
-
-						Write(iq, &Stanza);
-						return;
-					}
+	XMPPTRACE(this, XMPP_TRACE_ROUTING, "stream compression started");
+}
 
-					/* Channel Directory */
-					if (Stanza.GetAttribute("to").Equals("channels." + GetServerName())) {
-						iq.SetAttribute("type", "result");
-						CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#items");
-
-						// Enumerate networks
-						const std::vector<CIRCNetwork*> &networks = m_pUser->GetNetworks();
-						for (const auto& network : networks) {
-							if (!network->IsIRCConnected())
-								continue;
-
-							// Enumerate channels
-							const std::vector<CChan*> &channels = network->GetChans();
-							for (const auto &channel : channels) {
-								if (!channel->IsOn())
-									continue;
-
-								// Present each channel as a room
-								// JID grammar: https://xmpp.org/extensions/xep-0029.html#sect-idm45406366945648
-								CString jid = channel->GetName() + "!" + network->GetName() + "+irc@" + GetServerName();
-								CString name = channel->GetName() + " on " + network->GetName();
-
-								CXMPPStanza &item = query.NewChild("item");
-								item.SetAttribute("jid", jid);
-								item.SetAttribute("name", name);
-							}
-						}
-
-						Write(iq, &Stanza);
-						return;
-					}
+/* Non-SASL Authentication: https://xmpp.org/extensions/xep-0078.html */
+void CXMPPClient::HandleIQAuthGet(CXMPPStanza &Stanza) {
+	CXMPPStanza iq("iq");
+	iq.SetAttribute("id", Stanza.GetAttribute("id"));
+	iq.SetAttribute("type", "result");
+
+	CXMPPStanza &query = iq.NewChild("query", "jabber:iq:auth");
+	query.NewChild("username");
+	query.NewChild("password");
+	query.NewChild("resource");
+	Write(iq);
+}
 
-				}
+void CXMPPClient::HandleIQAuthSet(CXMPPStanza &Stanza) {
+	CXMPPStanza *pQuery = Stanza.GetChildByName("query");
+	if (!pQuery) {
+		HandleUnsupportedIQ(Stanza);
+		return;
+	}
 
-				if (pQuery->GetAttribute("xmlns").Equals("http://jabber.org/protocol/disco#info")) {
-					if (Stanza.GetAttribute("to").Equals(GetServerName())) {
-						iq.SetAttribute("type", "result");
-						CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#info");
-						/* XMPP Server */
-						CXMPPStanza &identity1 = query.NewChild("identity");
-						identity1.SetAttribute("category", "server");
-						identity1.SetAttribute("type", "im");
-						identity1.SetAttribute("name", "XMPP ZNC Module");
-						/* IRC Gateway */
-						CXMPPStanza identity2 = query.NewChild("identity");
-						identity2.SetAttribute("category", "gateway");
-						identity2.SetAttribute("type", "irc");
-						identity2.SetAttribute("name", "XMPP ZNC Module");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/disco#info");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/disco#items");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/muc");
-						query.NewChild("feature").SetAttribute("var", "vcard-temp");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:search");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:time");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:version");
-
-						Write(iq, &Stanza);
-						return;
-					}
+	CXMPPStanza *pUsername = pQuery->GetChildByName("username");
+	CXMPPStanza *pPassword = pQuery->GetChildByName("password");
 
-					/* User Directory */
-					if (Stanza.GetAttribute("to").Equals("users." + GetServerName())) {
-						iq.SetAttribute("type", "result");
-						CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#info");
-						CXMPPStanza &identity = query.NewChild("identity");
-						identity.SetAttribute("category", "directory");
-						identity.SetAttribute("type", "user");
-						identity.SetAttribute("name", "IRC Users");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/disco#info");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/disco#items");
-						query.NewChild("feature").SetAttribute("var", "vcard-temp");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:search");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:time");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:version");
-
-						Write(iq, &Stanza);
-						return;
-					}
+	if (pUsername && pPassword) {
+		pUsername = pUsername->GetTextChild();
+		pPassword = pPassword->GetTextChild();
+	}
 
-					/* Chatroom Directory */
-					if (Stanza.GetAttribute("to").Equals("channels." + GetServerName())) {
-						iq.SetAttribute("type", "result");
-						CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#info");
-						CXMPPStanza &identity1 = query.NewChild("identity");
-						identity1.SetAttribute("category", "conference");
-						identity1.SetAttribute("type", "text");
-						identity1.SetAttribute("name", "IRC Channels");
-						CXMPPStanza &identity2 = query.NewChild("identity");
-						identity2.SetAttribute("category", "directory");
-						identity2.SetAttribute("type", "chatroom");
-						identity2.SetAttribute("name", "IRC Channels");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/disco#info");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/disco#items");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/muc");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:search");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:time");
-						query.NewChild("feature").SetAttribute("var", "jabber:iq:version");
-
-						Write(iq, &Stanza);
-						return;
-					}
+	CString sUsername = "unknown";
 
-					if (!to.IsLocal(*GetModule())) {
-						Error("item-not-found", "cancel", "404", &Stanza, "Unknown server");
-						return;
-					}
+	if (pUsername && pPassword) {
+		sUsername = pUsername->GetText();
+		CString sPassword = pPassword->GetText();
 
-					/* Info on a user */
-					if (to.IsIRCUser()) {
-						CIRCNetwork *network = m_pUser->FindNetwork(to.GetIRCNetwork());
-						if (!network) {
-							Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC network");
-							return;
-						}
-
-						/* Traverse all channels this client is connected to on this network to confirm the user exists */
-						const CNick *nick;
-						for (const auto &entry : GetChannels()) {
-							const CXMPPJID &jid = entry.second.GetJID();
-							const CChan *channel = entry.second.GetChannel();
-
-							if (!channel) {
-								Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC channel in network");
-								return;
-							}
-
-							const CString user = to.GetIRCUser();
-							nick = channel->FindNick(user);
-							if (nick)
-								break;
-						}
-						if (!nick) {
-							Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC nick " + to.GetIRCUser() + " in network " + to.GetIRCNetwork());
-							return;
-						}
-
-						iq.SetAttribute("type", "result");
-						CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#info");
-						CXMPPStanza &identity = query.NewChild("identity");
-						identity.SetAttribute("category", "account");
-						identity.SetAttribute("type", "registered");
-						identity = query.NewChild("identity");
-						identity.SetAttribute("category", "pubsub");
-						identity.SetAttribute("type", "pep");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/disco#info");
-						query.NewChild("feature").SetAttribute("var", "vcard-temp");
-						query.NewChild("feature").SetAttribute("var", "urn:xmpp:tmp:profile");
-						/* Personal Eventing Protocol: https://xmpp.org/extensions/xep-0163.html */
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#access-presence");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#auto-create");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#auto-subscribe");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#config-node");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#create-and-configure");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#create-nodes");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#filtered-notifications");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#persistent-items");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#publish");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#retrieve-items");
-						query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/pubsub#subscribe");
-
-						Write(iq, &Stanza);
-						return;
-					}
+		CUser *pUser = CZNC::Get().FindUser(sUsername);
 
-					/* MUC: Querying Room Information: https://xmpp.org/extensions/xep-0045.html#disco-roominfo */
-					if (to.IsIRCChannel()) {
-						CIRCNetwork *network = m_pUser->FindNetwork(to.GetIRCNetwork());
-						if (network) {
-							CChan *channel = network->FindChan(to.GetIRCChannel());
-							if (channel) {
-								iq.SetAttribute("type", "result");
-								CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#info");
-								CXMPPStanza &identity = query.NewChild("identity");
-								identity.SetAttribute("category", "conference");
-								identity.SetAttribute("type", "text");
-								identity.SetAttribute("name", channel->GetName() + " on " + network->GetName());
-								query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/muc");
-								query.NewChild("feature").SetAttribute("var", "muc_nonanonymous");
-								query.NewChild("feature").SetAttribute("var", "muc_open");
-								query.NewChild("feature").SetAttribute("var", "muc_persistent");
-								query.NewChild("feature").SetAttribute("var", "muc_public");
-
-								Write(iq, &Stanza);
-								return;
-							}
-						}
-					}
+		CheckPassword(Stanza, pUser, sPassword, &CXMPPClient::IQAuthResult);
+		return;
+	}
 
-					Error("item-not-found", "cancel", "404", &Stanza, "Unknown entity, not this server or an IRC channel or nick");
-					return;
-				}
+	XMPPTRACE(this, XMPP_TRACE_AUTH, "jabber:iq:auth for [" << sUsername << "] failed: required information not provided.");
 
-				/* Roster Get: https://xmpp.org/rfcs/rfc6121.html#roster-syntax-actions-get */
-				if (pQuery->GetAttribute("xmlns").Equals("jabber:iq:roster")) {
-					iq.SetAttribute("type", "result");
-					CXMPPStanza &query = iq.NewChild("query", "jabber:iq:roster");
-
-					// Enumerate networks
-					const std::vector<CIRCNetwork*> &networks = m_pUser->GetNetworks();
-					for (const auto &network : networks) {
-						if (!network->IsIRCConnected())
-							continue;
-
-						// Add yourself
-						CXMPPStanza &item = query.NewChild("item");
-						item.SetAttribute("subscription", "to");
-						item.SetAttribute("jid", network->GetCurNick() + "!" + network->GetName() + "+irc@" + GetServerName());
-						item.SetAttribute("name", m_pUser->GetRealName());
-						item.SetAttribute("group", network->GetName());
-					}
+	/* Required Information Not Provided */
+	Error("not-acceptable", "modify", "406", &Stanza);
+}
 
-					Write(iq, &Stanza);
-					return;
-				}
-			}
+void CXMPPClient::IQAuthResult(CXMPPStanza &Stanza, CUser *pUser, bool bSuccess) {
+	CXMPPStanza *pQuery = Stanza.GetChildByName("query");
+	CXMPPStanza *pUsername = pQuery->GetChildByName("username");
+	CString sUsername = pUsername->GetAllText();
 
-			CXMPPStanza *pVCard = Stanza.GetChildByName("vCard", "vcard-temp");
-			if (pVCard) {
-				/* vcard-temp: https://xmpp.org/extensions/xep-0054.html */
-				if (!pVCard->HasAttribute("to")) {
-					/* Retrieving user's own vCard */
+	if (!bSuccess) {
+		XMPPTRACE(this, XMPP_TRACE_AUTH, "jabber:iq:auth for [" << sUsername << "] failed: incorrect credentials.");
 
-					iq.SetAttribute("type", "result");
-					CXMPPStanza &vCard = iq.NewChild("vCard", "vcard-temp");
-					vCard.NewChild("NICKNAME").NewChild().SetText(m_pUser->GetNick());
-					vCard.NewChild("FN").NewChild().SetText(m_pUser->GetRealName());
+		/* Incorrect Credentials */
+		Error("not-authorized", "auth", "401", &Stanza);
+		return;
+	}
 
-					Write(iq, &Stanza);
-					return;
-				}
+	CXMPPStanza iq("iq");
+	iq.SetAttribute("id", Stanza.GetAttribute("id"));
+	iq.SetAttribute("type", "result");
+	Write(iq);
 
-				// Another user's vCard
-				CXMPPJID to(pVCard->GetAttribute("to"));
-				if (to.IsIRCUser()) {
-					iq.SetAttribute("type", "result");
-					CXMPPStanza &vCard = iq.NewChild("vCard", "vcard-temp");
-					vCard.NewChild("NICKNAME").NewChild().SetText(to.GetIRCUser());
-					vCard.NewChild("FN").NewChild().SetText(to.GetIRCUser() + " on " + to.GetIRCNetwork());
+	m_pUser = pUser;
+	GetModule()->ClientAuthenticated(*this);
 
-					Write(iq, &Stanza);
-					return;
-				}
+	CXMPPStanza *pResource = pQuery->GetChildByName("resource");
+	if (pResource && pResource->GetTextChild()) {
+		m_sResource = pResource->GetTextChild()->GetText();
+	}
+	XMPPTRACE(this, XMPP_TRACE_AUTH, "jabber:iq:auth for [" << sUsername << "] success.");
+}
 
-				/* Item Not Found */
-				Error("item-not-found", "cancel", "404", &Stanza, "vCard can only be fetched for this user or an IRC nick");
-				return;
-			}
+void CXMPPClient::HandleBind(CXMPPStanza &Stanza) {
+	CXMPPStanza iq("iq");
+	CXMPPStanza *pBind = Stanza.GetChildByName("bind");
+	if (!pBind) {
+		HandleUnsupportedIQ(Stanza);
+		return;
+	}
 
+	bool bResource = false;
+	CString sResource;
 
-		} else if (Stanza.GetAttribute("type").Equals("set")) {
-			CXMPPStanza *pVCard = Stanza.GetChildByName("vCard", "vcard-temp");
-			if (pVCard) {
-				/* vcard-temp: https://xmpp.org/extensions/xep-0054.html */
-				if (!pVCard->HasAttribute("to")) {
-					/* Updating user's own vCard */
-					iq.SetAttribute("type", "result");
-					// TODO: Store vCard
-					Write(iq, &Stanza);
-					return;
+	CXMPPStanza *pResourceStanza = pBind->GetChildByName("resource");
+
+	if (pResourceStanza) {
+		CXMPPStanza *pStanza = pResourceStanza->GetTextChild();
+		if (pStanza) {
+			bResource = true;
+			sResource = pStanza->GetText();
+		}
+	}
+
+	if (!bResource) {
+		// Generate a resource
+		sResource = CString::RandomString(32).SHA256();
+	}
+
+	if (sResource.empty()) {
+		/* Invalid resource*/
+		Error("bad-request", "modify", "400", &Stanza);
+		return;
+	}
+
+	if (((CXMPPModule*)m_pModule)->Client(*m_pUser, sResource)) {
+		/* We already have a client with this resource */
+		Error("conflict", "cancel", "409", &Stanza);
+		return;
+	}
+
+	/* The resource is all good, lets use it */
+	m_sResource = sResource;
+
+	iq.SetAttribute("type", "result");
+	CXMPPStanza& bindStanza = iq.NewChild("bind", "urn:ietf:params:xml:ns:xmpp-bind");
+	CXMPPStanza& jidStanza = bindStanza.NewChild("jid");
+	jidStanza.NewChild().SetText(GetJID());
+
+	Write(iq, &Stanza);
+}
+
+#ifdef SUPPORT_RFC_3921
+void CXMPPClient::HandleSession(CXMPPStanza &Stanza) {
+	CXMPPStanza iq("iq");
+	iq.SetAttribute("type", "result");
+	Write(iq, &Stanza);
+}
+#endif
+
+void CXMPPClient::HandlePing(CXMPPStanza &Stanza) {
+	CXMPPStanza iq("iq");
+	iq.SetAttribute("type", "result");
+	Write(iq, &Stanza);
+}
+
+/* Service Discovery: https://xmpp.org/extensions/xep-0030.html */
+/* MUC: Discovering Rooms: https://xmpp.org/extensions/xep-0045.html#disco-rooms */
+void CXMPPClient::HandleDiscoItems(CXMPPStanza &Stanza) {
+	if (Stanza.GetAttribute("to").Equals("users." + GetServerName())) {
+		HandleUserDirectory(Stanza);
+		return;
+	}
+
+	/* The server and the channel directory, see CXMPPModule::GetDisco */
+	const CXMPPSerializedStanza *pCached = GetModule()->GetDisco(m_pUser, CXMPPAtom::NSDiscoItems, Stanza.GetAttribute("to"));
+	if (pCached) {
+		Write(*pCached, GetJID(), "", Stanza.GetAttribute("id"));
+		return;
+	}
+
+	HandleUnsupportedIQ(Stanza);
+}
+
+void CXMPPClient::HandleDiscoInfo(CXMPPStanza &Stanza) {
+	CXMPPStanza iq("iq");
+	CXMPPJID to(Stanza.GetAttribute("to"));
+
+	/* The server and its directories, see CXMPPModule::GetDisco */
+	const CXMPPSerializedStanza *pCached = GetModule()->GetDisco(m_pUser, CXMPPAtom::NSDiscoInfo, Stanza.GetAttribute("to"));
+	if (pCached) {
+		Write(*pCached, GetJID(), "", Stanza.GetAttribute("id"));
+		return;
+	}
+
+	if (!to.IsLocal(*GetModule())) {
+		Error("item-not-found", "cancel", "404", &Stanza, "Unknown server");
+		return;
+	}
+
+	/* Info on a user */
+	if (to.IsIRCUser()) {
+		/* All nicks share the capabilities advertised in their presence, known or not */
+		CXMPPStanza *pQuery = Stanza.GetChildByName(CXMPPAtom::Query, CXMPPAtom::NSDiscoInfo);
+		if (pQuery && pQuery->GetAttribute(CXMPPAtom::Node) == GetModule()->GetCapsNode() + "#" + GetModule()->GetCapsVer()) {
+			Write(GetModule()->GetIRCUserInfo(true), GetJID(), "", Stanza.GetAttribute("id"));
+			return;
+		}
+
+		CIRCNetwork *network = m_pUser->FindNetwork(to.GetIRCNetwork());
+		if (!network) {
+			Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC network");
+			return;
+		}
+
+		/* The user exists if we share a channel with them */
+		CXMPPNickIndex *pIndex = GetModule()->GetNickIndex(network);
+		if (!pIndex || !pIndex->Find(to.GetIRCUser())) {
+			Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC nick " + to.GetIRCUser() + " in network " + to.GetIRCNetwork());
+			return;
+		}
+
+		Write(GetModule()->GetIRCUserInfo(false), GetJID(), "", Stanza.GetAttribute("id"));
+		return;
+	}
+
+	/* MUC: Querying Room Information: https://xmpp.org/extensions/xep-0045.html#disco-roominfo */
+	if (to.IsIRCChannel()) {
+		CIRCNetwork *network = m_pUser->FindNetwork(to.GetIRCNetwork());
+		if (network) {
+			CChan *channel = network->FindChan(to.GetIRCChannel());
+			if (channel) {
+				iq.SetAttribute("type", "result");
+				CXMPPStanza &query = iq.NewChild("query", "http://jabber.org/protocol/disco#info");
+				CXMPPStanza &identity = query.NewChild("identity");
+				identity.SetAttribute("category", "conference");
+				identity.SetAttribute("type", "text");
+				identity.SetAttribute("name", channel->GetName() + " on " + network->GetName());
+				query.NewChild("feature").SetAttribute("var", "http://jabber.org/protocol/muc");
+				query.NewChild("feature").SetAttribute("var", "muc_nonanonymous");
+				query.NewChild("feature").SetAttribute("var", "muc_open");
+				query.NewChild("feature").SetAttribute("var", "muc_persistent");
+				query.NewChild("feature").SetAttribute("var", "muc_public");
+				if (GetModule()->IsArchiving()) {
+					query.NewChild("feature").SetAttribute("var", "urn:xmpp:mam:2");
 				}
 
-				/* Not Allowed */
-				Error("not-allowed", "cancel", "405", &Stanza);
+				Write(iq, &Stanza);
 				return;
 			}
+		}
+	}
 
-			CXMPPStanza *bindStanza = Stanza.GetChildByName("bind");
-			if (bindStanza) {
-				bool bResource = false;
-				CString sResource;
+	Error("item-not-found", "cancel", "404", &Stanza, "Unknown entity, not this server or an IRC channel or nick");
+}
 
-				CXMPPStanza *pResourceStanza = bindStanza->GetChildByName("resource");
+/* The users. directory, a page at a time with Result Set Management: https://xmpp.org/extensions/xep-0059.html */
+void CXMPPClient::HandleUserDirectory(CXMPPStanza &Stanza) {
+	static const size_t MAX_PAGE = 250;
+
+	/* Each unique nick on a connected network is a user, listed straight
+	 * from each network's nick index */
+	CXMPPNickDirectory directory;
+	for (const auto &network : m_pUser->GetNetworks()) {
+		const CXMPPNickIndex *pIndex = GetModule()->GetNickIndex(network);
+		if (pIndex) {
+			directory.AddNetwork(network->GetName(), *pIndex);
+		}
+	}
 
-				if (pResourceStanza) {
-					CXMPPStanza *pStanza = pResourceStanza->GetTextChild();
-					if (pStanza) {
-						bResource = true;
-						sResource = pStanza->GetText();
-					}
-				}
+	size_t uMax = MAX_PAGE;
+	CString sAfter;
+	CString sBefore;
+	bool bBackwards = false;
+
+	CXMPPStanza *pQuery = Stanza.GetChildByName(CXMPPAtom::Query, CXMPPAtom::NSDiscoItems);
+	CXMPPStanza *pSet = pQuery ? pQuery->GetChildByName(CXMPPAtom::Set, CXMPPAtom::NSRSM) : NULL;
+	if (pSet) {
+		CXMPPStanza *pMax = pSet->GetChildByName(CXMPPAtom::Max);
+		if (pMax) {
+			uMax = std::min((size_t)pMax->GetAllText().ToULong(), MAX_PAGE);
+		}
 
-				if (!bResource) {
-					// Generate a resource
-					sResource = CString::RandomString(32).SHA256();
-				}
+		/* Nicks come and go between pages, so these are positions rather than items that must still exist */
+		CXMPPStanza *pAfter = pSet->GetChildByName(CXMPPAtom::After);
+		if (pAfter) {
+			sAfter = pAfter->GetAllText();
+		}
 
-				if (sResource.empty()) {
-					/* Invalid resource*/
-					Error("bad-request", "modify", "400", &Stanza);
-					return;
-				}
+		/* An empty <before/> asks for the last page */
+		CXMPPStanza *pBefore = pSet->GetChildByName(CXMPPAtom::Before);
+		if (pBefore) {
+			sBefore = pBefore->GetAllText();
+			bBackwards = true;
+		}
+	}
 
-				if (((CXMPPModule*)m_pModule)->Client(*m_pUser, sResource)) {
-					/* We already have a client with this resource */
-					Error("conflict", "cancel", "409", &Stanza);
-					return;
-				}
+	std::vector<SXMPPDirectoryEntry> vPage;
+	if (!bBackwards) {
+		CXMPPJID after(sAfter);
+		directory.PageAfter(after.GetIRCNetwork(), after.GetIRCUser(), uMax, vPage);
+	} else {
+		CXMPPJID before(sBefore);
+		directory.PageBefore(before.GetIRCNetwork(), before.GetIRCUser(), uMax, vPage);
+	}
 
-				/* The resource is all good, lets use it */
-				m_sResource = sResource;
+	auto JID = [&](const SXMPPDirectoryEntry &entry) -> CString {
+		// JID grammar: https://xmpp.org/extensions/xep-0029.html#sect-idm45406366945648
+		return entry.pNick->sNick + "!" + entry.sNetwork + "+irc@" + GetServerName();
+	};
 
-				iq.SetAttribute("type", "result");
-				CXMPPStanza& bindStanza = iq.NewChild("bind", "urn:ietf:params:xml:ns:xmpp-bind");
-				CXMPPStanza& jidStanza = bindStanza.NewChild("jid");
-				jidStanza.NewChild().SetText(GetJID());
-#ifdef SUPPORT_RFC_3921
-			} else if (Stanza.GetChildByName("session")) {
-				iq.SetAttribute("type", "result");
+	CXMPPStanza iq(CXMPPAtom::IQ);
+	iq.SetAttribute(CXMPPAtom::Type, "result");
+	CXMPPStanza &query = iq.NewChild(CXMPPAtom::Query, CXMPPAtom::NSDiscoItems);
+
+	// Present each unique nick on the network as a user
+	for (const auto &entry : vPage) {
+		CXMPPStanza &item = query.NewChild(CXMPPAtom::Item);
+		item.SetAttribute(CXMPPAtom::Jid, JID(entry));
+		item.SetAttribute(CXMPPAtom::Name, entry.pNick->sNick + " on " + entry.sNetwork);
+	}
+
+	CXMPPStanza &set = query.NewChild(CXMPPAtom::Set, CXMPPAtom::NSRSM);
+	if (!vPage.empty()) {
+		CXMPPStanza &first = set.NewChild(CXMPPAtom::First);
+		/* The index is optional, and only known without counting at either end of the listing */
+		if (!bBackwards && sAfter.empty()) {
+			first.SetAttribute(CXMPPAtom::Index, "0");
+		} else if (bBackwards && sBefore.empty()) {
+			first.SetAttribute(CXMPPAtom::Index, CString(directory.GetCount() - vPage.size()));
+		}
+		first.NewChild().SetText(JID(vPage.front()));
+		set.NewChild(CXMPPAtom::Last).NewChild().SetText(JID(vPage.back()));
+	}
+	set.NewChild(CXMPPAtom::Count).NewChild().SetText(CString(directory.GetCount()));
+
+	Write(iq, &Stanza);
+}
+
+/* Message Archive Management: https://xmpp.org/extensions/xep-0313.html */
+void CXMPPClient::HandleMAMQuery(CXMPPStanza &Stanza) {
+	static const size_t MAX_PAGE = 250;
+
+	CXMPPStanza *pQuery = Stanza.GetChildByName(CXMPPAtom::Query, CXMPPAtom::NSMAM);
+	if (!pQuery) {
+		HandleUnsupportedIQ(Stanza);
+		return;
+	}
+
+	/* Private messages are queried at our own account, channels at the room */
+	CXMPPJID to(Stanza.GetAttribute(CXMPPAtom::To));
+	CXMPPJID archiveJID(m_pUser->GetUserName(), GetServerName());
+	CString sChannel;
+
+	if (to.IsIRCChannel() && to.IsLocal(*GetModule())) {
+		sChannel = to.GetUser();
+		archiveJID = CXMPPJID(to.GetUser(), GetServerName());
+	} else if (!to.IsBlank() && !(to.IsLocal(*GetModule()) && to.GetUser().Equals(m_pUser->GetUserName()))) {
+		Error("item-not-found", "cancel", "404", &Stanza, "No archive here");
+		return;
+	}
+
+	CXMPPArchive *pArchive = GetModule()->GetArchive(m_pUser, sChannel);
+	if (!pArchive) {
+		Error("service-unavailable", "cancel", "503", &Stanza, "Archiving is turned off");
+		return;
+	}
+
+	SXMPPArchiveQuery query = {0, ULLONG_MAX, "", "", "", false, MAX_PAGE};
+
+	/* Filters, as a data form */
+	CXMPPStanza *pForm = pQuery->GetChildByName(CXMPPAtom::XElement, CXMPPAtom::NSData);
+	for (CXMPPStanza *pField = pForm ? pForm->GetFirstChild() : NULL; pField; pField = pField->GetNextSibling()) {
+		if (!pField->IsName(CXMPPAtom::Field)) {
+			continue;
+		}
+
+		CString sVar = pField->GetAttribute(CXMPPAtom::Var);
+		CXMPPStanza *pValue = pField->GetChildByName(CXMPPAtom::Value);
+		CString sValue = pValue ? pValue->GetAllText() : "";
+
+		if (sVar.Equals("with")) {
+			query.sWith = CXMPPJID(sValue).GetUser().AsLower();
+		} else if (sVar.Equals("start") || sVar.Equals("end")) {
+			unsigned long long uTime;
+			if (!XMPPParseDateTime(sValue, uTime)) {
+				Error("bad-request", "modify", "400", &Stanza, "Invalid " + sVar + " time");
+				return;
+			}
+
+			if (sVar.Equals("start")) {
+				query.uStart = uTime;
+			} else {
+				query.uEnd = uTime;
 			}
-#endif
 		}
+	}
 
-		if (!iq.HasAttribute("type")) {
-			iq.SetAttribute("type", "error");
-			iq.NewChild("bad-request");
+	/* Result Set Management: https://xmpp.org/extensions/xep-0059.html */
+	CXMPPStanza *pSet = pQuery->GetChildByName(CXMPPAtom::Set, CXMPPAtom::NSRSM);
+	if (pSet) {
+		CXMPPStanza *pMax = pSet->GetChildByName(CXMPPAtom::Max);
+		if (pMax) {
+			query.uMax = std::min((size_t)pMax->GetAllText().ToULong(), MAX_PAGE);
+		}
 
-			DEBUG("XMPPClient unsupported iq type [" + Stanza.GetAttribute("type") + "]");
+		CXMPPStanza *pAfter = pSet->GetChildByName(CXMPPAtom::After);
+		if (pAfter) {
+			query.sAfter = pAfter->GetAllText();
 		}
 
-		Write(iq, &Stanza);
+		/* An empty <before/> asks for the last page */
+		CXMPPStanza *pBefore = pSet->GetChildByName(CXMPPAtom::Before);
+		if (pBefore) {
+			query.sBefore = pBefore->GetAllText();
+			query.bBackwards = true;
+		}
+	}
+
+	SXMPPArchivePage page;
+	std::vector<SXMPPArchivedMessage> vMessages;
+
+	if (!pArchive->Query(query, page)) {
+		Error("item-not-found", "cancel", "404", &Stanza, "Unknown message id");
 		return;
-	} else if (Stanza.GetName().Equals("message")) {
-		CXMPPJID to(Stanza.GetAttribute("to"));
-
-		// IRC interface
-		if (to.IsIRC()) {
-			CString targetName;
-			if (to.IsIRCUser())
-				targetName = to.GetIRCUser();
-			else
-				targetName = to.GetIRCChannel();
-			CString networkName = to.GetIRCNetwork();
-
-			CXMPPStanza *pBody = Stanza.GetChildByName("body");
-			if (pBody) {
-				CString body = pBody->GetAllText();
-				CIRCNetwork *network = m_pUser->FindNetwork(networkName);
-				if (network) {
-					CMessage message;
-					message.SetNick(network->GetIRCNick());
-					message.SetCommand("PRIVMSG");
-					message.SetParam(0, targetName);
-					message.SetParam(1, body);
-
-					network->PutIRC(message);
-					network->PutUser(message);
-
-					if (Stanza.GetAttribute("type").Equals("groupchat")) {
-						CXMPPStanza message("message");
-						message.SetAttribute("type", "groupchat");
-						CXMPPJID nick = m_mChannels[to.GetUser()].GetJID();
-						if (!nick.IsBlank()) {
-							message.SetAttribute("from", nick.ToString());
-						}
-						message.SetAttribute("to", to.ToString());
-						message.NewChild("body").NewChild().SetText(body);
-
-						Write(message, &Stanza);
-					}
+	}
 
-					return;
-				}
-			}
+	if (!pArchive->Read(page.vuIds, vMessages)) {
+		Error("internal-server-error", "wait", "500", &Stanza, "Archive is unreadable");
+		return;
+	}
+
+	CXMPPWriteBatch batch(*this);
+	CString sQueryId = pQuery->GetAttribute(CXMPPAtom::QueryId);
+
+	for (size_t i = 0; i < vMessages.size(); i++) {
+		const SXMPPArchivedMessage &archived = vMessages[i];
+
+		CXMPPStanza message(CXMPPAtom::Message);
+		message.SetAttribute(CXMPPAtom::To, GetJID());
+		message.SetAttribute(CXMPPAtom::From, archiveJID.ToString());
+
+		CXMPPStanza &result = message.NewChild(CXMPPAtom::Result, CXMPPAtom::NSMAM);
+		if (!sQueryId.empty()) {
+			result.SetAttribute(CXMPPAtom::QueryId, sQueryId);
+		}
+		result.SetAttribute(CXMPPAtom::Id, CString(page.vuIds[i]));
+
+		CXMPPStanza &forwarded = result.NewChild(CXMPPAtom::Forwarded, CXMPPAtom::NSForward);
+		CXMPPStanza &delay = forwarded.NewChild(CXMPPAtom::Delay, CXMPPAtom::NSDelay);
+		delay.SetAttribute(CXMPPAtom::Stamp, CUtils::FormatTime((time_t)(archived.uTime / 1000000), "%Y-%m-%dT%H:%M:%SZ", "UTC"));
+
+		CXMPPStanza &original = forwarded.NewChild(CXMPPAtom::Message, CXMPPAtom::NSClient);
+		if (sChannel.empty()) {
+			CString sPeer = archived.sWith + "@" + GetServerName();
+			original.SetAttribute(CXMPPAtom::From, archived.bOutgoing ? archiveJID.ToString() : sPeer);
+			original.SetAttribute(CXMPPAtom::To, archived.bOutgoing ? sPeer : archiveJID.ToString());
+			original.SetAttribute(CXMPPAtom::Type, "chat");
+		} else {
+			original.SetAttribute(CXMPPAtom::From, CXMPPJID(to.GetUser(), GetServerName(), archived.sNick).ToString());
+			original.SetAttribute(CXMPPAtom::Type, "groupchat");
 		}
+		original.NewChild(CXMPPAtom::Body).NewChild().SetText(archived.sBody);
+
+		Write(message);
+	}
 
-		GetModule()->SendStanza(Stanza);
+	CXMPPStanza iq(CXMPPAtom::IQ);
+	iq.SetAttribute(CXMPPAtom::Type, "result");
+
+	CXMPPStanza &fin = iq.NewChild(CXMPPAtom::Fin, CXMPPAtom::NSMAM);
+	if (page.bComplete) {
+		fin.SetAttribute(CXMPPAtom::Complete, "true");
+	}
+
+	CXMPPStanza &set = fin.NewChild(CXMPPAtom::Set, CXMPPAtom::NSRSM);
+	if (!page.vuIds.empty()) {
+		CXMPPStanza &first = set.NewChild(CXMPPAtom::First);
+		first.SetAttribute(CXMPPAtom::Index, CString(page.uFirstIndex));
+		first.NewChild().SetText(CString(page.vuIds.front()));
+		set.NewChild(CXMPPAtom::Last).NewChild().SetText(CString(page.vuIds.back()));
+	}
+	set.NewChild(CXMPPAtom::Count).NewChild().SetText(CString(page.uCount));
+
+	Write(iq, &Stanza);
+}
+
+/* Roster Get: https://xmpp.org/rfcs/rfc6121.html#roster-syntax-actions-get */
+void CXMPPClient::HandleRoster(CXMPPStanza &Stanza) {
+	CXMPPStanza iq("iq");
+
+	iq.SetAttribute("type", "result");
+	CXMPPStanza &query = iq.NewChild("query", "jabber:iq:roster");
+
+	// Enumerate networks
+	const std::vector<CIRCNetwork*> &networks = m_pUser->GetNetworks();
+	for (const auto &network : networks) {
+		if (!network->IsIRCConnected())
+			continue;
+
+		// Add yourself
+		CXMPPStanza &item = query.NewChild("item");
+		item.SetAttribute("subscription", "to");
+		item.SetAttribute("jid", network->GetCurNick() + "!" + network->GetName() + "+irc@" + GetServerName());
+		item.SetAttribute("name", m_pUser->GetRealName());
+		item.SetAttribute("group", network->GetName());
+	}
+
+	Write(iq, &Stanza);
+}
+
+/* vcard-temp: https://xmpp.org/extensions/xep-0054.html */
+void CXMPPClient::HandleVCardGet(CXMPPStanza &Stanza) {
+	CXMPPStanza iq("iq");
+	CXMPPStanza *pVCard = Stanza.GetChildByName(CXMPPAtom::VCard, CXMPPAtom::NSVCard);
+	if (!pVCard) {
+		HandleUnsupportedIQ(Stanza);
 		return;
-	} else if (Stanza.GetName().Equals("presence")) {
-		CXMPPStanza presence("presence");
+	}
 
-		if (!Stanza.HasAttribute("type")) {
-			if (!Stanza.HasAttribute("to")) {
-				/* Initial presence */
-				CXMPPStanza *pPriority = Stanza.GetChildByName("priority");
-				if (pPriority) {
-					CXMPPStanza *pPriorityText = pPriority->GetTextChild();
-					if (pPriorityText) {
-						int priority = pPriorityText->GetText().ToInt();
+	if (!pVCard->HasAttribute("to")) {
+		/* Retrieving user's own vCard */
 
-						if ((priority >= -128) && (priority <= 127)) {
-							m_uiPriority = priority;
-						}
-					}
+		iq.SetAttribute("type", "result");
+		CXMPPStanza &vCard = iq.NewChild("vCard", "vcard-temp");
+		vCard.NewChild("NICKNAME").NewChild().SetText(m_pUser->GetNick());
+		vCard.NewChild("FN").NewChild().SetText(m_pUser->GetRealName());
 
-					CXMPPStanza& priority = presence.NewChild("priority");
-					priority.NewChild().SetText(CString(GetPriority()));
-				}
-				CXMPPStanza *pXVCard = Stanza.GetChildByName("x", "vcard-temp:x:update");
-				if (pXVCard) {
-					presence.NewChild("x", "vcard-temp:x:update");
-				}
+		Write(iq, &Stanza);
+		return;
+	}
 
-				Write(presence, &Stanza);
+	// Another user's vCard
+	CXMPPJID to(pVCard->GetAttribute("to"));
+	if (to.IsIRCUser()) {
+		iq.SetAttribute("type", "result");
+		CXMPPStanza &vCard = iq.NewChild("vCard", "vcard-temp");
+		vCard.NewChild("NICKNAME").NewChild().SetText(to.GetIRCUser());
+		vCard.NewChild("FN").NewChild().SetText(to.GetIRCUser() + " on " + to.GetIRCNetwork());
+
+		Write(iq, &Stanza);
+		return;
+	}
 
-				/* Invite to all channels */
-				for (const auto &network : m_pUser->GetNetworks()) {
-					for (const auto &channel : network->GetChans()) {
-						CXMPPStanza message("message");
-						message.SetAttribute("from", channel->GetName() + "!" + network->GetName() + "+irc@" + GetServerName());
-						message.SetAttribute("id", "znc_" + CString::RandomString(8));
-						CXMPPStanza &invite = message.NewChild("x", "http://jabber.org/protocol/muc#user").NewChild("invite");
-						invite.SetAttribute("from", GetServerName());
-						invite.NewChild("reason").NewChild().SetText(m_pUser->GetNick() + " is joined to " + channel->GetName() + " on " + network->GetName());
+	/* Item Not Found */
+	Error("item-not-found", "cancel", "404", &Stanza, "vCard can only be fetched for this user or an IRC nick");
+}
 
-						Write(message);
+void CXMPPClient::HandleVCardSet(CXMPPStanza &Stanza) {
+	CXMPPStanza iq("iq");
+	CXMPPStanza *pVCard = Stanza.GetChildByName(CXMPPAtom::VCard, CXMPPAtom::NSVCard);
+	if (!pVCard) {
+		HandleUnsupportedIQ(Stanza);
+		return;
+	}
+
+	if (!pVCard->HasAttribute("to")) {
+		/* Updating user's own vCard */
+		iq.SetAttribute("type", "result");
+		// TODO: Store vCard
+		Write(iq, &Stanza);
+		return;
+	}
+
+	/* Not Allowed */
+	Error("not-allowed", "cancel", "405", &Stanza);
+}
+
+void CXMPPClient::HandleUnsupportedIQ(CXMPPStanza &Stanza) {
+	/* Replying to a result or error would only start a loop */
+	if (!Stanza.GetAttribute("type").Equals("get") && !Stanza.GetAttribute("type").Equals("set")) {
+		return;
+	}
+
+	CXMPPStanza iq("iq");
+	iq.SetAttribute("type", "error");
+	iq.NewChild("bad-request");
+
+	XMPPTRACE(this, XMPP_TRACE_ROUTING, "unsupported iq type [" + Stanza.GetAttribute("type") + "]");
+
+	Write(iq, &Stanza);
+}
+
+void CXMPPClient::HandleMessage(CXMPPStanza &Stanza) {
+	CXMPPJID to(Stanza.GetAttribute("to"));
+
+	// IRC interface
+	if (to.IsIRC()) {
+		CString targetName;
+		if (to.IsIRCUser())
+			targetName = to.GetIRCUser();
+		else
+			targetName = to.GetIRCChannel();
+		CString networkName = to.GetIRCNetwork();
+
+		CXMPPStanza *pBody = Stanza.GetChildByName(CXMPPAtom::Body);
+		if (pBody) {
+			CString body = pBody->GetAllText();
+			CIRCNetwork *network = m_pUser->FindNetwork(networkName);
+			if (network) {
+				CMessage message;
+				message.SetNick(network->GetIRCNick());
+				message.SetCommand("PRIVMSG");
+				message.SetParam(0, targetName);
+				message.SetParam(1, body);
+
+				network->PutIRC(message);
+				network->PutUser(message);
+
+				/* Our own side of the conversation */
+				SXMPPArchivedMessage archived = {XMPPArchiveTime(), to.IsIRCUser() ? to.GetUser().AsLower() : "", true, network->GetCurNick(), body};
+				GetModule()->ArchiveMessage(m_pUser, to.IsIRCUser() ? "" : to.GetUser(), archived);
+
+				if (Stanza.GetAttribute("type").Equals("groupchat")) {
+					CXMPPStanza message("message");
+					message.SetAttribute("type", "groupchat");
+					const CXMPPChannel *pChannel = FindChannel(to.GetUser());
+					if (pChannel) {
+						message.SetAttribute("from", pChannel->GetJID().ToString());
 					}
+					message.SetAttribute("to", to.ToString());
+					message.NewChild("body").NewChild().SetText(body);
+
+					Write(message, &Stanza);
 				}
+
 				return;
-			} else {
-				// channel join
-				CXMPPJID to(Stanza.GetAttribute("to"));
+			}
+		}
+	}
 
-				if (!to.IsLocal(*GetModule())) {
-					return; // ignore
-				}
-				if (to.GetResource().empty()) {
-					Error("jid-malformed", "modify", "400", &Stanza);
-					return;
-				}
+	GetModule()->SendStanza(Stanza);
+}
 
-				CXMPPStanza *pX = Stanza.GetChildByName("x", "http://jabber.org/protocol/muc");
-				if (pX) {
-					// TODO: Broadcast to any other XMPP clients in this room
-					// TODO: we need a per-client channel list
+void CXMPPClient::HandlePresence(CXMPPStanza &Stanza) {
+	CXMPPStanza presence("presence");
 
-					if (!(to.IsLocal(*GetModule()) && to.IsIRCChannel())) {
-						Error("item-not-found", "cancel", "404", &Stanza, "Channel is not on this server or is not an IRC channel");
-						return;
+	if (!Stanza.HasAttribute("type")) {
+		if (!Stanza.HasAttribute("to")) {
+			/* Initial presence */
+			CXMPPStanza *pPriority = Stanza.GetChildByName(CXMPPAtom::Priority);
+			if (pPriority) {
+				CXMPPStanza *pPriorityText = pPriority->GetTextChild();
+				if (pPriorityText) {
+					int priority = pPriorityText->GetText().ToInt();
+
+					if ((priority >= -128) && (priority <= 127)) {
+						m_uiPriority = priority;
 					}
+				}
 
-					CIRCNetwork *network = m_pUser->FindNetwork(to.GetIRCNetwork());
-					if (!network) {
-						Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC network");
-						return;
-					}
+				CXMPPStanza& priority = presence.NewChild("priority");
+				priority.NewChild().SetText(CString(GetPriority()));
+			}
+			CXMPPStanza *pXVCard = Stanza.GetChildByName(CXMPPAtom::XElement, CXMPPAtom::NSVCardUpdate);
+			if (pXVCard) {
+				presence.NewChild("x", "vcard-temp:x:update");
+			}
 
-					// Room history
-					int maxStanzas = 25;
-					CXMPPStanza *pHistory = pX->GetChildByName("history");
-					if (pHistory && pHistory->HasAttribute("maxstanzas")) {
-						maxStanzas = pHistory->GetAttribute("maxstanzas").ToInt();
-					}
+			Write(presence, &Stanza);
 
-					CChan *channel = network->FindChan(to.GetIRCChannel());
-					if (!channel) {
-						// Add the channel to the network
-						channel = new CChan(to.GetIRCChannel(), network, false);
-						network->AddChan(channel);
-					}
-					if (channel->IsDisabled()) {
-						Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC channel");
-						return;
-					}
-					if (!channel->IsOn()) {
-						// Join the channel
-						std::set<CChan *> joins{channel};
-						network->JoinChans(joins);
-
-						DEBUG("XMPPClient finish join to " + channel->GetName() + " on " + network->GetName() + " in callback");
-						m_mChannels.emplace(to.GetUser(), CXMPPChannel(to, channel, maxStanzas));
-						return;
-					}
+			/* Invite to all channels */
+			for (const auto &network : m_pUser->GetNetworks()) {
+				for (const auto &channel : network->GetChans()) {
+					CXMPPStanza message("message");
+					message.SetAttribute("from", channel->GetName() + "!" + network->GetName() + "+irc@" + GetServerName());
+					message.SetAttribute("id", "znc_" + CString::RandomString(8));
+					CXMPPStanza &invite = message.NewChild("x", "http://jabber.org/protocol/muc#user").NewChild("invite");
+					invite.SetAttribute("from", GetServerName());
+					invite.NewChild("reason").NewChild().SetText(m_pUser->GetNick() + " is joined to " + channel->GetName() + " on " + network->GetName());
 
-					JoinChannel(channel, to, maxStanzas);
-					return;
+					Write(message);
 				}
 			}
-		} else if (Stanza.GetAttribute("type").Equals("unavailable")) {
-			if (!Stanza.HasAttribute("to")) {
-				presence.NewChild("unavailable");
-				Write(presence, &Stanza);
+			return;
+		} else {
+			// channel join
+			CXMPPJID to(Stanza.GetAttribute("to"));
+
+			if (!to.IsLocal(*GetModule())) {
+				return; // ignore
+			}
+			if (to.GetResource().empty()) {
+				Error("jid-malformed", "modify", "400", &Stanza);
 				return;
-			} else {
-				/* An occupant exits a room by sending presence of type "unavailable" to its current <room@service/nick>. */
-				CXMPPJID to(Stanza.GetAttribute("to"));
+			}
+
+			CXMPPStanza *pX = Stanza.GetChildByName(CXMPPAtom::XElement, CXMPPAtom::NSMUC);
+			if (pX) {
+				// TODO: Broadcast to any other XMPP clients in this room
+				// TODO: we need a per-client channel list
+
 				if (!(to.IsLocal(*GetModule()) && to.IsIRCChannel())) {
-					/* Unknown, ignore */
+					Error("item-not-found", "cancel", "404", &Stanza, "Channel is not on this server or is not an IRC channel");
 					return;
 				}
-				CXMPPJID jid = m_mChannels[to.GetUser()].GetJID();
-				if (jid.IsBlank() || !jid.Equals(to)) {
-					/* Not joined, ignore */
+
+				CIRCNetwork *network = m_pUser->FindNetwork(to.GetIRCNetwork());
+				if (!network) {
+					Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC network");
 					return;
 				}
 
-				m_mChannels.erase(to.GetUser());
-				CXMPPJID from = to;
-				to.SetResource("");
-				ChannelPresence(from, jid, "unavailable");
+				// Room history
+				int maxStanzas = 25;
+				CXMPPStanza *pHistory = pX->GetChildByName(CXMPPAtom::History);
+				if (pHistory && pHistory->HasAttribute("maxstanzas")) {
+					maxStanzas = pHistory->GetAttribute("maxstanzas").ToInt();
+				}
+
+				CChan *channel = network->FindChan(to.GetIRCChannel());
+				if (!channel) {
+					// Add the channel to the network
+					channel = new CChan(to.GetIRCChannel(), network, false);
+					network->AddChan(channel);
+				}
+				if (channel->IsDisabled()) {
+					Error("item-not-found", "cancel", "404", &Stanza, "Unknown IRC channel");
+					return;
+				}
+				if (!channel->IsOn()) {
+					// Join the channel
+					std::set<CChan *> joins{channel};
+					network->JoinChans(joins);
+
+					XMPPTRACE(this, XMPP_TRACE_MUC, "finish join to " + channel->GetName() + " on " + network->GetName() + " in callback");
+					AddChannel(to, channel, maxStanzas);
+					return;
+				}
+
+				JoinChannel(channel, to, maxStanzas);
 				return;
 			}
-		} else if (Stanza.GetAttribute("type").Equals("available")) {
-			presence.NewChild("available");
 		}
+	} else if (Stanza.GetAttribute("type").Equals("unavailable")) {
+		if (!Stanza.HasAttribute("to")) {
+			presence.NewChild("unavailable");
+			Write(presence, &Stanza);
+			return;
+		} else {
+			/* An occupant exits a room by sending presence of type "unavailable" to its current <room@service/nick>. */
+			CXMPPJID to(Stanza.GetAttribute("to"));
+			if (!(to.IsLocal(*GetModule()) && to.IsIRCChannel())) {
+				/* Unknown, ignore */
+				return;
+			}
+			const CXMPPChannel *pChannel = FindChannel(to.GetUser());
+			if (!pChannel || !pChannel->GetJID().Equals(to)) {
+				/* Not joined, ignore */
+				return;
+			}
 
-		Write(presence, &Stanza);
-		return;
+			CXMPPJID jid = pChannel->GetJID();
+			RemoveChannel(to.GetUser());
+			CXMPPJID from = to;
+			to.SetResource("");
+			ChannelPresence(from, jid, "unavailable");
+			return;
+		}
+	} else if (Stanza.GetAttribute("type").Equals("available")) {
+		presence.NewChild("available");
 	}
 
-	DEBUG("XMPPClient unsupported stanza [" << Stanza.GetName() << "]");
+	Write(presence, &Stanza);
 }
 
 // TODO: Support multiple channels so nick presence is de-duplicated when logging back in.
 void CXMPPClient::JoinChannel(CChan *const &channel, const CXMPPJID &to, int maxStanzas) {
 	const CIRCNetwork *network = channel->GetNetwork();
-	DEBUG("XMPPClient sending join to " + channel->GetName() + " on " + network->GetName());
+	CXMPPWriteBatch batch(*this);
+
+	/* The client asked for this join, so it is answered even while inactive */
+	bool bInactive = m_bInactive;
+	m_bInactive = false;
+
+	XMPPTRACE(this, XMPP_TRACE_MUC, "sending join to " + channel->GetName() + " on " + network->GetName());
 	const std::map<CString, CNick> &nicks = channel->GetNicks();
 	for (const auto &entry : nicks) {
 		const CNick &nick = entry.second;
@@ -906,9 +1567,30 @@ void CXMPPClient::JoinChannel(CChan *const &channel, const CXMPPJID &to, int max
 	// User's own presence
 	ChannelPresence(to, GetJID(), "", "", {"100", "110"});
 
-	// Traverse back through time, finding messages
+	// Room history, from the archive once it has any
+	CXMPPArchive *pArchive = GetModule()->GetArchive(m_pUser, to.GetUser());
 	const CBuffer &buffer = channel->GetBuffer();
-	if (buffer.Size()) {
+	if (pArchive && pArchive->GetSize()) {
+		SXMPPArchiveQuery query = {0, ULLONG_MAX, "", "", "", true, (size_t)std::max(maxStanzas, 0)};
+		SXMPPArchivePage page;
+		std::vector<SXMPPArchivedMessage> vMessages;
+
+		if (pArchive->Query(query, page) && pArchive->Read(page.vuIds, vMessages)) {
+			CXMPPJID channelJID(to.GetUser(), GetServerName());
+
+			for (const auto &archived : vMessages) {
+				CXMPPJID from(to.GetUser(), to.GetDomain(), archived.sNick);
+				CXMPPStanza message(CXMPPAtom::Message);
+				message.SetAttribute(CXMPPAtom::Id, "znc_" + CString::RandomString(8));
+				message.SetAttribute(CXMPPAtom::From, from.ToString());
+				message.SetAttribute(CXMPPAtom::Type, "groupchat");
+				message.NewChild(CXMPPAtom::Body).NewChild().SetText(archived.sBody);
+				AddDelay(message, channelJID.ToString(), (time_t)(archived.uTime / 1000000));
+				Write(message);
+			}
+		}
+	} else if (buffer.Size()) {
+		// Traverse back through time, finding messages
 		std::deque<CXMPPBufLine> history;
 		for (size_t i = buffer.Size(); i-- > 0;) {
 			const CXMPPBufLine &line = CXMPPBufLine(buffer.GetBufLine(i));
@@ -926,11 +1608,11 @@ void CXMPPClient::JoinChannel(CChan *const &channel, const CXMPPJID &to, int max
 
 			CXMPPJID from(to.GetUser(), to.GetDomain(), msg.GetNick().GetNick());
 			CXMPPJID channelJID(to.GetUser(), GetServerName());
-			CXMPPStanza message("message");
-			message.SetAttribute("id", "znc_" + CString::RandomString(8));
-			message.SetAttribute("from", from.ToString());
-			message.SetAttribute("type", "groupchat");
-			message.NewChild("body").NewChild().SetText(line.GetText());
+			CXMPPStanza message(CXMPPAtom::Message);
+			message.SetAttribute(CXMPPAtom::Id, "znc_" + CString::RandomString(8));
+			message.SetAttribute(CXMPPAtom::From, from.ToString());
+			message.SetAttribute(CXMPPAtom::Type, "groupchat");
+			message.NewChild(CXMPPAtom::Body).NewChild().SetText(line.GetText());
 			AddDelay(message, channelJID.ToString(), msg.GetTime());
 			Write(message);
 		}
@@ -941,16 +1623,16 @@ void CXMPPClient::JoinChannel(CChan *const &channel, const CXMPPJID &to, int max
 	if (!topic.empty()) {
 		CXMPPJID owner(to.GetUser(), to.GetDomain(), CNick(channel->GetTopicOwner()).GetNick());
 		CXMPPJID channelJID(to.GetUser(), GetServerName());
-		CXMPPStanza message("message");
-		message.SetAttribute("id", "znc_" + CString::RandomString(8));
-		message.SetAttribute("from", owner.ToString());
-		message.SetAttribute("type", "groupchat");
-		message.NewChild("subject").NewChild().SetText(topic);
+		CXMPPStanza message(CXMPPAtom::Message);
+		message.SetAttribute(CXMPPAtom::Id, "znc_" + CString::RandomString(8));
+		message.SetAttribute(CXMPPAtom::From, owner.ToString());
+		message.SetAttribute(CXMPPAtom::Type, "groupchat");
+		message.NewChild(CXMPPAtom::Subject).NewChild().SetText(topic);
 		AddDelay(message, channelJID.ToString(), (time_t)channel->GetTopicDate());
 		Write(message);
 	}
 
-	m_mChannels.emplace(to.GetUser(), CXMPPChannel(to, channel));
+	AddChannel(to, channel);
 
 	// Finally, send the non-channel presence of channel members
 	for (const auto &entry : nicks) {
@@ -959,4 +1641,6 @@ void CXMPPClient::JoinChannel(CChan *const &channel, const CXMPPJID &to, int max
 		CXMPPJID from(nick.GetNick() + "!" + network->GetName() + "+irc", GetServerName());
 		Presence(from);
 	}
+
+	m_bInactive = bInactive;
 }
@@ -6,6 +6,11 @@
  * by the Free Software Foundation.
  */
 
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include <deque>
+
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
@@ -14,6 +19,10 @@
 
 #include "Socket.h"
 #include "JID.h"
+#include "xmpp.h"
+
+class CXMPPSession;
+class CXMPPAuthJob;
 
 class CXMPPClient : public CXMPPSocket {
 public:
@@ -24,10 +33,17 @@ public:
 	CString GetResource() const { return m_sResource; }
 	int GetPriority() const { return m_uiPriority; }
 	CString GetJID() const;
-	std::map<CString, CXMPPChannel> &GetChannels() const { return m_mChannels; }
+
+	/* Channel membership, keyed by the room JID's user part ("#chan!network+irc") */
+	const std::unordered_map<CXMPPChannelKey, CXMPPChannel>& GetChannels() const { return m_Channels.GetChannels(); }
+	const CXMPPChannel* FindChannel(const CString &sChannel) const { return m_Channels.Find(sChannel); }
+	bool HasChannel(const CString &sChannel) const { return m_Channels.Has(sChannel); }
+	void AddChannel(const CXMPPJID &jid, CChan *pChan, int historyMaxStanzas = 25);
+	void RemoveChannel(const CString &sChannel);
 
 	bool Write(CString sData);
 	bool Write(const CXMPPStanza& Stanza);
+	bool Write(const CXMPPSerializedStanza& Stanza, const CString &sTo, const CString &sFrom = "", const CString &sId = "");
 	bool Write(CXMPPStanza& Stanza, const CXMPPStanza *pStanza = nullptr);
 
 	void Error(const CString &tag, const CString &type, const CString &code = "", const CXMPPStanza *pStanza = nullptr, const CString &text = "");
@@ -35,15 +51,96 @@ public:
 	void ChannelPresence(const CXMPPJID &from, const CXMPPJID &jid, const CString &type = "", const CString &status = "", const std::vector<CString> &codes = {}, const CXMPPStanza *pStanza = nullptr);
 
 	virtual void StreamStart(CXMPPStanza &Stanza);
+	virtual void StreamEnd();
 	virtual void ReceiveStanza(CXMPPStanza &Stanza);
+	/* Until the peer has authenticated its names are not worth keeping */
+	virtual bool CanInternNames() const override { return m_pUser != NULL; }
 
 	void JoinChannel(CChan *const &channel, const CXMPPJID &to, int maxStanzas = 25);
 
+	/* Client State Indication (XEP-0352), presence is held while inactive */
+	bool IsInactive() const { return m_bInactive; }
+	size_t GetHeldPresences() const { return m_vHeldPresence.size(); }
+
+	/* Stream Management (XEP-0198), NULL until the client enables it */
+	CXMPPSession* GetSession() const { return m_pSession; }
+	/* Ask for an <a/> if stanzas are waiting for one and none has been asked for yet. */
+	void RequestAck();
+
+	/* The user a password is being checked for, NULL when none is */
+	CUser* GetAuthUser() const { return m_pAuthUser; }
+	void PasswordChecked(bool bSuccess);
+	/* Abandon a password check, waiting for it if it is already running */
+	void CancelAuth();
+
 protected:
+	friend struct SStanzaHandlerTable;
+
+	/* Stanza handlers, dispatched by ReceiveStanza */
+	void HandleSASLAuth(CXMPPStanza &Stanza);
+	void HandleStartTLS(CXMPPStanza &Stanza);
+	void HandleIQAuthGet(CXMPPStanza &Stanza);
+	void HandleIQAuthSet(CXMPPStanza &Stanza);
+	void HandleBind(CXMPPStanza &Stanza);
+	void HandleSession(CXMPPStanza &Stanza);
+	void HandlePing(CXMPPStanza &Stanza);
+	void HandleDiscoItems(CXMPPStanza &Stanza);
+	void HandleUserDirectory(CXMPPStanza &Stanza);
+	void HandleDiscoInfo(CXMPPStanza &Stanza);
+	void HandleRoster(CXMPPStanza &Stanza);
+	void HandleVCardGet(CXMPPStanza &Stanza);
+	void HandleVCardSet(CXMPPStanza &Stanza);
+	void HandleMAMQuery(CXMPPStanza &Stanza);
+	void HandleUnsupportedIQ(CXMPPStanza &Stanza);
+	void HandleMessage(CXMPPStanza &Stanza);
+	void HandlePresence(CXMPPStanza &Stanza);
+	void HandleActive(CXMPPStanza &Stanza);
+	void HandleInactive(CXMPPStanza &Stanza);
+	void HandleCompress(CXMPPStanza &Stanza);
+	void HandleSMEnable(CXMPPStanza &Stanza);
+	void HandleSMResume(CXMPPStanza &Stanza);
+	void HandleSMRequest(CXMPPStanza &Stanza);
+	void HandleSMAnswer(CXMPPStanza &Stanza);
+
+	typedef void (CXMPPClient::*TAuthResult)(CXMPPStanza &Stanza, CUser *pUser, bool bSuccess);
+
+	/*
+	 * Check a password, on a worker thread when ZNC has them. Reading
+	 * stops meanwhile, and stanzas already parsed wait in m_dpDeferred
+	 * until pResult has been called with the stanza that asked.
+	 */
+	void CheckPassword(CXMPPStanza &Stanza, CUser *pUser, const CString &sPassword, TAuthResult pResult);
+	void SASLAuthResult(CXMPPStanza &Stanza, CUser *pUser, bool bSuccess);
+	void IQAuthResult(CXMPPStanza &Stanza, CUser *pUser, bool bSuccess);
+
+	void CompressFailed(const CString &sCondition);
+	void SMFailed(const CString &sCondition);
+	/* Give up our session to the connection that resumed it, and close */
+	void Supersede();
+	virtual void StanzaSent(const char *szData, size_t uSize) override;
+
+	/* Keep an unsolicited presence for later if the client is inactive. */
+	bool HoldPresence(CXMPPStanza &Presence, const CString &sFrom);
+	void ReleasePresence();
+
 	CUser *m_pUser;
 
 	CString m_sResource;
 	int m_uiPriority;
-	std::map<CString, CXMPPChannel> m_mChannels;
+	CXMPPChannelMembership m_Channels;
+
+	bool m_bInactive;
+	/* Serialized presence held while inactive, only the latest per JID */
+	std::vector<CString> m_vHeldPresence;
+	std::unordered_map<CString, size_t, std::hash<std::string>> m_mHeldPresenceIndex;
+
+	CXMPPSession *m_pSession;
+
+	CXMPPAuthJob *m_pAuthJob;
+	CXMPPStanza *m_pAuthStanza;
+	CUser *m_pAuthUser;
+	TAuthResult m_pAuthResult;
+	std::deque<CXMPPStanza*> m_dpDeferred;
 };
 
+#endif
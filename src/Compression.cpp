@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <cstring>
+
+#include "Compression.h"
+
+static const size_t DEFLATE_CHUNK = 4096;
+
+CXMPPCompression::CXMPPCompression() {
+	memset(&m_Deflate, 0, sizeof(z_stream));
+	memset(&m_Inflate, 0, sizeof(z_stream));
+	m_bDeflateReady = false;
+	m_bInflateReady = false;
+	m_bInflatePending = false;
+}
+
+CXMPPCompression::~CXMPPCompression() {
+	if (m_bDeflateReady) {
+		deflateEnd(&m_Deflate);
+	}
+
+	if (m_bInflateReady) {
+		inflateEnd(&m_Inflate);
+	}
+}
+
+bool CXMPPCompression::Init(const SXMPPCompressionLimits &Limits) {
+	m_bDeflateReady = deflateInit2(&m_Deflate, Limits.iLevel, Z_DEFLATED, Limits.iWindowBits, Limits.iMemLevel, Z_DEFAULT_STRATEGY) == Z_OK;
+
+	/* The peer picks its own window, we have to be able to decode the largest */
+	m_bInflateReady = inflateInit2(&m_Inflate, MAX_WBITS) == Z_OK;
+
+	return m_bDeflateReady && m_bInflateReady;
+}
+
+bool CXMPPCompression::Deflate(const char *szData, size_t uSize, bool bFlush, CString &sOutput) {
+	m_Deflate.next_in = (Bytef *)szData;
+	m_Deflate.avail_in = uSize;
+
+	do {
+		size_t uOffset = sOutput.size();
+		sOutput.resize(uOffset + DEFLATE_CHUNK);
+
+		m_Deflate.next_out = (Bytef *)&sOutput[uOffset];
+		m_Deflate.avail_out = DEFLATE_CHUNK;
+
+		int iResult = deflate(&m_Deflate, bFlush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+		sOutput.resize(uOffset + DEFLATE_CHUNK - m_Deflate.avail_out);
+
+		if (iResult == Z_STREAM_ERROR) {
+			return false;
+		}
+	} while (m_Deflate.avail_out == 0);
+
+	return true;
+}
+
+void CXMPPCompression::SetInput(const char *szData, size_t uSize) {
+	m_Inflate.next_in = (Bytef *)szData;
+	m_Inflate.avail_in = uSize;
+}
+
+bool CXMPPCompression::Inflate(const char *&szOutput, size_t &uOutput) {
+	szOutput = m_acInflated;
+	uOutput = 0;
+
+	/* A full buffer last time may mean zlib is still holding output back */
+	while (uOutput == 0 && (m_Inflate.avail_in > 0 || m_bInflatePending)) {
+		m_Inflate.next_out = (Bytef *)m_acInflated;
+		m_Inflate.avail_out = INFLATE_CHUNK;
+
+		int iResult = inflate(&m_Inflate, Z_SYNC_FLUSH);
+		if (iResult != Z_OK && iResult != Z_BUF_ERROR && iResult != Z_STREAM_END) {
+			return false;
+		}
+
+		uOutput = INFLATE_CHUNK - m_Inflate.avail_out;
+		m_bInflatePending = m_Inflate.avail_out == 0;
+
+		if (iResult != Z_OK && uOutput == 0) {
+			/* No progress is possible until more input arrives */
+			break;
+		}
+	}
+
+	return true;
+}
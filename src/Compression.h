@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _COMPRESSION_H
+#define _COMPRESSION_H
+
+#include <zlib.h>
+
+#include <znc/ZNCString.h>
+
+struct SXMPPCompressionLimits {
+	bool bEnabled;
+	int iLevel;
+	/* Bound the compressor's memory, about (1 << (window + 2)) + (1 << (memlevel + 9)) bytes */
+	int iWindowBits;
+	int iMemLevel;
+};
+
+/*
+ * zlib stream compression (XEP-0138) for one connection. Each direction
+ * is a single zlib stream for the lifetime of the connection.
+ */
+class CXMPPCompression {
+public:
+	CXMPPCompression();
+	~CXMPPCompression();
+
+	CXMPPCompression(const CXMPPCompression&) = delete;
+	CXMPPCompression& operator=(const CXMPPCompression&) = delete;
+
+	bool Init(const SXMPPCompressionLimits &Limits);
+
+	/* Append the compressed form of the data to sOutput, bFlush makes everything so far decodable by the peer. */
+	bool Deflate(const char *szData, size_t uSize, bool bFlush, CString &sOutput);
+
+	/*
+	 * Hand over data read from the peer, then call Inflate() until it
+	 * yields nothing more. Output is produced a bounded chunk at a time,
+	 * however well the input compresses.
+	 */
+	void SetInput(const char *szData, size_t uSize);
+	bool Inflate(const char *&szOutput, size_t &uOutput);
+
+protected:
+	static const size_t INFLATE_CHUNK = 16384;
+
+	z_stream m_Deflate;
+	z_stream m_Inflate;
+	bool m_bDeflateReady;
+	bool m_bInflateReady;
+	bool m_bInflatePending;
+
+	char m_acInflated[INFLATE_CHUNK];
+};
+
+#endif
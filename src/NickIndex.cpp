@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <algorithm>
+
+#include "NickIndex.h"
+
+CXMPPNickIndex::CXMPPNickIndex(const CString &sCaseMapping) {
+	/* Unknown mappings (rfc7613 and the like) are at least ASCII case insensitive */
+	if (sCaseMapping.Equals("rfc1459")) {
+		m_eCaseMapping = CASEMAPPING_RFC1459;
+	} else if (sCaseMapping.Equals("strict-rfc1459")) {
+		m_eCaseMapping = CASEMAPPING_STRICT_RFC1459;
+	} else {
+		m_eCaseMapping = CASEMAPPING_ASCII;
+	}
+}
+
+CString CXMPPNickIndex::Fold(const CString &sName) const {
+	CString sFolded(sName);
+
+	for (char &c : sFolded) {
+		if (c >= 'A' && c <= 'Z') {
+			c += 'a' - 'A';
+		} else if (m_eCaseMapping != CASEMAPPING_ASCII) {
+			/* Scandinavian brackets: []\ are the upper case of {}|, and ~ of ^ unless strict */
+			switch (c) {
+				case '[': c = '{'; break;
+				case ']': c = '}'; break;
+				case '\\': c = '|'; break;
+				case '~':
+					if (m_eCaseMapping == CASEMAPPING_RFC1459) {
+						c = '^';
+					}
+					break;
+			}
+		}
+	}
+
+	return sFolded;
+}
+
+void CXMPPNickIndex::Join(const CString &sNick, const CString &sChannel) {
+	SXMPPIndexedNick &nick = m_mNicks[Fold(sNick)];
+	nick.sNick = sNick;
+	nick.ssChannels.insert(Fold(sChannel));
+}
+
+void CXMPPNickIndex::Part(const CString &sNick, const CString &sChannel) {
+	std::map<CString, SXMPPIndexedNick>::iterator it = m_mNicks.find(Fold(sNick));
+	if (it == m_mNicks.end()) {
+		return;
+	}
+
+	it->second.ssChannels.erase(Fold(sChannel));
+	if (it->second.ssChannels.empty()) {
+		m_mNicks.erase(it);
+	}
+}
+
+void CXMPPNickIndex::Quit(const CString &sNick) {
+	m_mNicks.erase(Fold(sNick));
+}
+
+void CXMPPNickIndex::Rename(const CString &sOldNick, const CString &sNewNick) {
+	std::map<CString, SXMPPIndexedNick>::iterator it = m_mNicks.find(Fold(sOldNick));
+	if (it == m_mNicks.end()) {
+		return;
+	}
+
+	std::set<CString> ssChannels;
+	ssChannels.swap(it->second.ssChannels);
+	m_mNicks.erase(it);
+
+	/* A case change folds to the same key */
+	SXMPPIndexedNick &renamed = m_mNicks[Fold(sNewNick)];
+	renamed.sNick = sNewNick;
+	renamed.ssChannels.insert(ssChannels.begin(), ssChannels.end());
+}
+
+void CXMPPNickIndex::PartAll(const CString &sChannel) {
+	CString sFolded = Fold(sChannel);
+
+	std::map<CString, SXMPPIndexedNick>::iterator it = m_mNicks.begin();
+	while (it != m_mNicks.end()) {
+		it->second.ssChannels.erase(sFolded);
+		if (it->second.ssChannels.empty()) {
+			it = m_mNicks.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+const SXMPPIndexedNick* CXMPPNickIndex::Find(const CString &sNick) const {
+	std::map<CString, SXMPPIndexedNick>::const_iterator it = m_mNicks.find(Fold(sNick));
+	return it == m_mNicks.end() ? NULL : &it->second;
+}
+
+void CXMPPNickDirectory::AddNetwork(const CString &sNetwork, const CXMPPNickIndex &Index) {
+	size_t uNetwork;
+	Locate(sNetwork, uNetwork);
+
+	SNetwork network = {sNetwork.AsLower(), sNetwork, &Index};
+	m_vNetworks.insert(m_vNetworks.begin() + uNetwork, network);
+	m_uCount += Index.GetNicks().size();
+}
+
+bool CXMPPNickDirectory::Locate(const CString &sNetwork, size_t &uNetwork) const {
+	CString sKey = sNetwork.AsLower();
+	uNetwork = std::lower_bound(m_vNetworks.begin(), m_vNetworks.end(), sKey, [](const SNetwork &network, const CString &sOther) {
+		return network.sKey < sOther;
+	}) - m_vNetworks.begin();
+
+	return uNetwork < m_vNetworks.size() && m_vNetworks[uNetwork].sKey == sKey;
+}
+
+void CXMPPNickDirectory::PageAfter(const CString &sNetwork, const CString &sNick, size_t uMax, std::vector<SXMPPDirectoryEntry> &vPage) const {
+	typedef std::map<CString, SXMPPIndexedNick>::const_iterator TNickIterator;
+
+	size_t uNetwork = 0;
+	bool bAfter = !sNetwork.empty() && Locate(sNetwork, uNetwork);
+
+	vPage.clear();
+	for (; uNetwork < m_vNetworks.size() && vPage.size() < uMax; uNetwork++, bAfter = false) {
+		const SNetwork &network = m_vNetworks[uNetwork];
+		const std::map<CString, SXMPPIndexedNick> &mNicks = network.pIndex->GetNicks();
+
+		for (TNickIterator it = bAfter ? mNicks.upper_bound(network.pIndex->Fold(sNick)) : mNicks.begin(); it != mNicks.end() && vPage.size() < uMax; ++it) {
+			vPage.push_back({network.sName, &it->second});
+		}
+	}
+}
+
+void CXMPPNickDirectory::PageBefore(const CString &sNetwork, const CString &sNick, size_t uMax, std::vector<SXMPPDirectoryEntry> &vPage) const {
+	typedef std::map<CString, SXMPPIndexedNick>::const_iterator TNickIterator;
+
+	size_t uNetwork = m_vNetworks.size();
+	bool bBefore = !sNetwork.empty() && Locate(sNetwork, uNetwork);
+	if (bBefore) {
+		uNetwork++;
+	}
+
+	/* Walked backwards from the end of the page, then put in order */
+	vPage.clear();
+	for (; uNetwork > 0 && vPage.size() < uMax; bBefore = false) {
+		const SNetwork &network = m_vNetworks[--uNetwork];
+		const std::map<CString, SXMPPIndexedNick> &mNicks = network.pIndex->GetNicks();
+
+		for (TNickIterator it = bBefore ? mNicks.lower_bound(network.pIndex->Fold(sNick)) : mNicks.end(); it != mNicks.begin() && vPage.size() < uMax;) {
+			vPage.push_back({network.sName, &(--it)->second});
+		}
+	}
+
+	std::reverse(vPage.begin(), vPage.end());
+}
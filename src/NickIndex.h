@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _NICKINDEX_H
+#define _NICKINDEX_H
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include <znc/ZNCString.h>
+
+struct SXMPPIndexedNick {
+	CString sNick;                /* as last seen */
+	std::set<CString> ssChannels; /* folded */
+};
+
+/*
+ * The nicks sharing a channel with us on one IRC network, and which
+ * channels those are. Nicks and channels are compared the way the network
+ * says it compares them (CASEMAPPING), and kept sorted in that order.
+ */
+class CXMPPNickIndex {
+public:
+	CXMPPNickIndex(const CString &sCaseMapping = "rfc1459");
+
+	CString Fold(const CString &sName) const;
+
+	void Join(const CString &sNick, const CString &sChannel);
+	void Part(const CString &sNick, const CString &sChannel);
+	void Quit(const CString &sNick);
+	void Rename(const CString &sOldNick, const CString &sNewNick);
+	/* We left the channel, so lost sight of everyone in it */
+	void PartAll(const CString &sChannel);
+
+	/* NULL if the nick shares no channel with us */
+	const SXMPPIndexedNick* Find(const CString &sNick) const;
+	/* Keyed by folded nick */
+	const std::map<CString, SXMPPIndexedNick>& GetNicks() const { return m_mNicks; }
+
+protected:
+	typedef enum {
+		CASEMAPPING_ASCII,
+		CASEMAPPING_RFC1459,
+		CASEMAPPING_STRICT_RFC1459
+	} ECaseMapping;
+
+	ECaseMapping m_eCaseMapping;
+	std::map<CString, SXMPPIndexedNick> m_mNicks;
+};
+
+struct SXMPPDirectoryEntry {
+	CString sNetwork;              /* as named by the user */
+	const SXMPPIndexedNick *pNick;
+};
+
+/*
+ * The nicks of several networks' indexes as one listing, network by
+ * network in name order and then in each index's own order. Pages are
+ * walked straight from the indexes, so one costs its own size and never a
+ * copy of the whole listing. The indexes must outlive the directory.
+ */
+class CXMPPNickDirectory {
+public:
+	CXMPPNickDirectory() : m_uCount(0) {}
+
+	void AddNetwork(const CString &sNetwork, const CXMPPNickIndex &Index);
+
+	size_t GetCount() const { return m_uCount; }
+
+	/* Up to uMax nicks sorting after sNick on sNetwork, or from the start if sNetwork is empty */
+	void PageAfter(const CString &sNetwork, const CString &sNick, size_t uMax, std::vector<SXMPPDirectoryEntry> &vPage) const;
+	/* Up to uMax nicks sorting before sNick on sNetwork, or up to the end if sNetwork is empty */
+	void PageBefore(const CString &sNetwork, const CString &sNick, size_t uMax, std::vector<SXMPPDirectoryEntry> &vPage) const;
+
+protected:
+	struct SNetwork {
+		CString sKey;   /* lower case name */
+		CString sName;
+		const CXMPPNickIndex *pIndex;
+	};
+
+	/* The first network not sorting before sNetwork, true if it is sNetwork */
+	bool Locate(const CString &sNetwork, size_t &uNetwork) const;
+
+	std::vector<SNetwork> m_vNetworks;
+	size_t m_uCount;
+};
+
+#endif
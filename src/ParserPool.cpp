@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include "ParserPool.h"
+
+CXMPPParserPool::~CXMPPParserPool() {
+	for (const auto &pContext : m_vParsers) {
+		xmlFreeParserCtxt(pContext);
+	}
+}
+
+xmlParserCtxtPtr CXMPPParserPool::Acquire(xmlSAXHandler *pHandlers, void *pUserData) {
+	if (m_vParsers.empty()) {
+		return xmlCreatePushParserCtxt(pHandlers, pUserData, NULL, 0, NULL);
+	}
+
+	xmlParserCtxtPtr pContext = m_vParsers.back();
+	m_vParsers.pop_back();
+
+	*pContext->sax = *pHandlers;
+	pContext->userData = pUserData;
+	return pContext;
+}
+
+void CXMPPParserPool::Release(xmlParserCtxtPtr pContext) {
+	if (m_vParsers.size() >= MAX_POOLED_PARSERS) {
+		xmlFreeParserCtxt(pContext);
+		return;
+	}
+
+	/* Drop any half parsed input now rather than holding it in the pool */
+	xmlCtxtResetPush(pContext, NULL, 0, NULL, NULL);
+	m_vParsers.push_back(pContext);
+}
+
+void CXMPPParserPool::Restart(xmlParserCtxtPtr pContext, void *pUserData) {
+	xmlCtxtResetPush(pContext, NULL, 0, NULL, NULL);
+	pContext->userData = pUserData;
+}
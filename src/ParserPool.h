@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _PARSERPOOL_H
+#define _PARSERPOOL_H
+
+#include <vector>
+
+#include <libxml/parser.h>
+
+/*
+ * libxml2 push parser contexts, recycled between sockets instead of
+ * rebuilt per connection, and reset in place when a stream restarts.
+ */
+class CXMPPParserPool {
+public:
+	CXMPPParserPool() {}
+	~CXMPPParserPool();
+
+	CXMPPParserPool(const CXMPPParserPool&) = delete;
+	CXMPPParserPool& operator=(const CXMPPParserPool&) = delete;
+
+	/* A context for a new stream, pooled when one is free */
+	xmlParserCtxtPtr Acquire(xmlSAXHandler *pHandlers, void *pUserData);
+	/* Hand back a context whose socket is done with it */
+	void Release(xmlParserCtxtPtr pContext);
+
+	/* Ready a context for a restarted stream (after STARTTLS or SASL), keeping its buffers */
+	static void Restart(xmlParserCtxtPtr pContext, void *pUserData);
+
+	size_t GetSize() const { return m_vParsers.size(); }
+
+protected:
+	/* Enough to absorb a reconnect storm without holding on to much memory afterwards */
+	static const size_t MAX_POOLED_PARSERS = 32;
+
+	std::vector<xmlParserCtxtPtr> m_vParsers;
+};
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include <algorithm>
+
+#include "Queue.h"
+
+CXMPPOutboundQueue::CXMPPOutboundQueue() {
+	m_uMarked = 0;
+	m_uSequence = 0;
+	m_uStanzas = 0;
+	m_uBytes = 0;
+	m_uPeakBytes = 0;
+}
+
+CString CXMPPOutboundQueue::GetOrderKey(const CString &sFrom) {
+	return sFrom.substr(0, sFrom.find('/'));
+}
+
+void CXMPPOutboundQueue::Push(const CString &sData, EXMPPTraffic eClass, const CString &sFrom, bool bStanza) {
+	m_adQueues[eClass].push_back({sData, sFrom, m_uSequence, bStanza, false});
+	m_mQueuedFrom[GetOrderKey(sFrom)].push_back(m_uSequence);
+	if (eClass == XMPP_TRAFFIC_PRESENCE) {
+		m_mPresenceFrom[sFrom.AsLower()] = m_uSequence;
+	}
+
+	m_uSequence++;
+	m_uStanzas++;
+	m_uBytes += sData.size();
+
+	if (m_uBytes > m_uPeakBytes) {
+		m_uPeakBytes = m_uBytes;
+	}
+}
+
+unsigned long long CXMPPOutboundQueue::Oldest(std::deque<unsigned long long> &vSequences) {
+	while (m_suRemoved.erase(vSequences.front())) {
+		vSequences.pop_front();
+	}
+
+	return vSequences.front();
+}
+
+bool CXMPPOutboundQueue::Next(bool bByPriority, TStanzaQueue *&pQueue, TStanzaQueue::iterator &it) {
+	pQueue = NULL;
+
+	auto SequenceBefore = [](const SXMPPQueuedStanza &stanza, unsigned long long uSequence) {
+		return stanza.uSequence < uSequence;
+	};
+
+	for (TStanzaQueue &Queue : m_adQueues) {
+		while (!Queue.empty() && Queue.front().bRemoved) {
+			Queue.pop_front();
+			m_uMarked--;
+		}
+
+		if (Queue.empty()) {
+			continue;
+		}
+
+		if (!bByPriority) {
+			/* Plain arrival order */
+			if (!pQueue || Queue.front().uSequence < pQueue->front().uSequence) {
+				pQueue = &Queue;
+			}
+			continue;
+		}
+
+		/* The most urgent stanza goes, unless something older under the
+		 * same key is still waiting, in which case that goes first instead */
+		unsigned long long uOldest = Oldest(m_mQueuedFrom[GetOrderKey(Queue.front().sFrom)]);
+
+		for (TStanzaQueue &Other : m_adQueues) {
+			/* Each queue is in sequence order, marked stanzas included */
+			TStanzaQueue::iterator found = std::lower_bound(Other.begin(), Other.end(), uOldest, SequenceBefore);
+			if (found != Other.end() && found->uSequence == uOldest) {
+				pQueue = &Other;
+				it = found;
+				return true;
+			}
+		}
+	}
+
+	if (pQueue) {
+		it = pQueue->begin();
+		return true;
+	}
+
+	return false;
+}
+
+bool CXMPPOutboundQueue::Pop(bool bByPriority, SXMPPQueuedStanza &Stanza) {
+	TStanzaQueue *pQueue;
+	TStanzaQueue::iterator it;
+	if (!Next(bByPriority, pQueue, it)) {
+		return false;
+	}
+
+	/* Handed over without copying, the emptied entry is then removed */
+	m_uBytes -= it->sData.size();
+	Stanza.sData.swap(it->sData);
+	it->sData.clear();
+	Stanza.sFrom = it->sFrom;
+	Stanza.uSequence = it->uSequence;
+	Stanza.bStanza = it->bStanza;
+	Stanza.bRemoved = false;
+
+	/* Whatever goes next is the oldest under its key */
+	TQueuedFromMap::iterator from = m_mQueuedFrom.find(GetOrderKey(it->sFrom));
+	Oldest(from->second);
+	from->second.pop_front();
+	if (from->second.empty()) {
+		m_mQueuedFrom.erase(from);
+	}
+
+	Remove(*pQueue, it);
+	return true;
+}
+
+void CXMPPOutboundQueue::Remove(TStanzaQueue &Queue, TStanzaQueue::iterator it) {
+	std::unordered_map<CString, unsigned long long, std::hash<std::string>>::iterator presence = m_mPresenceFrom.find(it->sFrom.AsLower());
+	if (presence != m_mPresenceFrom.end() && presence->second == it->uSequence) {
+		m_mPresenceFrom.erase(presence);
+	}
+
+	m_uBytes -= it->sData.size();
+	m_uStanzas--;
+
+	if (!m_uStanzas) {
+		/* Nothing left worth keeping track of */
+		Clear();
+	} else if (it == Queue.begin()) {
+		Queue.pop_front();
+	} else {
+		CString().swap(it->sData);
+		it->bRemoved = true;
+		m_uMarked++;
+
+		if (m_uMarked + m_suRemoved.size() > m_uStanzas + COMPACT_SLACK) {
+			Compact();
+		}
+	}
+}
+
+void CXMPPOutboundQueue::Compact() {
+	for (TStanzaQueue &Queue : m_adQueues) {
+		Queue.erase(std::remove_if(Queue.begin(), Queue.end(), [](const SXMPPQueuedStanza &stanza) {
+			return stanza.bRemoved;
+		}), Queue.end());
+	}
+
+	for (TQueuedFromMap::iterator from = m_mQueuedFrom.begin(); from != m_mQueuedFrom.end();) {
+		std::deque<unsigned long long> &vSequences = from->second;
+		vSequences.erase(std::remove_if(vSequences.begin(), vSequences.end(), [&](unsigned long long uSequence) {
+			return m_suRemoved.count(uSequence) != 0;
+		}), vSequences.end());
+
+		if (vSequences.empty()) {
+			from = m_mQueuedFrom.erase(from);
+		} else {
+			++from;
+		}
+	}
+
+	m_suRemoved.clear();
+	m_uMarked = 0;
+}
+
+bool CXMPPOutboundQueue::CollapsePresence(const CString &sFrom) {
+	std::unordered_map<CString, unsigned long long, std::hash<std::string>>::iterator presence = m_mPresenceFrom.find(sFrom.AsLower());
+	if (presence == m_mPresenceFrom.end()) {
+		return false;
+	}
+
+	TStanzaQueue &Queue = m_adQueues[XMPP_TRAFFIC_PRESENCE];
+	TStanzaQueue::iterator it = std::lower_bound(Queue.begin(), Queue.end(), presence->second, [](const SXMPPQueuedStanza &stanza, unsigned long long uSequence) {
+		return stanza.uSequence < uSequence;
+	});
+
+	m_suRemoved.insert(it->uSequence);
+	Remove(Queue, it);
+	return true;
+}
+
+bool CXMPPOutboundQueue::DropPresence() {
+	TStanzaQueue &Queue = m_adQueues[XMPP_TRAFFIC_PRESENCE];
+	while (!Queue.empty() && Queue.front().bRemoved) {
+		Queue.pop_front();
+		m_uMarked--;
+	}
+
+	if (Queue.empty()) {
+		return false;
+	}
+
+	m_suRemoved.insert(Queue.front().uSequence);
+	Remove(Queue, Queue.begin());
+	return true;
+}
+
+void CXMPPOutboundQueue::Clear() {
+	for (TStanzaQueue &Queue : m_adQueues) {
+		Queue.clear();
+	}
+
+	m_mQueuedFrom.clear();
+	m_suRemoved.clear();
+	m_mPresenceFrom.clear();
+	m_uMarked = 0;
+	m_uStanzas = 0;
+	m_uBytes = 0;
+}
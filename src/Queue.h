@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <znc/ZNCString.h>
+
+/* Outbound traffic classes, most urgent first */
+typedef enum {
+	XMPP_TRAFFIC_DIRECT,     /* chat messages, iq and stream level stanzas */
+	XMPP_TRAFFIC_GROUPCHAT,
+	XMPP_TRAFFIC_PRESENCE,
+	XMPP_TRAFFIC_CLASSES
+} EXMPPTraffic;
+
+struct SXMPPQueuedStanza {
+	CString sData;
+	CString sFrom;
+	unsigned long long uSequence;
+	bool bStanza;
+	/* Taken out from behind the front, skipped once it gets there */
+	bool bRemoved;
+};
+
+/*
+ * Serialized stanzas held back for a slow client. They leave by traffic
+ * class, but never ahead of an older stanza from the same bare JID. Keying
+ * the order on the bare JID keeps everything a MUC room sends in order,
+ * whichever occupant it comes from, so a join's occupant list and its
+ * status 110 self-presence always arrive before the room's history and
+ * subject.
+ *
+ * Stanzas leaving from behind the front of a class are only marked, and
+ * discarded when they reach it, so that collapsing a presence storm does
+ * not shuffle the rest of the queue for every stanza.
+ */
+class CXMPPOutboundQueue {
+public:
+	CXMPPOutboundQueue();
+
+	void Push(const CString &sData, EXMPPTraffic eClass, const CString &sFrom, bool bStanza);
+	/* Take the stanza to send next, by priority or in plain arrival order. False when empty. */
+	bool Pop(bool bByPriority, SXMPPQueuedStanza &Stanza);
+
+	/* Forget the latest queued presence from sFrom (a full JID), false if there is none. */
+	bool CollapsePresence(const CString &sFrom);
+	/* Forget the oldest queued presence, false if there is none. */
+	bool DropPresence();
+	void Clear();
+
+	bool IsEmpty() const { return m_uStanzas == 0; }
+	size_t GetStanzas() const { return m_uStanzas; }
+	size_t GetBytes() const { return m_uBytes; }
+	size_t GetPeakBytes() const { return m_uPeakBytes; }
+
+	/* The key that queued stanzas keep their order by */
+	static CString GetOrderKey(const CString &sFrom);
+
+protected:
+	typedef std::deque<SXMPPQueuedStanza> TStanzaQueue;
+
+	typedef std::unordered_map<CString, std::deque<unsigned long long>, std::hash<std::string>> TQueuedFromMap;
+
+	/* Marked stanzas tolerated beyond the live ones before they are swept out */
+	static const size_t COMPACT_SLACK = 64;
+
+	/* Find the stanza to send next, false when nothing is queued. */
+	bool Next(bool bByPriority, TStanzaQueue *&pQueue, TStanzaQueue::iterator &it);
+	/* The oldest stanza still queued under a key, which must have one */
+	unsigned long long Oldest(std::deque<unsigned long long> &vSequences);
+	void Remove(TStanzaQueue &Queue, TStanzaQueue::iterator it);
+	void Compact();
+
+	TStanzaQueue       m_adQueues[XMPP_TRAFFIC_CLASSES];
+	/* Sequence numbers of the stanzas queued under each order key, oldest first */
+	TQueuedFromMap     m_mQueuedFrom;
+	/* Removed stanzas whose sequence numbers are still in m_mQueuedFrom */
+	std::unordered_set<unsigned long long> m_suRemoved;
+	/* The latest queued presence from each full JID, lower case */
+	std::unordered_map<CString, unsigned long long, std::hash<std::string>> m_mPresenceFrom;
+	size_t             m_uMarked;
+	unsigned long long m_uSequence;
+	size_t             m_uStanzas;
+	size_t             m_uBytes;
+	size_t             m_uPeakBytes;
+};
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include "Session.h"
+
+/* A client that never acknowledges anything should not hold on to unbounded memory */
+static const size_t MAX_UNACKED_STANZAS = 5000;
+static const size_t MAX_UNACKED_BYTES = 1024 * 1024;
+
+CXMPPSession::CXMPPSession(const CString &sId, CUser *pUser, bool bResumable) {
+	m_sId = sId;
+	m_pUser = pUser;
+	m_bResumable = bResumable;
+
+	m_pClient = NULL;
+	m_tDetached = 0;
+
+	m_uiReceived = 0;
+	m_uiSent = 0;
+	m_uUnackedBytes = 0;
+	m_bAckRequested = false;
+}
+
+void CXMPPSession::Attach(CXMPPClient &Client) {
+	m_pClient = &Client;
+	m_tDetached = 0;
+	m_sJID.clear();
+	m_sResource.clear();
+	m_vChannels.clear();
+	m_bAckRequested = false;
+}
+
+void CXMPPSession::Detach(const CString &sJID, const CString &sResource, const std::unordered_map<CXMPPChannelKey, CXMPPChannel> &mChannels) {
+	m_pClient = NULL;
+	m_tDetached = time(NULL);
+	m_sJID = sJID;
+	m_sResource = sResource;
+
+	m_vChannels.clear();
+	for (const auto &entry : mChannels) {
+		m_vChannels.push_back(entry.second);
+	}
+}
+
+const CXMPPChannel* CXMPPSession::FindChannel(const CString &sChannel) const {
+	for (const CXMPPChannel &channel : m_vChannels) {
+		if (channel.GetJID().GetUser().Equals(sChannel)) {
+			return &channel;
+		}
+	}
+
+	return NULL;
+}
+
+void CXMPPSession::Hold(const CXMPPSerializedStanza &Stanza, const CString &sFrom) {
+	CString sStanza;
+	Stanza.Render(sStanza, m_sJID, sFrom);
+
+	/* Counted as sent, so the client's acks line up once it resumes */
+	Sent(sStanza.data(), sStanza.size());
+}
+
+void CXMPPSession::Sent(const char *szData, size_t uSize) {
+	m_dsUnacked.push_back(CString(szData, uSize));
+	m_uUnackedBytes += uSize;
+	m_uiSent++;
+
+	while (m_dsUnacked.size() > MAX_UNACKED_STANZAS || m_uUnackedBytes > MAX_UNACKED_BYTES) {
+		m_uUnackedBytes -= m_dsUnacked.front().size();
+		m_dsUnacked.pop_front();
+	}
+}
+
+bool CXMPPSession::Acknowledge(unsigned int uiHandled) {
+	if ((int)(uiHandled - m_uiSent) > 0) {
+		return false;
+	}
+
+	/* Number of stanzas sent before the oldest one still held */
+	unsigned int uiOldest = m_uiSent - m_dsUnacked.size();
+
+	while (!m_dsUnacked.empty() && (int)(uiHandled - uiOldest) > 0) {
+		m_uUnackedBytes -= m_dsUnacked.front().size();
+		m_dsUnacked.pop_front();
+		uiOldest++;
+	}
+
+	return true;
+}
+
+bool CXMPPSession::IsHeldSince(unsigned int uiHandled) const {
+	unsigned int uiOldest = m_uiSent - m_dsUnacked.size();
+	return (int)(uiHandled - uiOldest) >= 0 && (int)(uiHandled - m_uiSent) <= 0;
+}
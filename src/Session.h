@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <ctime>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include <znc/User.h>
+
+#include "xmpp.h"
+
+class CXMPPClient;
+
+/*
+ * Stream Management (XEP-0198) state of one client session. It outlives the
+ * client's socket, so a client that lost its connection can resume on a new
+ * one with its resource, channels and unacknowledged stanzas intact.
+ *
+ * Stanza counters wrap at 2^32 as the XEP requires.
+ */
+class CXMPPSession {
+public:
+	CXMPPSession(const CString &sId, CUser *pUser, bool bResumable);
+
+	const CString& GetId() const { return m_sId; }
+	CUser* GetUser() const { return m_pUser; }
+	bool IsResumable() const { return m_bResumable; }
+
+	/* The client using the session, NULL while detached */
+	CXMPPClient* GetClient() const { return m_pClient; }
+	void Attach(CXMPPClient &Client);
+	/* Keep what the client needs to carry on after it is gone */
+	void Detach(const CString &sJID, const CString &sResource, const std::unordered_map<CXMPPChannelKey, CXMPPChannel> &mChannels);
+	time_t GetDetachedTime() const { return m_tDetached; }
+	const CString& GetJID() const { return m_sJID; }
+	const CString& GetResource() const { return m_sResource; }
+	const std::vector<CXMPPChannel>& GetChannels() const { return m_vChannels; }
+	/* A channel the client was in when it went away, NULL if it was not in it */
+	const CXMPPChannel* FindChannel(const CString &sChannel) const;
+	/* A stanza for the detached client, kept with the unacked ones to be resent when it resumes */
+	void Hold(const CXMPPSerializedStanza &Stanza, const CString &sFrom);
+
+	/* Stanzas received from the client */
+	void Received() { m_uiReceived++; }
+	unsigned int GetReceived() const { return m_uiReceived; }
+
+	/* Stanzas sent to the client, kept until it acknowledges them */
+	void Sent(const char *szData, size_t uSize);
+	unsigned int GetSent() const { return m_uiSent; }
+	/* Drop everything up to h, false when h acknowledges stanzas that were never sent. */
+	bool Acknowledge(unsigned int uiHandled);
+	/* Whether every stanza after h can still be resent, the oldest are dropped past a bound. */
+	bool IsHeldSince(unsigned int uiHandled) const;
+	const std::deque<CString>& GetUnacked() const { return m_dsUnacked; }
+
+	bool IsAckRequested() const { return m_bAckRequested; }
+	void SetAckRequested(bool bRequested) { m_bAckRequested = bRequested; }
+
+protected:
+	CString m_sId;
+	CUser *m_pUser;
+	bool m_bResumable;
+
+	CXMPPClient *m_pClient;
+	time_t m_tDetached;
+	CString m_sJID;
+	CString m_sResource;
+	std::vector<CXMPPChannel> m_vChannels;
+
+	unsigned int m_uiReceived;
+	unsigned int m_uiSent;
+	/* The last m_dsUnacked.size() stanzas sent, oldest first */
+	std::deque<CString> m_dsUnacked;
+	size_t m_uUnackedBytes;
+	bool m_bAckRequested;
+};
+
+#endif
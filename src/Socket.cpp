@@ -11,49 +11,81 @@
 
 /* libxml2 handlers */
 
-static void _start_element(void *userdata, const xmlChar *name, const xmlChar **attrs) {
+/* Element and attribute names keep their prefix, as in "stream:stream" or "xml:lang" */
+static const CXMPPAtom* _intern_name(const xmlChar *prefix, const xmlChar *localname, CXMPPSocket *pSocket) {
+	if (!prefix) {
+		return pSocket->InternName((const char *)localname, strlen((const char *)localname));
+	}
+
+	CString sName = CString((const char *)prefix) + ":" + (const char *)localname;
+	return pSocket->InternName(sName.data(), sName.size());
+}
+
+static void _set_attributes(CXMPPSocket *pSocket, CXMPPStanza &Stanza, int nb_attributes, const xmlChar **attributes) {
+	/* Each attribute is (localname, prefix, URI, value, end), the value is not NUL terminated */
+	for (int i = 0; i < nb_attributes; i++, attributes += 5) {
+		const CXMPPAtom *pName = _intern_name(attributes[1], attributes[0], pSocket);
+		const char *szValue = (const char *)attributes[3];
+		size_t uSize = (const char *)attributes[4] - szValue;
+
+		if (!memchr(szValue, '&', uSize)) {
+			Stanza.SetAttribute(pName, szValue, uSize);
+			continue;
+		}
+
+		/* Without entity substitution libxml2 hands us &amp; as a character reference */
+		CString sValue(szValue, uSize);
+		sValue.Replace("&#38;", "&");
+		Stanza.SetAttribute(pName, sValue);
+	}
+}
+
+static void _start_element(void *userdata, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI,
+		int nb_namespaces, const xmlChar **namespaces, int nb_attributes, int nb_defaulted, const xmlChar **attributes) {
 	CXMPPSocket *pSocket = (CXMPPSocket*)userdata;
+	CXMPPArena &Arena = pSocket->GetArena();
+	const CXMPPAtom *pNamespace = NULL;
+
+	if (URI) {
+		pNamespace = pSocket->InternName((const char *)URI, strlen((const char *)URI));
+	}
 
 	if (pSocket->GetDepth() == 0) {
-		if (strcmp((char*)name, "stream:stream") != 0) {
-			DEBUG("XMPPClient: Socket did not open valid stream. [" << name << "]");
+		if (strcmp((const char *)localname, "stream") != 0 || !pNamespace || !pNamespace->Equals(CXMPPAtom::NSStream)) {
+			DEBUG("XMPPClient: Socket did not open valid stream. [" << localname << "]");
 			pSocket->Close(Csock::CLT_AFTERWRITE);
 			pSocket->IncrementDepth(); /* Incrmement because otherwise end_element will be confused */
 			return;
 		}
 
-		CXMPPStanza Stanza;
-		Stanza.SetName("stream:stream");
-		if (attrs) {
-			Stanza.SetAttributes(attrs);
-		}
+		CXMPPStanza Stanza(CXMPPAtom::Stream, CXMPPAtom::NSStream);
+		_set_attributes(pSocket, Stanza, nb_attributes, attributes);
 
 		pSocket->StreamStart(Stanza);
-	} else if (!pSocket->GetStanza()) {
-		/* New top level stanza */
-		CXMPPStanza *pStanza = new CXMPPStanza((char *)name);
-
-		pSocket->SetStanza(pStanza);
-
-		if (attrs) {
-			pStanza->SetAttributes(attrs);
-		}
 	} else {
-		/* New child stanza */
-		CXMPPStanza& child = pSocket->GetStanza()->NewChild((char *)name);
-		pSocket->SetStanza(&child);
-
-		if (attrs) {
-			child.SetAttributes(attrs);
+		CXMPPStanza *pStanza;
+
+		if (!pSocket->GetStanza()) {
+			/* New top level stanza, the whole tree is built in the socket's arena */
+			pStanza = Arena.New<CXMPPStanza>(Arena);
+		} else {
+			/* New child stanza */
+			pStanza = &pSocket->GetStanza()->NewChild((const char *)NULL);
 		}
+
+		pStanza->SetName(_intern_name(prefix, localname, pSocket));
+		pStanza->SetNamespace(pNamespace);
+		_set_attributes(pSocket, *pStanza, nb_attributes, attributes);
+
+		pSocket->SetStanza(pStanza);
 	}
 
-	DEBUG("libxml (" << pSocket->GetDepth() << ") start_element: [" << name << "]");
+	XMPPTRACE(pSocket, XMPP_TRACE_PARSER, "(" << pSocket->GetDepth() << ") start_element: [" << localname << "]");
 
 	pSocket->IncrementDepth();
 }
 
-static void _end_element(void *userdata, const xmlChar *name) {
+static void _end_element(void *userdata, const xmlChar *localname, const xmlChar *prefix, const xmlChar *URI) {
 	CXMPPSocket *pSocket = (CXMPPSocket*)userdata;
 
 	pSocket->DeincrementDepth();
@@ -70,24 +102,41 @@ static void _end_element(void *userdata, const xmlChar *name) {
 		pSocket->SetStanza(NULL);
 
 		pSocket->ReceiveStanza(*pStanza);
-		delete pStanza;
+
+		/* Release the tree in one go */
+		pStanza->~CXMPPStanza();
+		pSocket->GetArena().Reset();
 	}
 
-	DEBUG("libxml (" << pSocket->GetDepth() << ") end_element: [" << name << "]");
+	XMPPTRACE(pSocket, XMPP_TRACE_PARSER, "(" << pSocket->GetDepth() << ") end_element: [" << localname << "]");
 }
 
 static void _characters(void *userdata, const xmlChar *chr, int len) {
 	CXMPPSocket *pSocket = (CXMPPSocket*)userdata;
 
-	if (pSocket->GetStanza()) {
-		CXMPPStanza &Stanza = pSocket->GetStanza()->NewChild();
-		Stanza.SetText(CString((char*)chr, len));
+	CXMPPStanza *pStanza = pSocket->GetStanza();
+
+	if (pStanza) {
+		/* libxml2 splits text runs at buffer and entity boundaries, keep them in one node */
+		CXMPPStanza *pLast = pStanza->GetLastChild();
+
+		if (pLast && pLast->IsText()) {
+			pLast->AppendText((const char *)chr, len);
+		} else {
+			pStanza->NewChild((const char *)NULL).SetText((const char *)chr, len);
+		}
 	}
 }
 
-CXMPPSocket::CXMPPSocket(CModule *pModule) : CSocket(pModule) {
+CXMPPSocket::CXMPPSocket(CModule *pModule) : CSocket(pModule), m_Arena(8192) {
 	m_uiDepth = 0;
 	m_pStanza = NULL;
+	m_uiTraceMask = GetModule()->GetTraceMask("");
+	m_uiCorkDepth = 0;
+	m_pCompression = NULL;
+
+	m_uiCollapsedPresences = 0;
+	m_uiDroppedPresences = 0;
 
 	DisableReadLine();
 
@@ -95,50 +144,295 @@ CXMPPSocket::CXMPPSocket(CModule *pModule) : CSocket(pModule) {
 	m_bResetParser = true;
 
 	memset(&m_xmlHandlers, 0, sizeof(xmlSAXHandler));
-	m_xmlHandlers.startElement = _start_element;
-	m_xmlHandlers.endElement = _end_element;
+	m_xmlHandlers.initialized = XML_SAX2_MAGIC;
+	m_xmlHandlers.startElementNs = _start_element;
+	m_xmlHandlers.endElementNs = _end_element;
 	m_xmlHandlers.characters = _characters;
 }
 
 CXMPPSocket::~CXMPPSocket() {
-	xmlFreeParserCtxt(m_xmlContext);
+	if (m_xmlContext) {
+		GetModule()->GetParserPool().Release(m_xmlContext);
+	}
 
-	/* We might have a leftover stanza */
-	if (m_pStanza) {
-		while (m_pStanza->GetParent()) {
-			m_pStanza = m_pStanza->GetParent();
-		}
+	delete m_pCompression;
 
-		delete m_pStanza;
-	}
+	/* A leftover partial stanza is released along with m_Arena */
 }
 
 CString CXMPPSocket::GetServerName() const {
 	return GetModule()->GetServerName();
 }
 
+const CXMPPAtom* CXMPPSocket::InternName(const char *szData, size_t uSize) {
+	if (!CanInternNames()) {
+		/* Unknown names stay in the arena and go with the stanza */
+		return CXMPPAtom::Lookup(szData, uSize, m_Arena);
+	}
+
+	return CXMPPAtom::Intern(szData, uSize, m_Arena);
+}
+
 void CXMPPSocket::ReadData(const char *data, size_t len) {
 	if (m_bResetParser) {
 		m_uiDepth = 0;
+		m_pStanza = NULL;
+		m_Arena.Reset();
 
 		if (m_xmlContext) {
-			xmlFreeParserCtxt(m_xmlContext);
+			/* Stream restart after STARTTLS or SASL, keep the context and its buffers */
+			CXMPPParserPool::Restart(m_xmlContext, this);
+		} else {
+			m_xmlContext = GetModule()->GetParserPool().Acquire(&m_xmlHandlers, this);
 		}
 
-		m_xmlContext = xmlCreatePushParserCtxt(&m_xmlHandlers, this, NULL, 0, NULL);
-
 		m_bResetParser = false;
 	}
 
-	xmlParseChunk(m_xmlContext, data, len, 0);
+	if (!m_pCompression) {
+		xmlParseChunk(m_xmlContext, data, len, 0);
+		return;
+	}
+
+	m_pCompression->SetInput(data, len);
+
+	const char *szInflated;
+	size_t uInflated;
+	while (!IsClosed()) {
+		if (!m_pCompression->Inflate(szInflated, uInflated)) {
+			DEBUG("XMPPSocket: bad compressed data from [" << GetRemoteIP() << "]");
+			Close(Csock::CLT_NOW);
+			return;
+		}
+
+		if (!uInflated) {
+			break;
+		}
+
+		xmlParseChunk(m_xmlContext, szInflated, uInflated, 0);
+	}
+}
+
+void CXMPPSocket::StartCompression(CXMPPCompression *pCompression) {
+	Flush();
+
+	delete m_pCompression;
+	m_pCompression = pCompression;
+}
+
+bool CXMPPSocket::Transmit(const char *szData, size_t uSize, bool bFlush) {
+	if (!m_pCompression) {
+		return !uSize || CSocket::Write(szData, uSize);
+	}
+
+	m_sCompressed.clear();
+	if (!m_pCompression->Deflate(szData, uSize, bFlush, m_sCompressed)) {
+		DEBUG("XMPPSocket: compression failed for [" << GetRemoteIP() << "]");
+		Close(Csock::CLT_NOW);
+		return false;
+	}
+
+	return m_sCompressed.empty() || CSocket::Write(m_sCompressed.data(), m_sCompressed.size());
+}
+
+static EXMPPTraffic ClassifyStanza(bool bMessage, bool bPresence, const CXMPPAtom *pType) {
+	if (bPresence) {
+		return XMPP_TRAFFIC_PRESENCE;
+	} else if (bMessage && pType == CXMPPAtom::GroupChat) {
+		return XMPP_TRAFFIC_GROUPCHAT;
+	}
+
+	return XMPP_TRAFFIC_DIRECT;
+}
+
+/* Only these count as stanzas for acknowledgements, not stream level elements */
+static bool IsStanzaName(const CXMPPAtom *pName) {
+	return pName == CXMPPAtom::Message || pName == CXMPPAtom::Presence || pName == CXMPPAtom::IQ;
 }
 
 bool CXMPPSocket::Write(const CXMPPStanza &Stanza) {
-	return Write(Stanza.ToString());
+	bool bStanza = IsStanzaName(Stanza.GetNameAtom());
+
+	if (IsBacklogged()) {
+		CString sData;
+		Stanza.Serialize(sData);
+
+		EXMPPTraffic eClass = ClassifyStanza(Stanza.IsName(CXMPPAtom::Message), Stanza.IsName(CXMPPAtom::Presence), Stanza.GetAttributeAtom(CXMPPAtom::Type));
+		return Enqueue(sData, eClass, Stanza.GetAttribute(CXMPPAtom::From), bStanza);
+	}
+
+	size_t uOffset = m_sWriteBuffer.size();
+	Stanza.Serialize(m_sWriteBuffer);
+
+	if (bStanza) {
+		StanzaSent(m_sWriteBuffer.data() + uOffset, m_sWriteBuffer.size() - uOffset);
+	}
+
+	return IsCorked() || SendGathered();
+}
+
+bool CXMPPSocket::Write(const CXMPPSerializedStanza &Stanza, const CString &sTo, const CString &sFrom, const CString &sId) {
+	bool bStanza = Stanza.IsName(CXMPPAtom::Message) || Stanza.IsName(CXMPPAtom::Presence) || Stanza.IsName(CXMPPAtom::IQ);
+
+	if (IsBacklogged()) {
+		CString sData;
+		Stanza.Render(sData, sTo, sFrom, sId);
+
+		EXMPPTraffic eClass = ClassifyStanza(Stanza.IsName(CXMPPAtom::Message), Stanza.IsName(CXMPPAtom::Presence), Stanza.GetTypeAtom());
+		return Enqueue(sData, eClass, sFrom, bStanza);
+	}
+
+	size_t uOffset = m_sWriteBuffer.size();
+	Stanza.Render(m_sWriteBuffer, sTo, sFrom, sId);
+
+	if (bStanza) {
+		StanzaSent(m_sWriteBuffer.data() + uOffset, m_sWriteBuffer.size() - uOffset);
+	}
+
+	return IsCorked() || SendGathered();
+}
+
+bool CXMPPSocket::Write(const CString &sString, bool bStanza) {
+	if (IsBacklogged()) {
+		return Enqueue(sString, XMPP_TRAFFIC_DIRECT, "", bStanza);
+	}
+
+	m_sWriteBuffer.append(sString);
+
+	if (bStanza) {
+		StanzaSent(sString.data(), sString.size());
+	}
+
+	return IsCorked() || SendGathered();
+}
+
+bool CXMPPSocket::WriteKeepalive() {
+	if (IsBacklogged()) {
+		/* There is traffic waiting to go out, that keeps the stream alive */
+		return true;
+	}
+
+	return Write(" ");
+}
+
+bool CXMPPSocket::IsBacklogged() {
+	if (!m_Queue.IsEmpty()) {
+		DrainQueue();
+	}
+
+	return !m_Queue.IsEmpty() || m_sWriteBuffer.size() + GetInternalWriteBuffer().size() >= GetModule()->GetQueueLimits().uHighWater;
+}
+
+void CXMPPSocket::SendQueued(const SXMPPQueuedStanza &Stanza, bool bFlush) {
+	Transmit(Stanza.sData.data(), Stanza.sData.size(), bFlush);
+	if (Stanza.bStanza) {
+		StanzaSent(Stanza.sData.data(), Stanza.sData.size());
+	}
+}
+
+void CXMPPSocket::DrainQueue() {
+	size_t uHighWater = GetModule()->GetQueueLimits().uHighWater;
+	size_t uDeflated = 0;
+	bool bWritten = false;
+	SXMPPQueuedStanza stanza;
+
+	/* Compressed output only shows up in the write buffer at the flush, so
+	 * until then what went into the compressor counts towards the mark */
+	while (GetInternalWriteBuffer().size() + uDeflated < uHighWater && m_Queue.Pop(true, stanza)) {
+		SendQueued(stanza, false);
+		if (m_pCompression) {
+			uDeflated += stanza.sData.size();
+		}
+		bWritten = true;
+	}
+
+	if (bWritten) {
+		/* One sync flush for everything drained */
+		Transmit("", 0, true);
+	}
+}
+
+bool CXMPPSocket::Enqueue(const CString &sData, EXMPPTraffic eClass, const CString &sFrom, bool bStanza) {
+	if (IsClosed()) {
+		return false;
+	}
+
+	/* Anything gathered before the backlog started has to go out first */
+	if (!m_sWriteBuffer.empty()) {
+		m_Queue.Push(m_sWriteBuffer, XMPP_TRAFFIC_DIRECT, "", false);
+		m_sWriteBuffer.clear();
+	}
+
+	/* A newer presence from the same JID makes the queued one moot */
+	if (eClass == XMPP_TRAFFIC_PRESENCE && (GetModule()->GetQueueLimits().uiPolicy & XMPP_QUEUE_COLLAPSE_PRESENCE) && m_Queue.CollapsePresence(sFrom)) {
+		m_uiCollapsedPresences++;
+	}
+
+	m_Queue.Push(sData, eClass, sFrom, bStanza);
+
+	return EnforceQueueLimits();
+}
+
+bool CXMPPSocket::IsOverQueueBudget() const {
+	const SXMPPQueueLimits &limits = GetModule()->GetQueueLimits();
+	return m_Queue.GetBytes() > limits.uMaxBytes || m_Queue.GetStanzas() > limits.uMaxStanzas;
+}
+
+bool CXMPPSocket::EnforceQueueLimits() {
+	unsigned int uiPolicy = GetModule()->GetQueueLimits().uiPolicy;
+
+	if (uiPolicy & XMPP_QUEUE_DROP_PRESENCE) {
+		/* Oldest presence first, it is the most likely to be stale */
+		while (IsOverQueueBudget() && m_Queue.DropPresence()) {
+			m_uiDroppedPresences++;
+		}
+	}
+
+	if (IsOverQueueBudget() && (uiPolicy & XMPP_QUEUE_DISCONNECT)) {
+		DEBUG("XMPPSocket: dropping slow client [" << GetRemoteIP() << "] with " << m_Queue.GetStanzas() << " stanzas (" << m_Queue.GetBytes() << " bytes) queued");
+		m_Queue.Clear();
+		Close(Csock::CLT_NOW);
+		return false;
+	}
+
+	return true;
+}
+
+void CXMPPSocket::Uncork() {
+	if (m_uiCorkDepth > 0 && --m_uiCorkDepth == 0) {
+		/* Whatever the batch queued is left to the high water mark */
+		SendGathered();
+		DrainQueue();
+	}
 }
 
-bool CXMPPSocket::Write(const CString &sString) {
-	return CSocket::Write(sString);
+bool CXMPPSocket::SendGathered() {
+	if (m_sWriteBuffer.empty()) {
+		return true;
+	}
+
+	/* One sync flush for the whole batch when compressing. The buffer is
+	 * only emptied, its capacity is kept for the next write */
+	bool bResult = Transmit(m_sWriteBuffer.data(), m_sWriteBuffer.size(), true);
+	m_sWriteBuffer.clear();
+	return bResult;
+}
+
+bool CXMPPSocket::Flush() {
+	/* An explicit flush overrides the high water mark, and priorities */
+	SXMPPQueuedStanza stanza;
+	bool bWritten = false;
+	while (m_Queue.Pop(false, stanza)) {
+		SendQueued(stanza, false);
+		bWritten = true;
+	}
+
+	if (bWritten && m_sWriteBuffer.empty()) {
+		/* Push the queued data through the compressor */
+		return Transmit("", 0, true);
+	}
+
+	return SendGathered();
 }
 
 void CXMPPSocket::StreamStart(CXMPPStanza &Stanza) {
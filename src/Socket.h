@@ -6,13 +6,19 @@
  * by the Free Software Foundation.
  */
 
+#ifndef _SOCKET_H
+#define _SOCKET_H
+
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 
 #include <znc/User.h>
 #include <znc/znc.h>
 
+#include "Compression.h"
+#include "Queue.h"
 #include "Stanza.h"
+#include "Trace.h"
 
 class CXMPPModule;
 
@@ -26,13 +32,62 @@ public:
 
 	virtual void ReadData(const char *data, size_t len);
 
+	/*
+	 * Names read from the wire. Only a peer we trust may add to the
+	 * process wide atom table, anybody else's names are scoped to m_Arena.
+	 */
+	const CXMPPAtom* InternName(const char *szData, size_t uSize);
+	virtual bool CanInternNames() const { return false; }
+
 	bool Write(const CXMPPStanza& Stanza);
-	bool Write(const CString &sString);
+	bool Write(const CXMPPSerializedStanza& Stanza, const CString &sTo, const CString &sFrom = "", const CString &sId = "");
+	/* Raw data, bStanza marks an already serialized message, presence or iq */
+	bool Write(const CString &sString, bool bStanza = false);
+	bool WriteKeepalive();
+
+	/* While corked, writes are gathered and sent as one on the outermost Uncork(). */
+	void Cork() { m_uiCorkDepth++; }
+	void Uncork();
+	bool IsCorked() const { return m_uiCorkDepth > 0; }
+	/*
+	 * Send the queue and whatever has been gathered right away, in the
+	 * order it was written. Only for STARTTLS, compression and closing,
+	 * everything else leaves the queue to DrainQueue().
+	 */
+	bool Flush();
+
+	/*
+	 * Once the socket's own buffer passes the high water mark, stanzas are
+	 * held here instead and trickled out by DrainQueue() as the client
+	 * catches up, within the module's SXMPPQueueLimits. Queued stanzas go
+	 * out by traffic class, but never ahead of an older stanza from the
+	 * same bare JID (see CXMPPOutboundQueue).
+	 */
+	bool IsBacklogged();
+	void DrainQueue();
+	size_t GetQueuedStanzas() const { return m_Queue.GetStanzas(); }
+	size_t GetQueuedBytes() const { return m_Queue.GetBytes(); }
+	size_t GetQueuePeakBytes() const { return m_Queue.GetPeakBytes(); }
+	unsigned int GetCollapsedPresences() const { return m_uiCollapsedPresences; }
+	unsigned int GetDroppedPresences() const { return m_uiDroppedPresences; }
+
+	/*
+	 * Compress everything from here on, after flushing what was written
+	 * so far in the clear. The socket takes ownership of pCompression.
+	 * Reads are inflated before the parser sees them, and writes are
+	 * deflated with one sync flush per Flush().
+	 */
+	void StartCompression(CXMPPCompression *pCompression);
+	bool IsCompressed() const { return m_pCompression != NULL; }
 
 	unsigned int GetDepth() const { return m_uiDepth; }
 	void IncrementDepth() { m_uiDepth++; }
 	void DeincrementDepth() { m_uiDepth--; }
 
+	unsigned int GetTraceMask() const { return m_uiTraceMask; }
+	void SetTraceMask(unsigned int uiMask) { m_uiTraceMask = uiMask; }
+
+	CXMPPArena& GetArena() { return m_Arena; }
 	CXMPPStanza* GetStanza() const { return m_pStanza; }
 	void SetStanza(CXMPPStanza *pStanza) { m_pStanza = pStanza; }
 
@@ -42,12 +97,58 @@ public:
 	virtual void ReceiveStanza(CXMPPStanza &Stanza);
 
 protected:
+	/*
+	 * Called with each message, presence or iq as it is handed to the
+	 * socket, in the order the client will receive them. Queued stanzas
+	 * are only reported once they leave the queue.
+	 */
+	virtual void StanzaSent(const char *szData, size_t uSize) {}
+
+	/* Hand data to the Csock, through the compressor if there is one */
+	bool Transmit(const char *szData, size_t uSize, bool bFlush);
+	/* Send m_sWriteBuffer, leaving the queue alone */
+	bool SendGathered();
+
+	bool Enqueue(const CString &sData, EXMPPTraffic eClass, const CString &sFrom, bool bStanza);
+	/* Hand over a stanza that left the queue */
+	void SendQueued(const SXMPPQueuedStanza &Stanza, bool bFlush);
+	bool EnforceQueueLimits();
+	bool IsOverQueueBudget() const;
+
 	xmlParserCtxtPtr m_xmlContext;
 	xmlSAXHandler    m_xmlHandlers;
 
 	unsigned int     m_uiDepth;
+	CXMPPArena       m_Arena;
 	CXMPPStanza     *m_pStanza;
 
 	bool             m_bResetParser;
+	unsigned int     m_uiTraceMask;
+
+	/* Reused between writes so serializing does not allocate once warmed up */
+	CString          m_sWriteBuffer;
+	unsigned int     m_uiCorkDepth;
+
+	CXMPPCompression *m_pCompression;
+	/* Deflated output, reused like m_sWriteBuffer */
+	CString          m_sCompressed;
+
+	CXMPPOutboundQueue m_Queue;
+	unsigned int     m_uiCollapsedPresences;
+	unsigned int     m_uiDroppedPresences;
+};
+
+/* Corks a socket for the lifetime of the batch, so a burst of stanzas is a single write. */
+class CXMPPWriteBatch {
+public:
+	CXMPPWriteBatch(CXMPPSocket &Socket) : m_Socket(Socket) { m_Socket.Cork(); }
+	~CXMPPWriteBatch() { m_Socket.Uncork(); }
+
+	CXMPPWriteBatch(const CXMPPWriteBatch&) = delete;
+	CXMPPWriteBatch& operator=(const CXMPPWriteBatch&) = delete;
+
+protected:
+	CXMPPSocket &m_Socket;
 };
 
+#endif
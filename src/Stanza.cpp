@@ -6,167 +6,433 @@
  * by the Free Software Foundation.
  */
 
+#include <algorithm>
+#include <cstring>
+
 #include "Stanza.h"
 
 CXMPPStanza::CXMPPStanza(CString sName, CString sNamespace) {
-	m_pParent = NULL;
 	m_eType = XMPP_STANZA_UNKNOWN;
+	m_pArena = new CXMPPArena(1024);
+	m_bOwnsArena = true;
+	m_pName = m_pNamespace = NULL;
+	m_uTextCapacity = 0;
+	m_pParent = NULL;
+	m_pAttributes = m_aInlineAttributes;
+	m_uAttributes = 0;
+	m_uAttributeCapacity = INLINE_ATTRIBUTES;
+	m_pFirstChild = m_pLastChild = m_pNextSibling = NULL;
 
 	if (!sName.empty()) {
 		SetName(sName);
 	}
 
 	if (!sNamespace.empty()) {
-		SetAttribute("xmlns", sNamespace);
+		SetAttribute(CXMPPAtom::Xmlns, sNamespace);
+	}
+}
+
+CXMPPStanza::CXMPPStanza(const CXMPPAtom *pName, const CXMPPAtom *pNamespace) {
+	m_eType = XMPP_STANZA_UNKNOWN;
+	m_pArena = new CXMPPArena(1024);
+	m_bOwnsArena = true;
+	m_pName = NULL;
+	m_pNamespace = pNamespace;
+	m_uTextCapacity = 0;
+	m_pParent = NULL;
+	m_pAttributes = m_aInlineAttributes;
+	m_uAttributes = 0;
+	m_uAttributeCapacity = INLINE_ATTRIBUTES;
+	m_pFirstChild = m_pLastChild = m_pNextSibling = NULL;
+
+	SetName(pName);
+}
+
+CXMPPStanza::CXMPPStanza(CXMPPArena &Arena, const char *szName) {
+	m_eType = XMPP_STANZA_UNKNOWN;
+	m_pArena = &Arena;
+	m_bOwnsArena = false;
+	m_pName = m_pNamespace = NULL;
+	m_uTextCapacity = 0;
+	m_pParent = NULL;
+	m_pAttributes = m_aInlineAttributes;
+	m_uAttributes = 0;
+	m_uAttributeCapacity = INLINE_ATTRIBUTES;
+	m_pFirstChild = m_pLastChild = m_pNextSibling = NULL;
+
+	if (szName && *szName) {
+		SetName(szName, strlen(szName));
 	}
 }
 
 CXMPPStanza::~CXMPPStanza() {
-	/* Kill our children */
-	for (std::vector<CXMPPStanza*>::iterator it = m_vChildren.begin(); it != m_vChildren.end();) {
-		CXMPPStanza *pChild = *it;
-		it = m_vChildren.erase(it);
-		delete pChild;
+	/* Our children live in the arena and go with it */
+	if (m_bOwnsArena) {
+		delete m_pArena;
 	}
 }
 
 CString CXMPPStanza::ToString() const {
+	CString sOutput;
+	Serialize(sOutput);
+	return sOutput;
+}
+
+void CXMPPStanza::Serialize(CString &sOutput) const {
 	if (IsTag()) {
-		CString sOutput = "<" + GetName();
+		SerializeHead(sOutput);
+		SerializeTail(sOutput);
+	} else if (IsText()) {
+		AppendEscaped(sOutput, m_sData, false);
+	}
+}
 
-		for (const auto &entry : m_msAttributes) {
-			sOutput += " " + entry.first + "='" + entry.second + "'";
-		}
+void CXMPPStanza::SerializeHead(CString &sOutput) const {
+	if (!IsTag()) {
+		return;
+	}
 
-		if (m_vChildren.empty()) {
-			return sOutput + " />";
-		}
+	sOutput += '<';
+	sOutput.append(m_pName->GetData(), m_pName->GetSize());
 
-		sOutput += ">";
+	/* Namespaces are inherited, only declare them where they change */
+	if (m_pNamespace && !(m_pParent && m_pParent->IsNamespace(m_pNamespace))) {
+		sOutput += " xmlns='";
+		AppendEscaped(sOutput, CXMPPStringRef(m_pNamespace->GetData(), m_pNamespace->GetSize()), true);
+		sOutput += '\'';
+	}
 
-		for (const auto &pChild : m_vChildren) {
-			sOutput += pChild->ToString();
-		}
+	for (const SAttribute *pAttr = m_pAttributes; pAttr != m_pAttributes + m_uAttributes; pAttr++) {
+		sOutput += ' ';
+		sOutput.append(pAttr->pName->GetData(), pAttr->pName->GetSize());
+		sOutput += "='";
+		AppendEscaped(sOutput, pAttr->sValue, true);
+		sOutput += '\'';
+	}
+}
 
-		sOutput += "</" + GetName() + ">";
+void CXMPPStanza::SerializeTail(CString &sOutput) const {
+	if (!IsTag()) {
+		return;
+	}
 
-		return sOutput;
-	} else if (IsText()) {
-		return GetText();
+	if (!m_pFirstChild) {
+		sOutput += " />";
+		return;
 	}
 
-	return "";
+	sOutput += '>';
+
+	for (const CXMPPStanza *pChild = m_pFirstChild; pChild; pChild = pChild->m_pNextSibling) {
+		pChild->Serialize(sOutput);
+	}
+
+	sOutput += "</";
+	sOutput.append(m_pName->GetData(), m_pName->GetSize());
+	sOutput += '>';
+}
+
+void CXMPPStanza::AppendEscaped(CString &sOutput, const CXMPPStringRef &sData, bool bAttribute) {
+	const char *szData = sData.GetData();
+	const char *szEnd = szData + sData.GetSize();
+	const char *szRun = szData;
+
+	/* Copy unescaped runs in bulk, only splitting at characters that need an entity */
+	for (const char *p = szData; p < szEnd; p++) {
+		const char *szEntity;
+
+		switch (*p) {
+			case '&': szEntity = "&amp;"; break;
+			case '<': szEntity = "&lt;"; break;
+			case '>': szEntity = "&gt;"; break;
+			case '\'': szEntity = bAttribute ? "&apos;" : NULL; break;
+			case '"': szEntity = bAttribute ? "&quot;" : NULL; break;
+			default: szEntity = NULL; break;
+		}
+
+		if (szEntity) {
+			sOutput.append(szRun, p - szRun);
+			sOutput += szEntity;
+			szRun = p + 1;
+		}
+	}
+
+	sOutput.append(szRun, szEnd - szRun);
 }
 
 bool CXMPPStanza::SetName(CString sName) {
+	return SetName(sName.data(), sName.size());
+}
+
+bool CXMPPStanza::SetName(const char *szName, size_t uSize) {
 	if (IsTag()) {
 		return false;
 	}
 
+	return SetName(CXMPPAtom::Lookup(szName, uSize, *m_pArena));
+}
+
+bool CXMPPStanza::SetName(const CXMPPAtom *pName) {
+	if (IsTag() || !pName) {
+		return false;
+	}
+
 	m_eType = XMPP_STANZA_TAG;
-	m_sData = sName;
+	m_pName = pName;
 	return true;
 }
 
 CString CXMPPStanza::GetName() const {
 	if (IsTag()) {
-		return m_sData;
+		return m_pName->ToString();
 	}
 
 	return "";
 }
 
 bool CXMPPStanza::SetText(CString sText) {
+	return SetText(sText.data(), sText.size());
+}
+
+bool CXMPPStanza::SetText(const char *szText, size_t uSize) {
 	if (!IsTag()) {
 		m_eType = XMPP_STANZA_TEXT;
-		m_sData = sText;
+		m_sData = m_pArena->Copy(szText, uSize);
+		m_uTextCapacity = uSize + 1;
 		return true;
 	}
 
 	return false;
 }
 
+bool CXMPPStanza::AppendText(const char *szText, size_t uSize) {
+	if (IsTag()) {
+		return false;
+	}
+
+	if (!IsText()) {
+		return SetText(szText, uSize);
+	}
+
+	char *szData = (char*)m_sData.GetData();
+	size_t uLength = m_sData.GetSize() + uSize;
+
+	if (uLength + 1 > m_uTextCapacity) {
+		size_t uCapacity = std::max(uLength + 1, m_uTextCapacity * 2);
+
+		/* While the text is the last thing allocated it can grow where it is */
+		if (!m_pArena->Extend(szData, m_uTextCapacity, uCapacity - m_uTextCapacity)) {
+			char *szNew = (char*)m_pArena->Allocate(uCapacity, 1);
+			memcpy(szNew, szData, m_sData.GetSize());
+			szData = szNew;
+		}
+
+		m_uTextCapacity = uCapacity;
+	}
+
+	memcpy(szData + m_sData.GetSize(), szText, uSize);
+	szData[uLength] = '\0';
+	m_sData = CXMPPStringRef(szData, uLength);
+	return true;
+}
+
 CString CXMPPStanza::GetText() const {
 	if (IsTag()) {
 		return "";
 	}
 
-	return m_sData;
+	return m_sData.ToString();
 }
 
 CString CXMPPStanza::GetAllText() const {
 	CString text;
-	for (const auto &pChild : m_vChildren) {
+	for (const CXMPPStanza *pChild = m_pFirstChild; pChild; pChild = pChild->m_pNextSibling) {
 		if (pChild->IsText()) {
-			text += pChild->GetText();
+			text.append(pChild->m_sData.GetData(), pChild->m_sData.GetSize());
 		}
 	}
 
 	return text;
 }
 
-void CXMPPStanza::SetAttributes(const xmlChar **attrs) {
-	if (!IsTag()) {
-		return;
+CXMPPStanza::SAttribute* CXMPPStanza::FindAttribute(const char *szName, size_t uSize) const {
+	for (SAttribute *pAttr = m_pAttributes; pAttr != m_pAttributes + m_uAttributes; pAttr++) {
+		if (pAttr->pName->Equals(szName, uSize)) {
+			return pAttr;
+		}
 	}
 
-	for (unsigned int i = 0; attrs[i]; i += 2) {
-		SetAttribute((char*) attrs[i], (char*) attrs[i+1]);
+	return NULL;
+}
+
+CXMPPStanza::SAttribute* CXMPPStanza::FindAttribute(const CXMPPAtom *pName) const {
+	/* Stanzas rarely carry more than a handful of attributes, a linear scan
+	 * over pointers beats any lookup structure at that size */
+	for (SAttribute *pAttr = m_pAttributes; pAttr != m_pAttributes + m_uAttributes; pAttr++) {
+		if (pAttr->pName->Equals(pName)) {
+			return pAttr;
+		}
 	}
+
+	return NULL;
 }
 
-CString CXMPPStanza::GetAttribute(CString sName) const {
+CString CXMPPStanza::GetAttribute(const CString &sName) const {
 	if (!IsTag()) {
 		return "";
 	}
 
-	MCString::const_iterator it = m_msAttributes.find(sName);
+	if (CXMPPAtom::Xmlns->Equals(sName.data(), sName.size())) {
+		return m_pNamespace ? m_pNamespace->ToString() : "";
+	}
+
+	SAttribute *pAttr = FindAttribute(sName.data(), sName.size());
 
-	if (it == m_msAttributes.end()) {
+	if (!pAttr) {
 		return "";
 	}
 
-	return it->second;
+	return pAttr->sValue.ToString();
 }
 
-bool CXMPPStanza::HasAttribute(CString sName) const {
+bool CXMPPStanza::HasAttribute(const CString &sName) const {
 	if (!IsTag()) {
 		return false;
 	}
 
-	MCString::const_iterator it = m_msAttributes.find(sName);
+	if (CXMPPAtom::Xmlns->Equals(sName.data(), sName.size())) {
+		return m_pNamespace != NULL;
+	}
 
-	if (it == m_msAttributes.end()) {
-		return false;
+	return FindAttribute(sName.data(), sName.size()) != NULL;
+}
+
+void CXMPPStanza::SetAttribute(const CString &sName, const CString &sValue) {
+	SetAttribute(sName.data(), sName.size(), sValue.data(), sValue.size());
+}
+
+void CXMPPStanza::SetAttribute(const char *szName, size_t uNameSize, const char *szValue, size_t uValueSize) {
+	if (!IsTag()) {
+		return;
 	}
 
-	return true;
+	SetAttribute(CXMPPAtom::Lookup(szName, uNameSize, *m_pArena), szValue, uValueSize);
+}
 
+CString CXMPPStanza::GetAttribute(const CXMPPAtom *pName) const {
+	if (pName == CXMPPAtom::Xmlns) {
+		return m_pNamespace ? m_pNamespace->ToString() : "";
+	}
+
+	SAttribute *pAttr = FindAttribute(pName);
+
+	if (!pAttr) {
+		return "";
+	}
+
+	return pAttr->sValue.ToString();
+}
+
+bool CXMPPStanza::HasAttribute(const CXMPPAtom *pName) const {
+	if (pName == CXMPPAtom::Xmlns) {
+		return m_pNamespace != NULL;
+	}
+
+	return FindAttribute(pName) != NULL;
 }
 
-void CXMPPStanza::SetAttribute(CString sName, CString sValue) {
+const CXMPPAtom* CXMPPStanza::GetAttributeAtom(const CXMPPAtom *pName) const {
+	if (pName == CXMPPAtom::Xmlns) {
+		return m_pNamespace;
+	}
+
+	SAttribute *pAttr = FindAttribute(pName);
+
+	if (!pAttr) {
+		return NULL;
+	}
+
+	return CXMPPAtom::Find(pAttr->sValue.GetData(), pAttr->sValue.GetSize());
+}
+
+void CXMPPStanza::SetAttribute(const CXMPPAtom *pName, const CString &sValue) {
+	SetAttribute(pName, sValue.data(), sValue.size());
+}
+
+void CXMPPStanza::SetAttribute(const CXMPPAtom *pName, const char *szValue, size_t uValueSize) {
 	if (!IsTag()) {
 		return;
 	}
 
-	m_msAttributes[sName] = sValue;
+	if (pName == CXMPPAtom::Xmlns) {
+		/* Namespaces are few and compared often, so they are atoms too */
+		m_pNamespace = uValueSize ? CXMPPAtom::Lookup(szValue, uValueSize, *m_pArena) : NULL;
+		return;
+	}
+
+	SAttribute *pAttr = FindAttribute(pName);
+	if (pAttr) {
+		pAttr->sValue = m_pArena->Copy(szValue, uValueSize);
+		return;
+	}
+
+	if (m_uAttributes == m_uAttributeCapacity) {
+		/* Spill into the arena, the old array is simply abandoned there */
+		unsigned int uCapacity = m_uAttributeCapacity * 2;
+		SAttribute *pAttributes = (SAttribute*)m_pArena->Allocate(sizeof(SAttribute) * uCapacity, alignof(SAttribute));
+		std::copy(m_pAttributes, m_pAttributes + m_uAttributes, pAttributes);
+		m_pAttributes = pAttributes;
+		m_uAttributeCapacity = uCapacity;
+	}
+
+	/* Attributes keep their insertion order */
+	pAttr = &m_pAttributes[m_uAttributes++];
+	pAttr->pName = pName;
+	pAttr->sValue = m_pArena->Copy(szValue, uValueSize);
 }
 
 void CXMPPStanza::AddChild(CXMPPStanza &child) {
-	m_vChildren.push_back(&child);
-}
+	child.m_pNextSibling = NULL;
 
+	if (m_pLastChild) {
+		m_pLastChild->m_pNextSibling = &child;
+	} else {
+		m_pFirstChild = &child;
+	}
+	m_pLastChild = &child;
+}
 
 CXMPPStanza& CXMPPStanza::NewChild(CString sName, CString sNamespace) {
-	CXMPPStanza *pChild = new CXMPPStanza(sName, sNamespace);
+	CXMPPStanza &child = NewChild((const char*)NULL);
+
+	if (!sName.empty()) {
+		child.SetName(sName);
+	}
+
+	if (!sNamespace.empty()) {
+		child.SetAttribute(CXMPPAtom::Xmlns, sNamespace);
+	}
+
+	return child;
+}
+
+CXMPPStanza& CXMPPStanza::NewChild(const char *szName) {
+	CXMPPStanza *pChild = m_pArena->New<CXMPPStanza>(*m_pArena, szName);
 	pChild->SetParent(this);
 	AddChild(*pChild);
 	return *pChild;
 }
 
+CXMPPStanza& CXMPPStanza::NewChild(const CXMPPAtom *pName, const CXMPPAtom *pNamespace) {
+	CXMPPStanza &child = NewChild((const char*)NULL);
+	child.SetName(pName);
+	child.SetNamespace(pNamespace);
+	return child;
+}
+
 CXMPPStanza* CXMPPStanza::GetChildByName(CString sName) const {
-	for (const auto &pChild : m_vChildren) {
-		if (pChild->GetName().Equals(sName)) {
+	for (CXMPPStanza *pChild = m_pFirstChild; pChild; pChild = pChild->m_pNextSibling) {
+		if (pChild->IsTag() && pChild->m_pName->Equals(sName.data(), sName.size())) {
 			return pChild;
 		}
 	}
@@ -175,8 +441,18 @@ CXMPPStanza* CXMPPStanza::GetChildByName(CString sName) const {
 }
 
 CXMPPStanza* CXMPPStanza::GetChildByName(CString sName, CString sNamespace) const {
-	for (const auto &pChild : m_vChildren) {
-		if (pChild->GetName().Equals(sName) && pChild->GetAttribute("xmlns").Equals(sNamespace)) {
+	for (CXMPPStanza *pChild = m_pFirstChild; pChild; pChild = pChild->m_pNextSibling) {
+		if (pChild->IsTag() && pChild->m_pName->Equals(sName.data(), sName.size()) && pChild->GetAttribute(CXMPPAtom::Xmlns).Equals(sNamespace)) {
+			return pChild;
+		}
+	}
+
+	return NULL;
+}
+
+CXMPPStanza* CXMPPStanza::GetChildByName(const CXMPPAtom *pName, const CXMPPAtom *pNamespace) const {
+	for (CXMPPStanza *pChild = m_pFirstChild; pChild; pChild = pChild->m_pNextSibling) {
+		if (pChild->IsName(pName) && (!pNamespace || pChild->IsNamespace(pNamespace))) {
 			return pChild;
 		}
 	}
@@ -185,7 +461,7 @@ CXMPPStanza* CXMPPStanza::GetChildByName(CString sName, CString sNamespace) cons
 }
 
 CXMPPStanza* CXMPPStanza::GetTextChild() const {
-	for (const auto &pChild : m_vChildren) {
+	for (CXMPPStanza *pChild = m_pFirstChild; pChild; pChild = pChild->m_pNextSibling) {
 		if (pChild->IsText()) {
 			return pChild;
 		}
@@ -194,3 +470,69 @@ CXMPPStanza* CXMPPStanza::GetTextChild() const {
 	return NULL;
 }
 
+CXMPPStanza* CXMPPStanza::Clone() const {
+	CXMPPStanza *pCopy = new CXMPPStanza();
+	CopyInto(*pCopy);
+	return pCopy;
+}
+
+void CXMPPStanza::CopyInto(CXMPPStanza &Copy) const {
+	if (IsText()) {
+		Copy.SetText(m_sData.GetData(), m_sData.GetSize());
+		return;
+	}
+
+	if (!IsTag()) {
+		return;
+	}
+
+	/* Names are looked up again, an uninterned atom lives in the original's arena */
+	Copy.SetName(m_pName->GetData(), m_pName->GetSize());
+	if (m_pNamespace) {
+		Copy.SetAttribute(CXMPPAtom::Xmlns, m_pNamespace->GetData(), m_pNamespace->GetSize());
+	}
+
+	for (unsigned int i = 0; i < m_uAttributes; i++) {
+		const SAttribute &attr = m_pAttributes[i];
+		Copy.SetAttribute(attr.pName->GetData(), attr.pName->GetSize(), attr.sValue.GetData(), attr.sValue.GetSize());
+	}
+
+	for (CXMPPStanza *pChild = m_pFirstChild; pChild; pChild = pChild->m_pNextSibling) {
+		pChild->CopyInto(Copy.NewChild((const char *)NULL));
+	}
+}
+
+CXMPPSerializedStanza::CXMPPSerializedStanza(const CXMPPStanza &Stanza) {
+	m_pName = Stanza.GetNameAtom();
+	if (m_pName && !m_pName->IsInterned()) {
+		m_pName = NULL;
+	}
+	m_pType = Stanza.GetAttributeAtom(CXMPPAtom::Type);
+
+	Stanza.SerializeHead(m_sHead);
+	Stanza.SerializeTail(m_sTail);
+}
+
+void CXMPPSerializedStanza::Render(CString &sOutput, const CString &sTo, const CString &sFrom, const CString &sId) const {
+	sOutput.append(m_sHead);
+
+	if (!sTo.empty()) {
+		sOutput += " to='";
+		CXMPPStanza::AppendEscaped(sOutput, CXMPPStringRef(sTo.data(), sTo.size()), true);
+		sOutput += '\'';
+	}
+
+	if (!sFrom.empty()) {
+		sOutput += " from='";
+		CXMPPStanza::AppendEscaped(sOutput, CXMPPStringRef(sFrom.data(), sFrom.size()), true);
+		sOutput += '\'';
+	}
+
+	if (!sId.empty()) {
+		sOutput += " id='";
+		CXMPPStanza::AppendEscaped(sOutput, CXMPPStringRef(sId.data(), sId.size()), true);
+		sOutput += '\'';
+	}
+
+	sOutput.append(m_sTail);
+}
@@ -9,10 +9,18 @@
 #ifndef _STANZA_H
 #define _STANZA_H
 
-#include <libxml/parser.h>
-
 #include <znc/ZNCString.h>
 
+#include "Arena.h"
+#include "Atom.h"
+
+/*
+ * A node in a stanza tree. Every node, attribute and text run of a tree
+ * lives in a single CXMPPArena, element and attribute names are atoms. A
+ * root constructed without an arena creates and owns one, nodes
+ * constructed on an existing arena (such as the one a socket parses into)
+ * are released when that arena is reset.
+ */
 class CXMPPStanza {
 public:
 	typedef enum {
@@ -22,49 +30,136 @@ public:
 	} EStanzaType;
 
 	CXMPPStanza(CString sName = "", CString sNamespace = "");
+	CXMPPStanza(const CXMPPAtom *pName, const CXMPPAtom *pNamespace = NULL);
+	CXMPPStanza(CXMPPArena &Arena, const char *szName = NULL);
 	~CXMPPStanza();
 
+	/* Nodes are owned by their tree, they cannot be copied out of it. */
+	CXMPPStanza(const CXMPPStanza&) = delete;
+	CXMPPStanza& operator=(const CXMPPStanza&) = delete;
+
 	CString ToString() const;
 
+	/* A deep copy with its own arena, to keep a parsed stanza past the socket's arena reset. */
+	CXMPPStanza* Clone() const;
+
+	/* Append the escaped XML for this tree to sOutput in a single pass. */
+	void Serialize(CString &sOutput) const;
+	/* The opening tag up to (but excluding) its closing bracket, and the rest. */
+	void SerializeHead(CString &sOutput) const;
+	void SerializeTail(CString &sOutput) const;
+	static void AppendEscaped(CString &sOutput, const CXMPPStringRef &sData, bool bAttribute);
+
 	bool IsText() const { return m_eType == XMPP_STANZA_TEXT; }
 	bool IsTag()  const { return m_eType == XMPP_STANZA_TAG; }
 
 	bool SetName(CString sName);
+	bool SetName(const char *szName, size_t uSize);
+	bool SetName(const CXMPPAtom *pName);
 	CString GetName() const;
+	const CXMPPAtom* GetNameAtom() const { return m_pName; }
+	bool IsName(const CXMPPAtom *pName) const { return m_pName && m_pName->Equals(pName); }
+
+	/* The element's namespace, also readable and writable as the "xmlns" attribute. */
+	const CXMPPAtom* GetNamespace() const { return m_pNamespace; }
+	void SetNamespace(const CXMPPAtom *pNamespace) { m_pNamespace = pNamespace; }
+	bool IsNamespace(const CXMPPAtom *pNamespace) const { return m_pNamespace && m_pNamespace->Equals(pNamespace); }
 
 	bool SetText(CString sText);
+	bool SetText(const char *szText, size_t uSize);
+	/* Append to a text node, growing its buffer in place where possible. */
+	bool AppendText(const char *szText, size_t uSize);
 	CString GetText() const;
 	CString GetAllText() const;
 
-	CString GetData() const { return m_sData; }
-	void SetData(CString sData) { m_sData = sData; }
+	CString GetData() const { return IsTag() ? GetName() : GetText(); }
+
+	CXMPPArena& GetArena() const { return *m_pArena; }
 
 	CXMPPStanza* GetParent() const { return m_pParent; }
+	CXMPPStanza* GetFirstChild() const { return m_pFirstChild; }
+	CXMPPStanza* GetLastChild() const { return m_pLastChild; }
+	CXMPPStanza* GetNextSibling() const { return m_pNextSibling; }
 	void SetParent(CXMPPStanza *pParent) { m_pParent = pParent; }
 	CXMPPStanza& NewChild(CString sName = "", CString sNamespace = "");
+	CXMPPStanza& NewChild(const char *szName);
+	CXMPPStanza& NewChild(const CXMPPAtom *pName, const CXMPPAtom *pNamespace = NULL);
 
 	/* Get the first child of stanza with name. */
 	CXMPPStanza* GetChildByName(CString sName) const;
 	CXMPPStanza* GetChildByName(CString sName, CString sNamespace) const;
+	CXMPPStanza* GetChildByName(const CXMPPAtom *pName, const CXMPPAtom *pNamespace = NULL) const;
 	CXMPPStanza* GetTextChild() const;
 
-	CString GetAttribute(CString sName) const;
-	bool HasAttribute(CString sName) const;
-	void SetAttribute(CString sName, CString sValue);
+	CString GetAttribute(const CString &sName) const;
+	bool HasAttribute(const CString &sName) const;
+	void SetAttribute(const CString &sName, const CString &sValue);
+	void SetAttribute(const char *szName, size_t uNameSize, const char *szValue, size_t uValueSize);
 
-	void SetAttributes(const xmlChar **attrs);
+	CString GetAttribute(const CXMPPAtom *pName) const;
+	bool HasAttribute(const CXMPPAtom *pName) const;
+	void SetAttribute(const CXMPPAtom *pName, const CString &sValue);
+	void SetAttribute(const CXMPPAtom *pName, const char *szValue, size_t uValueSize);
+	/* The value of an attribute as an atom, NULL when absent or not a known name. */
+	const CXMPPAtom* GetAttributeAtom(const CXMPPAtom *pName) const;
 
 protected:
+	/* Enough for to, from, id and type plus one more without spilling */
+	static const unsigned int INLINE_ATTRIBUTES = 5;
+
+	struct SAttribute {
+		const CXMPPAtom *pName;
+		CXMPPStringRef sValue;
+	};
+
 	void AddChild(CXMPPStanza &child);
+	void CopyInto(CXMPPStanza &Copy) const;
+	SAttribute* FindAttribute(const char *szName, size_t uSize) const;
+	SAttribute* FindAttribute(const CXMPPAtom *pName) const;
 
 	EStanzaType m_eType;
 
-	CString m_sData;
+	CXMPPArena *m_pArena;
+	bool m_bOwnsArena;
+
+	const CXMPPAtom *m_pName;
+	const CXMPPAtom *m_pNamespace;
+	CXMPPStringRef m_sData;
+	size_t m_uTextCapacity;
 	CXMPPStanza *m_pParent;
-	MCString m_msAttributes;
 
-	std::vector<CXMPPStanza*> m_vChildren;
+	/* Attributes in insertion order, inline until they outgrow it */
+	SAttribute *m_pAttributes;
+	unsigned int m_uAttributes;
+	unsigned int m_uAttributeCapacity;
+	SAttribute m_aInlineAttributes[INLINE_ATTRIBUTES];
+
+	CXMPPStanza *m_pFirstChild;
+	CXMPPStanza *m_pLastChild;
+	CXMPPStanza *m_pNextSibling;
 };
 
-#endif
+/*
+ * A stanza serialized once for delivery to many recipients. Only the
+ * per-recipient 'to' and 'from' attributes of the root are spliced in
+ * when rendering, the rest of the tree is copied as bytes.
+ */
+class CXMPPSerializedStanza {
+public:
+	CXMPPSerializedStanza() : m_pName(NULL), m_pType(NULL) {}
+	CXMPPSerializedStanza(const CXMPPStanza &Stanza);
+
+	void Render(CString &sOutput, const CString &sTo, const CString &sFrom = "", const CString &sId = "") const;
 
+	bool IsName(const CXMPPAtom *pName) const { return m_pName && m_pName->Equals(pName); }
+	const CXMPPAtom* GetTypeAtom() const { return m_pType; }
+
+protected:
+	/* NULL unless interned, an uninterned name dies with the stanza's arena */
+	const CXMPPAtom *m_pName;
+	const CXMPPAtom *m_pType;
+	CString m_sHead;
+	CString m_sTail;
+};
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#include "Trace.h"
+
+static const struct {
+	const char *szName;
+	unsigned int uiMask;
+} s_aTraceCategories[] = {
+	{"parser",  XMPP_TRACE_PARSER},
+	{"auth",    XMPP_TRACE_AUTH},
+	{"routing", XMPP_TRACE_ROUTING},
+	{"muc",     XMPP_TRACE_MUC},
+};
+
+bool XMPPParseTraceMask(const CString &sCategories, unsigned int &uiMask) {
+	VCString vsCategories;
+	sCategories.Split(" ", vsCategories, false);
+
+	uiMask = 0;
+
+	for (const CString &sCategory : vsCategories) {
+		if (sCategory.Equals("all")) {
+			uiMask |= XMPP_TRACE_ALL;
+			continue;
+		} else if (sCategory.Equals("off")) {
+			continue;
+		}
+
+		bool bFound = false;
+		for (const auto &category : s_aTraceCategories) {
+			if (sCategory.Equals(category.szName)) {
+				uiMask |= category.uiMask;
+				bFound = true;
+				break;
+			}
+		}
+
+		if (!bFound) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+CString XMPPTraceMaskToString(unsigned int uiMask) {
+	CString sResult;
+
+	for (const auto &category : s_aTraceCategories) {
+		if (uiMask & category.uiMask) {
+			if (!sResult.empty()) {
+				sResult += " ";
+			}
+			sResult += category.szName;
+		}
+	}
+
+	return sResult.empty() ? "off" : sResult;
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <znc/ZNCDebug.h>
+#include <znc/ZNCString.h>
+
+/* Trace categories, enabled per socket with the "trace" module command */
+typedef enum {
+	XMPP_TRACE_PARSER  = 1 << 0,
+	XMPP_TRACE_AUTH    = 1 << 1,
+	XMPP_TRACE_ROUTING = 1 << 2,
+	XMPP_TRACE_MUC     = 1 << 3,
+	XMPP_TRACE_ALL     = XMPP_TRACE_PARSER | XMPP_TRACE_AUTH | XMPP_TRACE_ROUTING | XMPP_TRACE_MUC
+} EXMPPTrace;
+
+/* Parse "parser auth ...", "all" or "off" into a mask, false on an unknown category. */
+bool XMPPParseTraceMask(const CString &sCategories, unsigned int &uiMask);
+CString XMPPTraceMaskToString(unsigned int uiMask);
+
+/*
+ * Emit a trace line for pSocket if it has eCategory enabled. When it does
+ * not, this is a single test of the socket's mask, the message is never
+ * formatted. Building with XMPP_NO_TRACE removes trace points entirely.
+ */
+#ifdef XMPP_NO_TRACE
+#define XMPPTRACE(pSocket, eCategory, f) do {} while (0)
+#else
+#define XMPPTRACE(pSocket, eCategory, f) \
+	do { \
+		if (__builtin_expect(((pSocket)->GetTraceMask() & (eCategory)) != 0, 0)) { \
+			DEBUG("XMPP[" << XMPPTraceMaskToString(eCategory) << "] " << f); \
+		} \
+	} while (0)
+#endif
+
+#endif
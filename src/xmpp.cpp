@@ -6,14 +6,19 @@
  * by the Free Software Foundation.
  */
 
+#include <algorithm>
+
 #include <znc/IRCNetwork.h>
 #include <znc/Chan.h>
+#include <znc/FileUtils.h>
 
 #include "xmpp.h"
 #include "Client.h"
+#include "Session.h"
 #include "Listener.h"
 #include "Stanza.h"
 #include "Codes.h"
+#include "Trace.h"
 
 // Keep the socket alive
 class CXMPPSpaceJob : public CTimer {
@@ -30,40 +35,815 @@ protected:
 		for (std::vector<CXMPPClient *>::const_iterator iter = clients.begin(); iter != clients.end(); ++iter) {
 			CXMPPClient *client = *iter;
 			if (client->IsConnected())
-				client->Write(" ");
+				client->WriteKeepalive();
+		}
+	}
+};
+
+// Trickle queued stanzas out to clients that fell behind
+class CXMPPQueueJob : public CTimer {
+public:
+	CXMPPQueueJob(CModule* pModule, unsigned int uInterval, unsigned int uCycles, const CString& sLabel, const CString& sDescription)
+		: CTimer(pModule, uInterval, uCycles, sLabel, sDescription) {}
+	virtual ~CXMPPQueueJob() {}
+protected:
+	virtual void RunJob() {
+		CXMPPModule *module = (CXMPPModule *)m_pModule;
+
+		for (const auto &client : module->GetClients()) {
+			if (client->GetQueuedStanzas()) {
+				client->DrainQueue();
+			}
+		}
+	}
+};
+
+// Send the presence gathered during one coalescing window
+class CXMPPPresenceJob : public CTimer {
+public:
+	CXMPPPresenceJob(CModule* pModule, unsigned int uInterval, unsigned int uCycles, const CString& sLabel, const CString& sDescription)
+		: CTimer(pModule, uInterval, uCycles, sLabel, sDescription) {}
+	virtual ~CXMPPPresenceJob() {}
+protected:
+	virtual void RunJob() {
+		((CXMPPModule *)m_pModule)->FlushPresence();
+	}
+};
+
+// Ask for acknowledgements and forget sessions nobody came back for
+class CXMPPSessionJob : public CTimer {
+public:
+	CXMPPSessionJob(CModule* pModule, unsigned int uInterval, unsigned int uCycles, const CString& sLabel, const CString& sDescription)
+		: CTimer(pModule, uInterval, uCycles, sLabel, sDescription) {}
+	virtual ~CXMPPSessionJob() {}
+protected:
+	virtual void RunJob() {
+		CXMPPModule *module = (CXMPPModule *)m_pModule;
+
+		for (const auto &client : module->GetClients()) {
+			if (client->GetSession() && client->IsConnected()) {
+				client->RequestAck();
+			}
 		}
+
+		module->ExpireSessions();
+	}
+};
+
+// Close archives nobody has used for a while
+class CXMPPArchiveJob : public CTimer {
+public:
+	CXMPPArchiveJob(CModule* pModule, unsigned int uInterval, unsigned int uCycles, const CString& sLabel, const CString& sDescription)
+		: CTimer(pModule, uInterval, uCycles, sLabel, sDescription) {}
+	virtual ~CXMPPArchiveJob() {}
+protected:
+	virtual void RunJob() {
+		((CXMPPModule *)m_pModule)->ExpireArchives();
 	}
 };
 
+/* Seconds an archive stays open after its last use */
+static const time_t ARCHIVE_IDLE_TIME = 600;
+
+CXMPPModule::~CXMPPModule() {
+	/* Close our clients while the indexes and parser pool they use still exist */
+	std::vector<CXMPPClient*> vClients = m_vClients;
+	for (const auto &pClient : vClients) {
+		CZNC::Get().GetManager().DelSockByAddr(pClient);
+	}
+
+	for (const auto &it : m_mSessions) {
+		delete it.second;
+	}
+
+	for (const auto &it : m_mArchives) {
+		delete it.second;
+	}
+}
+
 bool CXMPPModule::OnLoad(const CString& sArgs, CString& sMessage) {
 	m_sServerName = sArgs.Token(0);
 	if (m_sServerName.empty()) {
 		m_sServerName = "localhost";
 	}
 
+	m_QueueLimits.uHighWater = 64 * 1024;
+	m_QueueLimits.uMaxBytes = 1024 * 1024;
+	m_QueueLimits.uMaxStanzas = 5000;
+	m_QueueLimits.uiPolicy = XMPP_QUEUE_COLLAPSE_PRESENCE | XMPP_QUEUE_DROP_PRESENCE | XMPP_QUEUE_DISCONNECT;
+
+	m_uPresenceSequence = 0;
+	m_uiPresenceWindow = 2;
+	m_bPresenceTimer = false;
+	m_uiSessionTimeout = 300;
+	m_bArchive = true;
+
+	/* About 32K for the compressor and 40K for the decompressor per client */
+	m_CompressionLimits.bEnabled = true;
+	m_CompressionLimits.iLevel = 6;
+	m_CompressionLimits.iWindowBits = 12;
+	m_CompressionLimits.iMemLevel = 5;
+
+	/* Settings follow the server name as key=value */
+	VCString vsArgs;
+	sArgs.Token(1, true).Split(" ", vsArgs, false);
+	for (const CString &sArg : vsArgs) {
+		CString sKey = sArg.Token(0, false, "=");
+		CString sValue = sArg.Token(1, true, "=");
+
+		if (sKey.Equals("queue_bytes")) {
+			m_QueueLimits.uMaxBytes = sValue.ToULong();
+		} else if (sKey.Equals("queue_stanzas")) {
+			m_QueueLimits.uMaxStanzas = sValue.ToULong();
+		} else if (sKey.Equals("presence_window")) {
+			m_uiPresenceWindow = sValue.ToUInt();
+		} else if (sKey.Equals("sm_timeout")) {
+			m_uiSessionTimeout = sValue.ToUInt();
+		} else if (sKey.Equals("archive")) {
+			m_bArchive = sValue.ToBool();
+		} else if (sKey.Equals("compress")) {
+			m_CompressionLimits.bEnabled = sValue.ToBool();
+		} else if (sKey.Equals("compress_level")) {
+			m_CompressionLimits.iLevel = sValue.ToInt();
+			if (m_CompressionLimits.iLevel < 1 || m_CompressionLimits.iLevel > 9) {
+				sMessage = "compress_level must be between 1 and 9";
+				return false;
+			}
+		} else if (sKey.Equals("compress_window")) {
+			m_CompressionLimits.iWindowBits = sValue.ToInt();
+			if (m_CompressionLimits.iWindowBits < 9 || m_CompressionLimits.iWindowBits > 15) {
+				sMessage = "compress_window must be between 9 and 15";
+				return false;
+			}
+		} else if (sKey.Equals("compress_memlevel")) {
+			m_CompressionLimits.iMemLevel = sValue.ToInt();
+			if (m_CompressionLimits.iMemLevel < 1 || m_CompressionLimits.iMemLevel > 9) {
+				sMessage = "compress_memlevel must be between 1 and 9";
+				return false;
+			}
+		} else if (sKey.Equals("queue_highwater")) {
+			m_QueueLimits.uHighWater = sValue.ToULong();
+		} else if (sKey.Equals("queue_policy")) {
+			VCString vsPolicies;
+			sValue.Split(",", vsPolicies, false);
+
+			m_QueueLimits.uiPolicy = 0;
+			for (const CString &sPolicy : vsPolicies) {
+				if (sPolicy.Equals("collapse")) {
+					m_QueueLimits.uiPolicy |= XMPP_QUEUE_COLLAPSE_PRESENCE;
+				} else if (sPolicy.Equals("drop")) {
+					m_QueueLimits.uiPolicy |= XMPP_QUEUE_DROP_PRESENCE;
+				} else if (sPolicy.Equals("disconnect")) {
+					m_QueueLimits.uiPolicy |= XMPP_QUEUE_DISCONNECT;
+				} else {
+					sMessage = "Unknown queue policy [" + sPolicy + "]";
+					return false;
+				}
+			}
+		} else {
+			sMessage = "Unknown argument [" + sArg + "]";
+			return false;
+		}
+	}
+
+	BuildDisco();
+
 	CXMPPListener *pClient = new CXMPPListener(this);
 	pClient->Listen(5222, false);
 
 	AddTimer(new CXMPPSpaceJob(this, 30, 0, "CXMPPSpace", "Periodically sends a space on the socket to prevent closing"));
+	AddTimer(new CXMPPQueueJob(this, 1, 0, "CXMPPQueue", "Drains stanzas queued for slow clients"));
+	AddTimer(new CXMPPSessionJob(this, 5, 0, "CXMPPSession", "Requests stream management acks and expires detached sessions"));
+	AddTimer(new CXMPPArchiveJob(this, 60, 0, "CXMPPArchive", "Closes message archives that are no longer in use"));
 
 	return true;
 }
 
 CModule::EModRet CXMPPModule::OnDeleteUser(CUser& User) {
-	// Delete clients
-	std::vector<CXMPPClient*>::iterator it;
-	for (it = m_vClients.begin(); it != m_vClients.end();) {
-		CXMPPClient *pClient = *it;
-
-		if (pClient->GetUser() == &User) {
-			CZNC::Get().GetManager().DelSockByAddr(pClient);
-			it = m_vClients.erase(it);
+	// Delete clients, each deletion unregisters itself via ClientDisconnected
+	std::vector<CXMPPClient*> vClients = GetUserClients(&User);
+	for (const auto &pClient : vClients) {
+		CZNC::Get().GetManager().DelSockByAddr(pClient);
+	}
+
+	/* A password check in progress must not outlive the user it reads */
+	for (const auto &pClient : m_vClients) {
+		if (pClient->GetAuthUser() == &User) {
+			pClient->CancelAuth();
+			pClient->Close();
+		}
+	}
+
+	/* Nobody can resume these any more */
+	std::vector<CXMPPSession*> vSessions;
+	for (const auto &it : m_mSessions) {
+		if (it.second->GetUser() == &User) {
+			vSessions.push_back(it.second);
+		}
+	}
+	for (const auto &pSession : vSessions) {
+		DeleteSession(pSession);
+	}
+
+	/* The archive files stay with the module's data */
+	std::map<std::pair<const CUser*, CString>, CXMPPArchive*>::iterator archive = m_mArchives.lower_bound(std::make_pair(&User, CString()));
+	while (archive != m_mArchives.end() && archive->first.first == &User) {
+		delete archive->second;
+		archive = m_mArchives.erase(archive);
+	}
+
+	InvalidateChannelDirectory(&User);
+	for (const auto &network : User.GetNetworks()) {
+		m_mNickIndexes.erase(network);
+	}
+
+	return CONTINUE;
+}
+
+CModule::EModRet CXMPPModule::OnDeleteNetwork(CIRCNetwork& Network) {
+	InvalidateChannelDirectory(Network.GetUser());
+	m_mNickIndexes.erase(&Network);
+
+	return CONTINUE;
+}
+
+void CXMPPModule::OnModCommand(const CString& sCommand) {
+	CString sCmd = sCommand.Token(0);
+
+	if (sCmd.Equals("trace")) {
+		CString sUser = sCommand.Token(1).AsLower();
+
+		if (sUser.empty()) {
+			if (m_muiTraceMasks.empty()) {
+				PutModule("Tracing is off");
+			}
+
+			for (const auto &it : m_muiTraceMasks) {
+				PutModule(it.first + ": " + XMPPTraceMaskToString(it.second));
+			}
+			return;
+		}
+
+		unsigned int uiMask;
+		if (!XMPPParseTraceMask(sCommand.Token(2, true), uiMask)) {
+			PutModule("Unknown category, expected parser, auth, routing, muc, all or off");
+			return;
+		}
+
+		if (uiMask) {
+			m_muiTraceMasks[sUser] = uiMask;
+		} else {
+			m_muiTraceMasks.erase(sUser);
+		}
+
+		/* Apply to connected sockets too, not just future ones */
+		for (const auto &pClient : m_vClients) {
+			CUser *pUser = pClient->GetUser();
+			if (pUser ? pUser->GetUserName().Equals(sUser) : sUser == "*") {
+				pClient->SetTraceMask(uiMask);
+			}
+		}
+
+		PutModule("Tracing [" + XMPPTraceMaskToString(uiMask) + "] for " + sUser);
+	} else if (sCmd.Equals("queues")) {
+		if (m_vClients.empty()) {
+			PutModule("No clients connected");
+		}
+
+		for (const auto &pClient : m_vClients) {
+			CString sClient = pClient->GetUser() ? pClient->GetJID() : pClient->GetRemoteIP();
+			PutModule(sClient + ": " + CString(pClient->GetQueuedStanzas()) + " stanzas, " + CString(pClient->GetQueuedBytes()) + " bytes queued (peak " + CString(pClient->GetQueuePeakBytes()) + "), " + CString(pClient->GetInternalWriteBuffer().size()) + " bytes in socket, " + CString(pClient->GetCollapsedPresences()) + " presences collapsed, " + CString(pClient->GetDroppedPresences()) + " dropped");
+		}
+	} else {
+		PutModule("Usage: trace [<user>|* [parser|auth|routing|muc|all|off ...]]");
+		PutModule("       queues");
+	}
+}
+
+unsigned int CXMPPModule::GetTraceMask(const CString &sUser) const {
+	std::map<CString, unsigned int>::const_iterator it = m_muiTraceMasks.find(sUser.empty() ? "*" : sUser.AsLower());
+	if (it == m_muiTraceMasks.end()) {
+		return 0;
+	}
+
+	return it->second;
+}
+
+/* Channel names can hold anything but a few separators, keep file names tame */
+static CString ArchiveFileName(const CString &sChannel) {
+	if (sChannel.empty()) {
+		return "private.log";
+	}
+
+	CString sName;
+	for (unsigned char c : sChannel) {
+		if (isalnum(c) || c == '!' || c == '+' || c == '-' || c == '_' || c == '.') {
+			sName += c;
+		} else {
+			char szHex[4];
+			snprintf(szHex, sizeof(szHex), "%%%02X", c);
+			sName += szHex;
+		}
+	}
+
+	return sName + ".log";
+}
+
+CXMPPArchive* CXMPPModule::GetArchive(const CUser *pUser, const CString &sChannel) {
+	if (!m_bArchive) {
+		return NULL;
+	}
+
+	std::pair<const CUser*, CString> key(pUser, sChannel.AsLower());
+	std::map<std::pair<const CUser*, CString>, CXMPPArchive*>::iterator it = m_mArchives.find(key);
+	if (it != m_mArchives.end()) {
+		return it->second;
+	}
+
+	CString sDirectory = GetSavePath() + "/archive/" + pUser->GetUserName();
+	CDir::MakeDir(sDirectory);
+
+	CXMPPArchive *pArchive = new CXMPPArchive(sDirectory + "/" + ArchiveFileName(key.second));
+	m_mArchives[key] = pArchive;
+	return pArchive;
+}
+
+void CXMPPModule::ExpireArchives() {
+	time_t tNow = time(NULL);
+
+	std::map<std::pair<const CUser*, CString>, CXMPPArchive*>::iterator it = m_mArchives.begin();
+	while (it != m_mArchives.end()) {
+		if (tNow - it->second->GetLastUsed() >= ARCHIVE_IDLE_TIME) {
+			/* Opened again, from the index on disk, when next needed */
+			delete it->second;
+			it = m_mArchives.erase(it);
 		} else {
 			++it;
 		}
 	}
+}
 
-	return CONTINUE;
+void CXMPPModule::ArchiveMessage(const CUser *pUser, const CString &sChannel, const SXMPPArchivedMessage &Message) {
+	CXMPPArchive *pArchive = GetArchive(pUser, sChannel);
+	if (pArchive && !pArchive->Append(Message)) {
+		DEBUG("XMPPModule: failed to archive a message for [" << pUser->GetUserName() << "] " << sChannel);
+	}
+}
+
+/* Service Discovery: https://xmpp.org/extensions/xep-0030.html */
+void CXMPPModule::BuildDisco() {
+	m_mDisco.clear();
+	m_mChannelDirectories.clear();
+
+	CString sServer = m_sServerName.AsLower();
+
+	/* List directories as separate servers */
+	{
+		CXMPPStanza iq(CXMPPAtom::IQ);
+		iq.SetAttribute(CXMPPAtom::Type, "result");
+		CXMPPStanza &query = iq.NewChild(CXMPPAtom::Query, CXMPPAtom::NSDiscoItems);
+		CXMPPStanza &channels = query.NewChild(CXMPPAtom::Item);
+		channels.SetAttribute(CXMPPAtom::Jid, "channels." + m_sServerName);
+		channels.SetAttribute(CXMPPAtom::Name, "Directory of IRC Channels");
+		CXMPPStanza &users = query.NewChild(CXMPPAtom::Item);
+		users.SetAttribute(CXMPPAtom::Jid, "users." + m_sServerName);
+		users.SetAttribute(CXMPPAtom::Name, "Directory of IRC Users");
+
+		m_mDisco.emplace(TDiscoKey(CXMPPAtom::NSDiscoItems, sServer), CXMPPSerializedStanza(iq));
+	}
+
+	/* XMPP Server and IRC Gateway */
+	{
+		CXMPPStanza iq(CXMPPAtom::IQ);
+		iq.SetAttribute(CXMPPAtom::Type, "result");
+		CXMPPStanza &query = iq.NewChild(CXMPPAtom::Query, CXMPPAtom::NSDiscoInfo);
+		CXMPPStanza &identity1 = query.NewChild(CXMPPAtom::Identity);
+		identity1.SetAttribute(CXMPPAtom::Category, "server");
+		identity1.SetAttribute(CXMPPAtom::Type, "im");
+		identity1.SetAttribute(CXMPPAtom::Name, "XMPP ZNC Module");
+		CXMPPStanza &identity2 = query.NewChild(CXMPPAtom::Identity);
+		identity2.SetAttribute(CXMPPAtom::Category, "gateway");
+		identity2.SetAttribute(CXMPPAtom::Type, "irc");
+		identity2.SetAttribute(CXMPPAtom::Name, "XMPP ZNC Module");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "http://jabber.org/protocol/disco#info");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "http://jabber.org/protocol/disco#items");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "http://jabber.org/protocol/muc");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "vcard-temp");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:search");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:time");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:version");
+		if (IsArchiving()) {
+			query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "urn:xmpp:mam:2");
+		}
+
+		m_mDisco.emplace(TDiscoKey(CXMPPAtom::NSDiscoInfo, sServer), CXMPPSerializedStanza(iq));
+	}
+
+	/* User Directory */
+	{
+		CXMPPStanza iq(CXMPPAtom::IQ);
+		iq.SetAttribute(CXMPPAtom::Type, "result");
+		CXMPPStanza &query = iq.NewChild(CXMPPAtom::Query, CXMPPAtom::NSDiscoInfo);
+		CXMPPStanza &identity = query.NewChild(CXMPPAtom::Identity);
+		identity.SetAttribute(CXMPPAtom::Category, "directory");
+		identity.SetAttribute(CXMPPAtom::Type, "user");
+		identity.SetAttribute(CXMPPAtom::Name, "IRC Users");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "http://jabber.org/protocol/disco#info");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "http://jabber.org/protocol/disco#items");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "vcard-temp");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:search");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:time");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:version");
+
+		m_mDisco.emplace(TDiscoKey(CXMPPAtom::NSDiscoInfo, "users." + sServer), CXMPPSerializedStanza(iq));
+	}
+
+	/* Chatroom Directory */
+	{
+		CXMPPStanza iq(CXMPPAtom::IQ);
+		iq.SetAttribute(CXMPPAtom::Type, "result");
+		CXMPPStanza &query = iq.NewChild(CXMPPAtom::Query, CXMPPAtom::NSDiscoInfo);
+		CXMPPStanza &identity1 = query.NewChild(CXMPPAtom::Identity);
+		identity1.SetAttribute(CXMPPAtom::Category, "conference");
+		identity1.SetAttribute(CXMPPAtom::Type, "text");
+		identity1.SetAttribute(CXMPPAtom::Name, "IRC Channels");
+		CXMPPStanza &identity2 = query.NewChild(CXMPPAtom::Identity);
+		identity2.SetAttribute(CXMPPAtom::Category, "directory");
+		identity2.SetAttribute(CXMPPAtom::Type, "chatroom");
+		identity2.SetAttribute(CXMPPAtom::Name, "IRC Channels");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "http://jabber.org/protocol/disco#info");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "http://jabber.org/protocol/disco#items");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "http://jabber.org/protocol/muc");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:search");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:time");
+		query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, "jabber:iq:version");
+
+		m_mDisco.emplace(TDiscoKey(CXMPPAtom::NSDiscoInfo, "channels." + sServer), CXMPPSerializedStanza(iq));
+	}
+
+	/* IRC users */
+	{
+		std::vector<SXMPPIdentity> vIdentities = {
+			{"account", "registered", ""},
+			{"pubsub", "pep", ""},
+		};
+		std::vector<CString> vsFeatures = {
+			"http://jabber.org/protocol/disco#info",
+			"vcard-temp",
+			"urn:xmpp:tmp:profile",
+			/* Personal Eventing Protocol: https://xmpp.org/extensions/xep-0163.html */
+			"http://jabber.org/protocol/pubsub#access-presence",
+			"http://jabber.org/protocol/pubsub#auto-create",
+			"http://jabber.org/protocol/pubsub#auto-subscribe",
+			"http://jabber.org/protocol/pubsub#config-node",
+			"http://jabber.org/protocol/pubsub#create-and-configure",
+			"http://jabber.org/protocol/pubsub#create-nodes",
+			"http://jabber.org/protocol/pubsub#filtered-notifications",
+			"http://jabber.org/protocol/pubsub#persistent-items",
+			"http://jabber.org/protocol/pubsub#publish",
+			"http://jabber.org/protocol/pubsub#retrieve-items",
+			"http://jabber.org/protocol/pubsub#subscribe",
+		};
+
+		m_sCapsNode = "http://znc.in";
+		m_sCapsVer = XMPPCapsVer(vIdentities, vsFeatures);
+
+		CXMPPStanza iq(CXMPPAtom::IQ);
+		iq.SetAttribute(CXMPPAtom::Type, "result");
+		CXMPPStanza &query = iq.NewChild(CXMPPAtom::Query, CXMPPAtom::NSDiscoInfo);
+		for (const SXMPPIdentity &identity : vIdentities) {
+			CXMPPStanza &child = query.NewChild(CXMPPAtom::Identity);
+			child.SetAttribute(CXMPPAtom::Category, identity.sCategory);
+			child.SetAttribute(CXMPPAtom::Type, identity.sType);
+		}
+		for (const CString &sFeature : vsFeatures) {
+			query.NewChild(CXMPPAtom::Feature).SetAttribute(CXMPPAtom::Var, sFeature);
+		}
+
+		m_IRCUserInfo = CXMPPSerializedStanza(iq);
+
+		/* Asked for by node, the node is echoed back */
+		query.SetAttribute(CXMPPAtom::Node, m_sCapsNode + "#" + m_sCapsVer);
+		m_IRCUserCapsInfo = CXMPPSerializedStanza(iq);
+	}
+}
+
+/* MUC: Discovering Rooms: https://xmpp.org/extensions/xep-0045.html#disco-rooms */
+void CXMPPModule::BuildChannelDirectory(const CUser &User, CXMPPStanza &Query) const {
+	// Enumerate networks
+	for (const auto &network : User.GetNetworks()) {
+		if (!network->IsIRCConnected())
+			continue;
+
+		// Enumerate channels
+		for (const auto &channel : network->GetChans()) {
+			if (!channel->IsOn())
+				continue;
+
+			// Present each channel as a room
+			// JID grammar: https://xmpp.org/extensions/xep-0029.html#sect-idm45406366945648
+			CXMPPStanza &item = Query.NewChild(CXMPPAtom::Item);
+			item.SetAttribute(CXMPPAtom::Jid, channel->GetName() + "!" + network->GetName() + "+irc@" + m_sServerName);
+			item.SetAttribute(CXMPPAtom::Name, channel->GetName() + " on " + network->GetName());
+		}
+	}
+}
+
+const CXMPPSerializedStanza* CXMPPModule::GetDisco(const CUser *pUser, const CXMPPAtom *pNamespace, const CString &sJID) {
+	CString sLower = sJID.AsLower();
+
+	std::map<TDiscoKey, CXMPPSerializedStanza>::const_iterator it = m_mDisco.find(TDiscoKey(pNamespace, sLower));
+	if (it != m_mDisco.end()) {
+		return &it->second;
+	}
+
+	if (!pUser || pNamespace != CXMPPAtom::NSDiscoItems || sLower != "channels." + m_sServerName.AsLower()) {
+		return NULL;
+	}
+
+	std::map<const CUser*, CXMPPSerializedStanza>::const_iterator directory = m_mChannelDirectories.find(pUser);
+	if (directory == m_mChannelDirectories.end()) {
+		CXMPPStanza iq(CXMPPAtom::IQ);
+		iq.SetAttribute(CXMPPAtom::Type, "result");
+		BuildChannelDirectory(*pUser, iq.NewChild(CXMPPAtom::Query, CXMPPAtom::NSDiscoItems));
+
+		directory = m_mChannelDirectories.emplace(pUser, CXMPPSerializedStanza(iq)).first;
+	}
+
+	return &directory->second;
+}
+
+void CXMPPModule::InvalidateChannelDirectory(const CUser *pUser) {
+	m_mChannelDirectories.erase(pUser);
+}
+
+CXMPPNickIndex* CXMPPModule::FindNickIndex(const CIRCNetwork *pNetwork) {
+	std::map<const CIRCNetwork*, CXMPPNickIndex>::iterator it = m_mNickIndexes.find(pNetwork);
+	return it == m_mNickIndexes.end() ? NULL : &it->second;
+}
+
+CXMPPNickIndex* CXMPPModule::GetNickIndex(CIRCNetwork *pNetwork) {
+	if (!pNetwork || !pNetwork->IsIRCConnected()) {
+		return NULL;
+	}
+
+	CXMPPNickIndex *pIndex = FindNickIndex(pNetwork);
+	if (pIndex) {
+		return pIndex;
+	}
+
+	CString sCaseMapping = pNetwork->GetIRCSock()->GetISupport("CASEMAPPING", "rfc1459");
+	CXMPPNickIndex &index = m_mNickIndexes.emplace(pNetwork, CXMPPNickIndex(sCaseMapping)).first->second;
+
+	for (const auto &channel : pNetwork->GetChans()) {
+		if (!channel->IsOn())
+			continue;
+
+		for (const auto &entry : channel->GetNicks()) {
+			index.Join(entry.second.GetNick(), channel->GetName());
+		}
+	}
+
+	return &index;
+}
+
+CXMPPSession* CXMPPModule::CreateSession(CXMPPClient &Client, bool bResumable) {
+	CString sId;
+	do {
+		sId = CString::RandomString(32).SHA256();
+	} while (m_mSessions.count(sId));
+
+	CXMPPSession *pSession = new CXMPPSession(sId, Client.GetUser(), bResumable && m_uiSessionTimeout > 0);
+	pSession->Attach(Client);
+	m_mSessions[sId] = pSession;
+
+	return pSession;
+}
+
+CXMPPSession* CXMPPModule::FindSession(const CString &sId) const {
+	std::map<CString, CXMPPSession*>::const_iterator it = m_mSessions.find(sId);
+	if (it == m_mSessions.end()) {
+		return NULL;
+	}
+
+	return it->second;
+}
+
+void CXMPPModule::DetachSession(CXMPPClient &Client, CXMPPSession &Session) {
+	if (!Session.IsResumable()) {
+		DeleteSession(&Session);
+		return;
+	}
+
+	Session.Detach(Client.GetJID(), Client.GetResource(), Client.GetChannels());
+	m_mDetachedSessions[Session.GetUser()].push_back(&Session);
+	DEBUG("XMPPModule: keeping session [" << Session.GetId() << "] of " << Client.GetJID() << " for " << m_uiSessionTimeout << "s with " << Session.GetUnacked().size() << " unacked stanzas");
+}
+
+void CXMPPModule::ResumeSession(CXMPPClient &Client, CXMPPSession &Session) {
+	ForgetDetachedSession(Session);
+	Session.Attach(Client);
+}
+
+void CXMPPModule::DeleteSession(CXMPPSession *pSession) {
+	ForgetDetachedSession(*pSession);
+	m_mSessions.erase(pSession->GetId());
+	delete pSession;
+}
+
+void CXMPPModule::ForgetDetachedSession(CXMPPSession &Session) {
+	std::map<const CUser*, std::vector<CXMPPSession*>>::iterator it = m_mDetachedSessions.find(Session.GetUser());
+	if (it == m_mDetachedSessions.end()) {
+		return;
+	}
+
+	std::vector<CXMPPSession*>::iterator session = std::find(it->second.begin(), it->second.end(), &Session);
+	if (session != it->second.end()) {
+		it->second.erase(session);
+	}
+	if (it->second.empty()) {
+		m_mDetachedSessions.erase(it);
+	}
+}
+
+static const std::vector<CXMPPSession*> s_vNoSessions;
+
+const std::vector<CXMPPSession*>& CXMPPModule::GetDetachedSessions(const CUser *pUser) const {
+	std::map<const CUser*, std::vector<CXMPPSession*>>::const_iterator it = m_mDetachedSessions.find(pUser);
+	if (it == m_mDetachedSessions.end()) {
+		return s_vNoSessions;
+	}
+
+	return it->second;
+}
+
+void CXMPPModule::HoldSessionStanza(const CUser *pUser, const CString &sChannel, const CXMPPSerializedStanza &Stanza, const CString &sFrom, bool bSelf) {
+	for (const auto &pSession : GetDetachedSessions(pUser)) {
+		const CXMPPChannel *pChannel = sChannel.empty() ? NULL : pSession->FindChannel(sChannel);
+		if (!sChannel.empty() && !pChannel) {
+			continue;
+		}
+
+		if (bSelf && pChannel) {
+			pSession->Hold(Stanza, pChannel->GetJID().ToString());
+		} else {
+			pSession->Hold(Stanza, sFrom.empty() ? pSession->GetJID() : sFrom);
+		}
+	}
+}
+
+void CXMPPModule::HoldSessionPresence(const CUser *pUser, const CXMPPJID &From, const CXMPPJID &Jid, const CString &sType, const CString &sStatus, bool bChannel, const std::vector<CString> &vsCodes) {
+	if (GetDetachedSessions(pUser).empty()) {
+		return;
+	}
+
+	/* Nothing in it depends on the session, the real JID is never a client's own */
+	CXMPPStanza presence(CXMPPAtom::Presence);
+	if (bChannel) {
+		BuildChannelPresence(presence, From, Jid, "", sType, sStatus, vsCodes);
+	} else {
+		BuildPresence(presence, From, sType, sStatus);
+	}
+
+	CXMPPSerializedStanza serialized(presence);
+	HoldSessionStanza(pUser, bChannel ? From.GetUser() : "", serialized, From.ToString());
+}
+
+void CXMPPModule::ExpireSessions() {
+	time_t tNow = time(NULL);
+
+	std::map<CString, CXMPPSession*>::iterator it = m_mSessions.begin();
+	while (it != m_mSessions.end()) {
+		CXMPPSession *pSession = it->second;
+
+		if (!pSession->GetClient() && tNow - pSession->GetDetachedTime() >= (time_t)m_uiSessionTimeout) {
+			ForgetDetachedSession(*pSession);
+			it = m_mSessions.erase(it);
+			delete pSession;
+		} else {
+			++it;
+		}
+	}
+}
+
+void CXMPPModule::QueuePresence(CXMPPClient &Client, const CXMPPJID &From, const CXMPPJID &Jid, const CString &sType, const CString &sStatus, bool bChannel, const std::vector<CString> &vsCodes) {
+	if (!m_uiPresenceWindow) {
+		if (bChannel) {
+			Client.ChannelPresence(From, Jid, sType, sStatus, vsCodes);
+		} else {
+			Client.Presence(From, sType, sStatus);
+		}
+		return;
+	}
+
+	TPresenceKey key(&Client, From.ToString());
+	std::map<TPresenceKey, SPendingPresence>::iterator it = m_mPendingPresence.find(key);
+
+	if (it != m_mPendingPresence.end()) {
+		if (it->second.sType.Equals("unavailable") != sType.Equals("unavailable")) {
+			/* Back to what the client last saw */
+			m_mPendingPresence.erase(it);
+		} else {
+			it->second.sType = sType;
+			it->second.sStatus = sStatus;
+			it->second.vsCodes = vsCodes;
+			it->second.uSequence = m_uPresenceSequence++;
+		}
+		return;
+	}
+
+	m_mPendingPresence[key] = {From, Jid, sType, sStatus, vsCodes, bChannel, m_uPresenceSequence++};
+
+	if (!m_bPresenceTimer) {
+		m_bPresenceTimer = true;
+		AddTimer(new CXMPPPresenceJob(this, m_uiPresenceWindow, 1, "CXMPPPresence", "Sends presence gathered during the coalescing window"));
+	}
+}
+
+void CXMPPModule::CancelPresence(CXMPPClient &Client, const CXMPPJID &From) {
+	std::map<TPresenceKey, SPendingPresence>::iterator it = m_mPendingPresence.find(TPresenceKey(&Client, From.ToString()));
+	if (it != m_mPendingPresence.end() && it->second.sType.Equals("unavailable")) {
+		m_mPendingPresence.erase(it);
+	}
+}
+
+void CXMPPModule::BuildPresence(CXMPPStanza &Presence, const CXMPPJID &From, const CString &sType, const CString &sStatus) const {
+	Presence.SetAttribute(CXMPPAtom::Id, "znc_" + CString::RandomString(8));
+	Presence.SetAttribute(CXMPPAtom::From, From.ToString());
+	if (!sType.empty())
+		Presence.SetAttribute(CXMPPAtom::Type, sType);
+	if (!sStatus.empty())
+		Presence.NewChild(CXMPPAtom::Status).NewChild().SetText(sStatus);
+	/* Hash stolen from iChat vCard update */
+	Presence.NewChild(CXMPPAtom::XElement, CXMPPAtom::NSVCardUpdate).NewChild(CXMPPAtom::Photo).NewChild().SetText("341f80f531fbce7a0441b5983e2ebf9fa84868d0");
+	if (sType.empty()) {
+		/* Entity Capabilities: https://xmpp.org/extensions/xep-0115.html */
+		CXMPPStanza &caps = Presence.NewChild(CXMPPAtom::Caps, CXMPPAtom::NSCaps);
+		caps.SetAttribute(CXMPPAtom::Hash, "sha-1");
+		caps.SetAttribute(CXMPPAtom::Node, GetCapsNode());
+		caps.SetAttribute(CXMPPAtom::Ver, GetCapsVer());
+	}
+}
+
+void CXMPPModule::BuildChannelPresence(CXMPPStanza &Presence, const CXMPPJID &From, const CXMPPJID &Jid, const CString &sSelf, const CString &sType, const CString &sStatus, const std::vector<CString> &vsCodes) const {
+	Presence.SetAttribute(CXMPPAtom::Id, "znc_" + CString::RandomString(8));
+	Presence.SetAttribute(CXMPPAtom::From, From.ToString());
+	if (!sType.empty())
+		Presence.SetAttribute(CXMPPAtom::Type, sType);
+	if (!sStatus.empty())
+		Presence.NewChild(CXMPPAtom::Status).NewChild().SetText(sStatus);
+	CXMPPStanza &x = Presence.NewChild(CXMPPAtom::XElement, CXMPPAtom::NSMUCUser);
+	CXMPPStanza &item = x.NewChild(CXMPPAtom::Item);
+	// TODO: check permissions
+	if (!Jid.Equals(sSelf))
+		item.SetAttribute(CXMPPAtom::Jid, Jid.ToString());
+	item.SetAttribute(CXMPPAtom::Affiliation, "member");
+	item.SetAttribute(CXMPPAtom::Role, "participant");
+	for (const auto& it : vsCodes) {
+		Presence.NewChild(CXMPPAtom::Status).SetAttribute(CXMPPAtom::Code, it);
+	}
+}
+
+void CXMPPModule::FlushPresence() {
+	m_bPresenceTimer = false;
+
+	/* Grouped by client, in the order the updates happened */
+	std::vector<std::pair<TPresenceKey, const SPendingPresence*>> vPending;
+	for (const auto &entry : m_mPendingPresence) {
+		vPending.push_back(std::make_pair(entry.first, &entry.second));
+	}
+
+	std::sort(vPending.begin(), vPending.end(), [](const std::pair<TPresenceKey, const SPendingPresence*> &a, const std::pair<TPresenceKey, const SPendingPresence*> &b) {
+		if (a.first.first != b.first.first) {
+			return a.first.first < b.first.first;
+		}
+		return a.second->uSequence < b.second->uSequence;
+	});
+
+	for (std::vector<std::pair<TPresenceKey, const SPendingPresence*>>::const_iterator it = vPending.begin(); it != vPending.end();) {
+		CXMPPClient *pClient = it->first.first;
+		CXMPPWriteBatch batch(*pClient);
+
+		for (; it != vPending.end() && it->first.first == pClient; ++it) {
+			const SPendingPresence &presence = *it->second;
+			if (presence.bChannel) {
+				pClient->ChannelPresence(presence.From, presence.Jid, presence.sType, presence.sStatus, presence.vsCodes);
+			} else {
+				pClient->Presence(presence.From, presence.sType, presence.sStatus);
+			}
+		}
+	}
+
+	m_mPendingPresence.clear();
+}
+
+static void RemoveClient(std::vector<CXMPPClient*> &vClients, CXMPPClient *pClient) {
+	for (std::vector<CXMPPClient*>::iterator it = vClients.begin(); it != vClients.end(); ++it) {
+		if (*it == pClient) {
+			vClients.erase(it);
+			break;
+		}
+	}
 }
 
 void CXMPPModule::ClientConnected(CXMPPClient &Client) {
@@ -71,17 +851,100 @@ void CXMPPModule::ClientConnected(CXMPPClient &Client) {
 }
 
 void CXMPPModule::ClientDisconnected(CXMPPClient &Client) {
-	for (std::vector<CXMPPClient*>::iterator it = m_vClients.begin(); it != m_vClients.end(); ++it) {
-		if (*it == &Client) {
-			m_vClients.erase(it);
-			break;
+	RemoveClient(m_vClients, &Client);
+	UnindexClient(Client);
+}
+
+void CXMPPModule::UnindexClient(CXMPPClient &Client) {
+	std::map<TPresenceKey, SPendingPresence>::iterator pending = m_mPendingPresence.lower_bound(TPresenceKey(&Client, ""));
+	while (pending != m_mPendingPresence.end() && pending->first.first == &Client) {
+		pending = m_mPendingPresence.erase(pending);
+	}
+
+	CUser *pUser = Client.GetUser();
+	if (!pUser) {
+		return;
+	}
+
+	for (const auto &entry : Client.GetChannels()) {
+		ClientPartedChannel(Client, entry.first);
+	}
+
+	std::map<const CUser*, std::vector<CXMPPClient*>>::iterator it = m_mUserClients.find(pUser);
+	if (it != m_mUserClients.end()) {
+		RemoveClient(it->second, &Client);
+		if (it->second.empty()) {
+			m_mUserClients.erase(it);
 		}
 	}
 }
 
+void CXMPPModule::ClientAuthenticated(CXMPPClient &Client) {
+	Client.SetTraceMask(GetTraceMask(Client.GetUser()->GetUserName()));
+
+	std::vector<CXMPPClient*> &vClients = m_mUserClients[Client.GetUser()];
+	if (std::find(vClients.begin(), vClients.end(), &Client) == vClients.end()) {
+		vClients.push_back(&Client);
+	}
+}
+
+void CXMPPModule::ClientJoinedChannel(CXMPPClient &Client, CXMPPChannelKey Channel) {
+	std::vector<CXMPPClient*> &vClients = m_mChannelClients[TChannelKey(Client.GetUser(), Channel)];
+	if (std::find(vClients.begin(), vClients.end(), &Client) == vClients.end()) {
+		vClients.push_back(&Client);
+	}
+}
+
+void CXMPPModule::ClientPartedChannel(CXMPPClient &Client, CXMPPChannelKey Channel) {
+	std::map<TChannelKey, std::vector<CXMPPClient*>>::iterator it = m_mChannelClients.find(TChannelKey(Client.GetUser(), Channel));
+	if (it != m_mChannelClients.end()) {
+		RemoveClient(it->second, &Client);
+		if (it->second.empty()) {
+			m_mChannelClients.erase(it);
+		}
+	}
+}
+
+CXMPPChannelKey CXMPPModule::FindChannelKey(const CString &sChannel) const {
+	return m_ChannelKeys.Find(sChannel);
+}
+
+static const std::vector<CXMPPClient*> s_vNoClients;
+
+const std::vector<CXMPPClient*>& CXMPPModule::GetUserClients(const CUser *pUser) const {
+	std::map<const CUser*, std::vector<CXMPPClient*>>::const_iterator it = m_mUserClients.find(pUser);
+	if (it == m_mUserClients.end()) {
+		return s_vNoClients;
+	}
+
+	return it->second;
+}
+
+const std::vector<CXMPPClient*>& CXMPPModule::GetChannelClients(const CUser *pUser, const CString &sChannel) const {
+	CXMPPChannelKey Channel = FindChannelKey(sChannel);
+	if (!Channel) {
+		return s_vNoClients;
+	}
+
+	std::map<TChannelKey, std::vector<CXMPPClient*>>::const_iterator it = m_mChannelClients.find(TChannelKey(pUser, Channel));
+	if (it == m_mChannelClients.end()) {
+		return s_vNoClients;
+	}
+
+	return it->second;
+}
+
+CXMPPClient* CXMPPModule::GetSoleRecipient(const std::vector<CXMPPClient*> &vClients, const CUser *pUser) const {
+	if (vClients.size() != 1 || !GetDetachedSessions(pUser).empty()) {
+		return NULL;
+	}
+
+	return vClients.front();
+}
+
 CXMPPClient* CXMPPModule::Client(CUser& user, CString sResource) const {
-	for (const auto &pClient : m_vClients) {
-		if (pClient->GetUser() == &user && sResource.Equals(pClient->GetResource())) {
+	for (const auto &pClient : GetUserClients(&user)) {
+		if (sResource.Equals(pClient->GetResource())) {
 			return pClient;
 		}
 	}
@@ -96,8 +959,12 @@ CXMPPClient* CXMPPModule::Client(const CXMPPJID& jid, bool bAcceptNegative) cons
 
 	CXMPPClient *pCurrent = NULL;
 
-	for (const auto &pClient : m_vClients) {
-		if (pClient->GetUser() && pClient->GetUser()->GetUserName().Equals(jid.GetUser())) {
+	for (const auto &entry : m_mUserClients) {
+		if (!entry.first->GetUserName().Equals(jid.GetUser())) {
+			continue;
+		}
+
+		for (const auto &pClient : entry.second) {
 			if (!jid.GetResource().empty() && jid.GetResource().Equals(pClient->GetResource())) {
 				return pClient;
 			}
@@ -176,33 +1043,36 @@ CModule::EModRet CXMPPModule::OnChanTextMessage(CTextMessage& message) {
 
 	CXMPPJID from(channel->GetName() + "!" + network->GetName() + "+irc", GetServerName(), nick.GetNick());
 
-	CXMPPStanza iq("message");
-	iq.SetAttribute("id", "znc_" + CString::RandomString(8));
-	iq.SetAttribute("type", "groupchat");
-	if (!nick.GetNick().Equals(network->GetCurNick())) {
-		iq.SetAttribute("from", from.ToString());
-	}
-	CXMPPStanza &body = iq.NewChild("body");
-	body.NewChild().SetText(message.GetText());
+	bool bSelf = nick.GetNick().Equals(network->GetCurNick());
 
-	for (const auto &client : m_vClients) {
-		CUser *user = client->GetUser();
-		if (!user || !user->GetUsername().Equals(network->GetUser()->GetUsername()))
-			continue;
+	SXMPPArchivedMessage archived = {XMPPArchiveTime(message.GetTime()), "", bSelf, nick.GetNick(), message.GetText()};
+	ArchiveMessage(network->GetUser(), from.GetUser(), archived);
 
-		// Check that this client is in the channel
-		CXMPPJID jid = client->GetChannels()[from.GetUser()].GetJID();
-		if (jid.IsBlank())
-			continue;
+	CXMPPStanza iq(CXMPPAtom::Message);
+	iq.SetAttribute(CXMPPAtom::Id, "znc_" + CString::RandomString(8));
+	iq.SetAttribute(CXMPPAtom::Type, "groupchat");
+	CXMPPStanza &body = iq.NewChild(CXMPPAtom::Body);
+	body.NewChild().SetText(message.GetText());
 
-		// self messages
-		if (!iq.HasAttribute("from")) {
-			iq.SetAttribute("from", jid.ToString());
-		}
+	const std::vector<CXMPPClient*> &vClients = GetChannelClients(network->GetUser(), from.GetUser());
 
-		iq.SetAttribute("to", client->GetJID());
+	// self messages come from the client's own occupant jid
+	if (CXMPPClient *client = GetSoleRecipient(vClients, network->GetUser())) {
+		// Nothing to share, the tree is written as is
+		iq.SetAttribute(CXMPPAtom::To, client->GetJID());
+		iq.SetAttribute(CXMPPAtom::From, bSelf ? client->FindChannel(from.GetUser())->GetJID().ToString() : from.ToString());
 		client->Write(iq);
+		return CModule::CONTINUE;
+	}
+
+	// Serialize once, only to/from differ between recipients
+	CXMPPSerializedStanza serialized(iq);
+
+	for (const auto &client : vClients) {
+		CXMPPJID jid = client->FindChannel(from.GetUser())->GetJID();
+		client->Write(serialized, client->GetJID(), bSelf ? jid.ToString() : from.ToString());
 	}
+	HoldSessionStanza(network->GetUser(), from.GetUser(), serialized, from.ToString(), bSelf);
 
 	return CModule::CONTINUE;
 }
@@ -215,28 +1085,40 @@ CModule::EModRet CXMPPModule::OnPrivTextMessage(CTextMessage& message) {
 		return CModule::CONTINUE;
 	}
 
-	CXMPPStanza iq("message");
-	iq.SetAttribute("id", "znc_" + CString::RandomString(8));
-	iq.SetAttribute("type", "chat");
+	CString sFrom;
 	if (!nick.GetNick().Equals(network->GetCurNick())) {
-		iq.SetAttribute("from", nick.GetNick() + "!" + network->GetName() + "+irc@" + GetServerName());
+		sFrom = nick.GetNick() + "!" + network->GetName() + "+irc@" + GetServerName();
 	}
-	CXMPPStanza &body = iq.NewChild("body");
+
+	/* Our own messages, echoed back, are filed under who they were sent to */
+	CString sWith = (sFrom.empty() ? message.GetTarget() : nick.GetNick()) + "!" + network->GetName() + "+irc";
+	SXMPPArchivedMessage archived = {XMPPArchiveTime(message.GetTime()), sWith.AsLower(), sFrom.empty(), nick.GetNick(), message.GetText()};
+	ArchiveMessage(network->GetUser(), "", archived);
+
+	CXMPPStanza iq(CXMPPAtom::Message);
+	iq.SetAttribute(CXMPPAtom::Id, "znc_" + CString::RandomString(8));
+	iq.SetAttribute(CXMPPAtom::Type, "chat");
+	CXMPPStanza &body = iq.NewChild(CXMPPAtom::Body);
 	body.NewChild().SetText(message.GetText());
 
-	for (const auto &client : m_vClients) {
-		CUser *user = client->GetUser();
-		// TODO: Are user pointers comparable?
-		if (!user || !user->GetUsername().Equals(network->GetUser()->GetUsername()))
-			continue;
+	const std::vector<CXMPPClient*> &vClients = GetUserClients(network->GetUser());
 
-		if (!iq.HasAttribute("from")) {
-			iq.SetAttribute("from", client->GetJID());
-		}
-		iq.SetAttribute("to", client->GetJID());
+	if (CXMPPClient *client = GetSoleRecipient(vClients, network->GetUser())) {
+		// Nothing to share, the tree is written as is
+		iq.SetAttribute(CXMPPAtom::To, client->GetJID());
+		iq.SetAttribute(CXMPPAtom::From, sFrom.empty() ? client->GetJID() : sFrom);
 		client->Write(iq);
+		return CModule::CONTINUE;
 	}
 
+	// Serialize once, only to/from differ between recipients
+	CXMPPSerializedStanza serialized(iq);
+
+	for (const auto &client : vClients) {
+		client->Write(serialized, client->GetJID(), sFrom.empty() ? client->GetJID() : sFrom);
+	}
+	HoldSessionStanza(network->GetUser(), "", serialized, sFrom);
+
 	return CModule::CONTINUE;
 }
 
@@ -249,23 +1131,31 @@ void CXMPPModule::OnJoinMessage(CJoinMessage& message) {
 	if (!network || !channel) {
 		return;
 	}
+
+	if (nick.NickEquals(network->GetNick())) {
+		InvalidateChannelDirectory(network->GetUser());
+	}
+
+	/* Our own join is indexed with the rest of the nick list at RPL_ENDOFNAMES */
+	CXMPPNickIndex *pIndex = FindNickIndex(network);
+	if (pIndex) {
+		pIndex->Join(nick.GetNick(), channel->GetName());
+	}
+
 	if (nick.NickEquals(network->GetNick()))
 		return; // ignore self-join
 
 	CXMPPJID from(channel->GetName() + "!" + network->GetName() + "+irc", GetServerName(), nick.GetNick());
 	CXMPPJID jid(nick.GetNick() + "!" + network->GetName() + "+irc", GetServerName());
 
-	for (const auto &client : m_vClients) {
-		CUser *user = client->GetUser();
-		if (network->GetUser() != user)
-			continue;
-
-		// Check that this client is in the channel
-		CXMPPJID jid = client->GetChannels()[from.GetUser()].GetJID();
-		if (jid.IsBlank())
-			continue;
+	for (const auto &client : GetChannelClients(network->GetUser(), from.GetUser())) {
+		QueuePresence(*client, from, jid, "", "", true);
+	}
+	HoldSessionPresence(network->GetUser(), from, jid, "", "", true);
 
-		client->ChannelPresence(from, jid);
+	/* Only undoes a pending quit, joins do not otherwise send user presence */
+	for (const auto &client : GetUserClients(network->GetUser())) {
+		CancelPresence(*client, jid);
 	}
 
 	return;
@@ -281,21 +1171,26 @@ void CXMPPModule::OnPartMessage(CPartMessage & message) {
 		return;
 	}
 
-	CXMPPJID from(channel->GetName() + "!" + network->GetName() + "+irc", GetServerName(), nick.GetNick());
-	CXMPPJID jid(nick.GetNick() + "!" + network->GetName() + "+irc", GetServerName());
+	if (nick.NickEquals(network->GetCurNick())) {
+		InvalidateChannelDirectory(network->GetUser());
+	}
 
-	for (const auto &client : m_vClients) {
-		CUser *user = client->GetUser();
-		if (!user || !user->GetUsername().Equals(network->GetUser()->GetUsername()))
-			continue;
+	CXMPPNickIndex *pIndex = FindNickIndex(network);
+	if (pIndex) {
+		if (nick.NickEquals(network->GetCurNick())) {
+			pIndex->PartAll(channel->GetName());
+		} else {
+			pIndex->Part(nick.GetNick(), channel->GetName());
+		}
+	}
 
-		// Check that this client is in the channel
-		CXMPPJID jid = client->GetChannels()[from.GetUser()].GetJID();
-		if (jid.IsBlank())
-			continue;
+	CXMPPJID from(channel->GetName() + "!" + network->GetName() + "+irc", GetServerName(), nick.GetNick());
+	CXMPPJID jid(nick.GetNick() + "!" + network->GetName() + "+irc", GetServerName());
 
-		client->ChannelPresence(from, jid, "unavailable", message.GetReason());
+	for (const auto &client : GetChannelClients(network->GetUser(), from.GetUser())) {
+		QueuePresence(*client, from, jid, "unavailable", message.GetReason(), true);
 	}
+	HoldSessionPresence(network->GetUser(), from, jid, "unavailable", message.GetReason(), true);
 
 	return;
 }
@@ -309,26 +1204,28 @@ void CXMPPModule::OnQuitMessage(CQuitMessage &message, const std::vector<CChan*>
 		return;
 	}
 
-	CXMPPJID jid(nick.GetNick() + "!" + network->GetName() + "+irc", GetServerName());
-
-	for (const auto &client : m_vClients) {
-		CUser *user = client->GetUser();
-		if (!user || !user->GetUsername().Equals(network->GetUser()->GetUsername()))
-			continue;
+	if (nick.NickEquals(network->GetCurNick())) {
+		InvalidateChannelDirectory(network->GetUser());
+		m_mNickIndexes.erase(network);
+	} else if (CXMPPNickIndex *pIndex = FindNickIndex(network)) {
+		pIndex->Quit(nick.GetNick());
+	}
 
-		for (const auto &channel : vChans) {
-			CXMPPJID from(channel->GetName() + "!" + network->GetName() + "+irc", GetServerName(), nick.GetNick());
+	CXMPPJID jid(nick.GetNick() + "!" + network->GetName() + "+irc", GetServerName());
 
-			// Check that this client is in the channel
-			CXMPPJID jid = client->GetChannels()[from.GetUser()].GetJID();
-			if (jid.IsBlank())
-				continue;
+	for (const auto &channel : vChans) {
+		CXMPPJID from(channel->GetName() + "!" + network->GetName() + "+irc", GetServerName(), nick.GetNick());
 
-			client->ChannelPresence(from, jid, "unavailable", message.GetParam(0));
+		for (const auto &client : GetChannelClients(network->GetUser(), from.GetUser())) {
+			QueuePresence(*client, from, jid, "unavailable", message.GetParam(0), true);
 		}
+		HoldSessionPresence(network->GetUser(), from, jid, "unavailable", message.GetParam(0), true);
+	}
 
-		client->Presence(jid, "unavailable", message.GetParam(0));
+	for (const auto &client : GetUserClients(network->GetUser())) {
+		QueuePresence(*client, jid, jid, "unavailable", message.GetParam(0), false);
 	}
+	HoldSessionPresence(network->GetUser(), jid, jid, "unavailable", message.GetParam(0), false);
 
 	return;
 }
@@ -344,23 +1241,56 @@ void CXMPPModule::OnKickMessage(CKickMessage &message) {
 		return;
 	}
 
+	if (nick.Equals(network->GetCurNick())) {
+		InvalidateChannelDirectory(network->GetUser());
+	}
+
+	CXMPPNickIndex *pIndex = FindNickIndex(network);
+	if (pIndex) {
+		if (nick.Equals(network->GetCurNick())) {
+			pIndex->PartAll(channel->GetName());
+		} else {
+			pIndex->Part(nick, channel->GetName());
+		}
+	}
+
 	CXMPPJID from(channel->GetName() + "!" + network->GetName() + "+irc", GetServerName(), nick);
 	CXMPPJID jid(nick + "!" + network->GetName() + "+irc", GetServerName());
 
-	for (const auto &client : m_vClients) {
-		CUser *user = client->GetUser();
-		if (!user || !user->GetUsername().Equals(network->GetUser()->GetUsername()))
-			continue;
+	for (const auto &client : GetChannelClients(network->GetUser(), from.GetUser())) {
+		QueuePresence(*client, from, jid, "unavailable", status, true, {"307"});
+	}
+	HoldSessionPresence(network->GetUser(), from, jid, "unavailable", status, true, {"307"});
 
-		// Check that this client is in the channel
-		CXMPPJID jid = client->GetChannels()[from.GetUser()].GetJID();
-		if (jid.IsBlank())
-			continue;
+	return;
+}
 
-		client->ChannelPresence(from, jid, "unavailable", status, {"307"});
+void CXMPPModule::OnNickMessage(CNickMessage &message, const std::vector<CChan*> &vChans) {
+	CIRCNetwork *network = message.GetNetwork();
+
+	if (!network) {
+		return;
 	}
 
-	return;
+	CXMPPNickIndex *pIndex = FindNickIndex(network);
+	if (pIndex) {
+		pIndex->Rename(message.GetOldNick(), message.GetNewNick());
+	}
+}
+
+void CXMPPModule::OnIRCConnected() {
+	/* Directories only list connected networks */
+	if (GetNetwork()) {
+		InvalidateChannelDirectory(GetNetwork()->GetUser());
+		m_mNickIndexes.erase(GetNetwork());
+	}
+}
+
+void CXMPPModule::OnIRCDisconnected() {
+	if (GetNetwork()) {
+		InvalidateChannelDirectory(GetNetwork()->GetUser());
+		m_mNickIndexes.erase(GetNetwork());
+	}
 }
 
 // Taken from https://www.alien.net.au/irc/irc2numerics.html
@@ -387,34 +1317,45 @@ CModule::EModRet CXMPPModule::OnNumericMessage(CNumericMessage &message) {
 			return CModule::CONTINUE;
 		}
 
+		// The nick list is complete
+		CXMPPNickIndex *pIndex = FindNickIndex(network);
+		if (pIndex) {
+			pIndex->PartAll(channel->GetName());
+			for (const auto &entry : channel->GetNicks()) {
+				pIndex->Join(entry.second.GetNick(), channel->GetName());
+			}
+		}
+
 		DEBUG("XMPPModule finishing join to " + channel->GetName() + " on " + network->GetName());
 
 		CString chanuser = channel->GetName() + "!" + network->GetName() + "+irc";
 
-		for (const auto &client : m_vClients) {
-			CUser *user = client->GetUser();
-			if (!user)
-				continue;
-
-			CXMPPChannel chan = client->GetChannels()[chanuser];
-			CXMPPJID jid = chan.GetJID();
-			if (jid.IsBlank())
-				continue;
+		// Copied as JoinChannel registers membership with the index
+		std::vector<CXMPPClient*> vClients = GetChannelClients(network->GetUser(), chanuser);
+		for (const auto &client : vClients) {
+			CXMPPChannel chan = *client->FindChannel(chanuser);
 
 			// Finish join
-			client->JoinChannel(channel, jid, chan.GetHistoryMaxStanzas());
+			client->JoinChannel(channel, chan.GetJID(), chan.GetHistoryMaxStanzas());
 		}
 
 		return CModule::CONTINUE;
 	}
 
+	if (message.GetCode() == 5 && network) {
+		/* RPL_ISUPPORT may change the CASEMAPPING, the index is rebuilt on next use */
+		m_mNickIndexes.erase(network);
+		return CModule::CONTINUE;
+	}
+
 	/* Send error message to client as PM */
 	if (code.IsClientError() || code.IsServerError()) {
-		CXMPPStanza iq("message");
-		iq.SetAttribute("id", "znc_" + CString::RandomString(8));
-		iq.SetAttribute("type", "chat");
-		iq.SetAttribute("from", nick.GetNick() + "!" + network->GetName() + "+irc@" + GetServerName());
-		CXMPPStanza &body = iq.NewChild("body");
+		CString sFrom = nick.GetNick() + "!" + network->GetName() + "+irc@" + GetServerName();
+
+		CXMPPStanza iq(CXMPPAtom::Message);
+		iq.SetAttribute(CXMPPAtom::Id, "znc_" + CString::RandomString(8));
+		iq.SetAttribute(CXMPPAtom::Type, "chat");
+		CXMPPStanza &body = iq.NewChild(CXMPPAtom::Body);
 		CString text;
 		for (const auto &param : message.GetParams()) {
 			if (!text.empty()) {
@@ -424,14 +1365,21 @@ CModule::EModRet CXMPPModule::OnNumericMessage(CNumericMessage &message) {
 		}
 		body.NewChild().SetText(text);
 
-		for (const auto &client : m_vClients) {
-			CUser *user = client->GetUser();
-			if (!user || user != network->GetUser())
-				continue;
+		const std::vector<CXMPPClient*> &vClients = GetUserClients(network->GetUser());
 
-			iq.SetAttribute("to", client->GetJID());
+		if (CXMPPClient *client = GetSoleRecipient(vClients, network->GetUser())) {
+			iq.SetAttribute(CXMPPAtom::To, client->GetJID());
+			iq.SetAttribute(CXMPPAtom::From, sFrom);
 			client->Write(iq);
+			return CModule::CONTINUE;
+		}
+
+		CXMPPSerializedStanza serialized(iq);
+
+		for (const auto &client : vClients) {
+			client->Write(serialized, client->GetJID(), sFrom);
 		}
+		HoldSessionStanza(network->GetUser(), "", serialized, sFrom);
 	}
 
 	return CModule::CONTINUE;
@@ -6,46 +6,154 @@
  * by the Free Software Foundation.
  */
 
+#ifndef _XMPP_H
+#define _XMPP_H
+
+#include <unordered_map>
+#include <unordered_set>
+
 #include <znc/Modules.h>
+#include "Archive.h"
+#include "Caps.h"
+#include "Channels.h"
+#include "Compression.h"
 #include "JID.h"
+#include "NickIndex.h"
+#include "ParserPool.h"
+#include "Stanza.h"
 
 class CXMPPClient;
-class CXMPPStanza;
+class CXMPPSession;
 
-class CXMPPChannel {
-public:
-	CXMPPChannel() {}
-	CXMPPChannel(const CXMPPJID &jid, CChan *const &pChan, int historyMaxStanzas = 25) {
-		m_Jid = jid;
-		m_pChan = pChan;
-		// Used for callback joins
-		m_historyMaxStanzas = historyMaxStanzas;
-	}
-
-	CXMPPJID GetJID() const { return m_Jid; }
-	CChan *GetChannel() const { return m_pChan; }
-	int GetHistoryMaxStanzas() { return m_historyMaxStanzas; }
+/* What to do when a client is not reading its stanzas fast enough */
+typedef enum {
+	XMPP_QUEUE_COLLAPSE_PRESENCE = 1 << 0, /* only the latest presence from each JID is kept */
+	XMPP_QUEUE_DROP_PRESENCE     = 1 << 1, /* oldest presence is dropped to get back under budget */
+	XMPP_QUEUE_DISCONNECT        = 1 << 2  /* the client is dropped if that is still not enough */
+} EXMPPQueuePolicy;
 
-protected:
-	CXMPPJID m_Jid;
-	CChan *m_pChan;
-	int m_historyMaxStanzas;
+struct SXMPPQueueLimits {
+	size_t uHighWater;   /* stanzas are queued once this much is waiting in the socket */
+	size_t uMaxBytes;
+	size_t uMaxStanzas;
+	unsigned int uiPolicy;
 };
 
 class CXMPPModule : public CModule {
 public:
 	MODCONSTRUCTOR(CXMPPModule) {};
+	virtual ~CXMPPModule();
 
 	virtual bool OnLoad(const CString& sArgs, CString& sMessage) override;
 	virtual EModRet OnDeleteUser(CUser& User) override;
+	virtual EModRet OnDeleteNetwork(CIRCNetwork& Network) override;
+	virtual void OnModCommand(const CString& sCommand) override;
 
 	void ClientConnected(CXMPPClient &Client);
 	void ClientDisconnected(CXMPPClient &Client);
+	/* Out of the user and channel indexes, for a client that is closing */
+	void UnindexClient(CXMPPClient &Client);
+	void ClientAuthenticated(CXMPPClient &Client);
+	void ClientJoinedChannel(CXMPPClient &Client, CXMPPChannelKey Channel);
+	void ClientPartedChannel(CXMPPClient &Client, CXMPPChannelKey Channel);
+
+	/* Keys are interned as clients join, see CXMPPChannelMembership */
+	CXMPPChannelKeys& GetChannelKeys() { return m_ChannelKeys; }
+	CXMPPChannelKey FindChannelKey(const CString &sChannel) const;
 
 	std::vector<CXMPPClient*>& GetClients() { return m_vClients; };
+	/* Authenticated clients of a user, and clients of a user joined to a channel (keyed by "#chan!network+irc") */
+	const std::vector<CXMPPClient*>& GetUserClients(const CUser *pUser) const;
+	const std::vector<CXMPPClient*>& GetChannelClients(const CUser *pUser, const CString &sChannel) const;
+	/* The only one of vClients, when no detached session of the user needs a copy either */
+	CXMPPClient* GetSoleRecipient(const std::vector<CXMPPClient*> &vClients, const CUser *pUser) const;
 	CXMPPClient* Client(CUser& User, CString sResource) const;
 	CXMPPClient* Client(const CXMPPJID& jid, bool bAcceptNegative = true) const;
 
+	/* Push parser contexts, shared by all the module's sockets */
+	CXMPPParserPool& GetParserPool() { return m_ParserPool; }
+
+	/* Trace categories for a user's sockets, an empty user means unauthenticated ones */
+	unsigned int GetTraceMask(const CString &sUser) const;
+
+	const SXMPPQueueLimits& GetQueueLimits() const { return m_QueueLimits; }
+
+	/*
+	 * Stream Management sessions. A resumable session is kept for
+	 * GetSessionTimeout() seconds after its client goes away, for a new
+	 * connection to pick up with <resume/>.
+	 */
+	CXMPPSession* CreateSession(CXMPPClient &Client, bool bResumable);
+	CXMPPSession* FindSession(const CString &sId) const;
+	void DetachSession(CXMPPClient &Client, CXMPPSession &Session);
+	void ResumeSession(CXMPPClient &Client, CXMPPSession &Session);
+	void DeleteSession(CXMPPSession *pSession);
+	void ExpireSessions();
+	unsigned int GetSessionTimeout() const { return m_uiSessionTimeout; }
+	const std::vector<CXMPPSession*>& GetDetachedSessions(const CUser *pUser) const;
+
+	/*
+	 * What a user's clients are sent is also held for the user's detached
+	 * sessions, channel traffic only for sessions that were in the channel.
+	 * An empty sFrom is the session's own JID, bSelf its occupant JID.
+	 */
+	void HoldSessionStanza(const CUser *pUser, const CString &sChannel, const CXMPPSerializedStanza &Stanza, const CString &sFrom, bool bSelf = false);
+	void HoldSessionPresence(const CUser *pUser, const CXMPPJID &From, const CXMPPJID &Jid, const CString &sType, const CString &sStatus, bool bChannel, const std::vector<CString> &vsCodes = {});
+
+	const SXMPPCompressionLimits& GetCompressionLimits() const { return m_CompressionLimits; }
+
+	/*
+	 * Message archives (XEP-0313) under the module's save path, one per
+	 * user for private messages and one per user and channel. Archives are
+	 * opened on first use and closed again once idle, and are NULL when
+	 * archiving is turned off.
+	 */
+	bool IsArchiving() const { return m_bArchive; }
+	CXMPPArchive* GetArchive(const CUser *pUser, const CString &sChannel = "");
+	void ExpireArchives();
+	void ArchiveMessage(const CUser *pUser, const CString &sChannel, const SXMPPArchivedMessage &Message);
+
+	/*
+	 * Service discovery answers for the server and its users. and
+	 * channels. directories, serialized without to or id. The info never
+	 * changes and is built at load, the channel listing is built per user
+	 * on first query and only changes with our own joins, parts, kicks
+	 * and connections. NULL for any other entity, and for the users.
+	 * listing, which is too large for one answer and is paged straight
+	 * from the nick indexes instead.
+	 */
+	const CXMPPSerializedStanza* GetDisco(const CUser *pUser, const CXMPPAtom *pNamespace, const CString &sJID);
+	/*
+	 * Every IRC user has the same disco#info, built at load. Its
+	 * Entity Capabilities (XEP-0115) node and verification string go on
+	 * their presence, so clients cache it once instead of asking each nick.
+	 */
+	const CXMPPSerializedStanza& GetIRCUserInfo(bool bCapsNode) const { return bCapsNode ? m_IRCUserCapsInfo : m_IRCUserInfo; }
+	const CString& GetCapsNode() const { return m_sCapsNode; }
+	const CString& GetCapsVer() const { return m_sCapsVer; }
+	void InvalidateChannelDirectory(const CUser *pUser);
+
+	/*
+	 * Who shares a channel with us on a network, built on first use and
+	 * kept current from joins, parts, quits, kicks and nick changes. NULL
+	 * while the network is not connected.
+	 */
+	CXMPPNickIndex* GetNickIndex(CIRCNetwork *pNetwork);
+
+	/*
+	 * Presence caused by IRC joins, parts and quits is held for a short
+	 * window. A newer update for the same JID replaces a pending one, and an
+	 * update that undoes a pending one cancels both, so a netsplit followed
+	 * by a rejoin sends nothing.
+	 */
+	void QueuePresence(CXMPPClient &Client, const CXMPPJID &From, const CXMPPJID &Jid, const CString &sType, const CString &sStatus, bool bChannel, const std::vector<CString> &vsCodes = {});
+	/* The presence stanzas themselves, for the client or session sSelf */
+	void BuildPresence(CXMPPStanza &Presence, const CXMPPJID &From, const CString &sType, const CString &sStatus) const;
+	void BuildChannelPresence(CXMPPStanza &Presence, const CXMPPJID &From, const CXMPPJID &Jid, const CString &sSelf, const CString &sType, const CString &sStatus, const std::vector<CString> &vsCodes) const;
+	/* Drop a pending unavailable presence from From, if there is one. */
+	void CancelPresence(CXMPPClient &Client, const CXMPPJID &From);
+	void FlushPresence();
+
 	CString GetServerName() const { return m_sServerName; }
 	bool IsTLSAvailible() const;
 
@@ -57,9 +165,63 @@ public:
 	virtual void OnPartMessage(CPartMessage &message) override;
 	virtual void OnQuitMessage(CQuitMessage &message, const std::vector<CChan*> &vChans) override;
 	virtual void OnKickMessage(CKickMessage &message) override;
+	virtual void OnNickMessage(CNickMessage &message, const std::vector<CChan*> &vChans) override;
 	virtual CModule::EModRet OnNumericMessage(CNumericMessage &message) override;
+	virtual void OnIRCConnected() override;
+	virtual void OnIRCDisconnected() override;
 protected:
+	void BuildDisco();
+	void BuildChannelDirectory(const CUser &User, CXMPPStanza &Query) const;
+	/* The index if one has been built, never builds one */
+	CXMPPNickIndex* FindNickIndex(const CIRCNetwork *pNetwork);
+	void ForgetDetachedSession(CXMPPSession &Session);
+
+	typedef std::pair<const CUser*, CXMPPChannelKey> TChannelKey;
+
+	struct SPendingPresence {
+		CXMPPJID From;
+		CXMPPJID Jid;
+		CString sType;
+		CString sStatus;
+		std::vector<CString> vsCodes;
+		bool bChannel;
+		unsigned long long uSequence;
+	};
+
+	typedef std::pair<CXMPPClient*, CString> TPresenceKey;
+	/* Namespace and lower case JID queried */
+	typedef std::pair<const CXMPPAtom*, CString> TDiscoKey;
+
 	std::vector<CXMPPClient*> m_vClients;
+	std::map<const CUser*, std::vector<CXMPPClient*>> m_mUserClients;
+	std::map<TChannelKey, std::vector<CXMPPClient*>> m_mChannelClients;
+	CXMPPChannelKeys m_ChannelKeys;
+	CXMPPParserPool m_ParserPool;
+	/* Keyed by lower case user name, "*" applies to unauthenticated sockets */
+	std::map<CString, unsigned int> m_muiTraceMasks;
+
+	std::map<std::pair<const CUser*, CString>, CXMPPArchive*> m_mArchives;
+	bool m_bArchive;
+
+	std::map<TDiscoKey, CXMPPSerializedStanza> m_mDisco;
+	std::map<const CUser*, CXMPPSerializedStanza> m_mChannelDirectories;
+	CXMPPSerializedStanza m_IRCUserInfo;
+	CXMPPSerializedStanza m_IRCUserCapsInfo;
+	CString m_sCapsNode;
+	CString m_sCapsVer;
+	std::map<const CIRCNetwork*, CXMPPNickIndex> m_mNickIndexes;
+
+	std::map<CString, CXMPPSession*> m_mSessions;
+	std::map<const CUser*, std::vector<CXMPPSession*>> m_mDetachedSessions;
+	unsigned int m_uiSessionTimeout;
+
+	std::map<TPresenceKey, SPendingPresence> m_mPendingPresence;
+	unsigned long long m_uPresenceSequence;
+	unsigned int m_uiPresenceWindow;
+	bool m_bPresenceTimer;
 	CString m_sServerName;
+	SXMPPQueueLimits m_QueueLimits;
+	SXMPPCompressionLimits m_CompressionLimits;
 };
 
+#endif
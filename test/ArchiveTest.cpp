@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/* The on-disk archive and its sidecar index, including recovery after a crash */
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <climits>
+#include <cstdlib>
+
+#include "Test.h"
+#include "Archive.h"
+
+static const size_t MESSAGES = 1000;
+
+static CString TempPath() {
+	char szPath[] = "/tmp/xmpp-archive-XXXXXX";
+	int iFD = mkstemp(szPath);
+	close(iFD);
+	unlink(szPath);
+	return szPath;
+}
+
+static void Remove(const CString &sPath) {
+	unlink(sPath.c_str());
+	unlink((sPath + ".idx").c_str());
+}
+
+static off_t FileSize(const CString &sPath) {
+	struct stat st;
+	return stat(sPath.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+/* Message i is at time 1000 + i, every third one with alice */
+static bool Fill(CXMPPArchive &Archive, size_t uFrom, size_t uTo) {
+	for (size_t i = uFrom; i < uTo; i++) {
+		SXMPPArchivedMessage message = {1000 + i, i % 3 ? "bob!net+irc" : "alice!net+irc", i % 2 == 0, "nick", "body\t" + CString((unsigned long long)i) + "\n"};
+		if (!Archive.Append(message)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int CheckContents(CXMPPArchive &Archive, size_t uMessages) {
+	CHECK(Archive.GetSize() == uMessages);
+
+	/* Time range */
+	SXMPPArchiveQuery query = {1100, 1199, "", "", "", false, 50};
+	SXMPPArchivePage page;
+	CHECK(Archive.Query(query, page));
+	CHECK(page.uCount == 100);
+	CHECK(page.vuIds.size() == 50);
+	CHECK(page.vuIds.front() == 100);
+	CHECK(!page.bComplete);
+
+	/* Paging on from the last id */
+	query.sAfter = CString((unsigned long long)page.vuIds.back());
+	CHECK(Archive.Query(query, page));
+	CHECK(page.vuIds.size() == 50 && page.vuIds.front() == 150 && page.bComplete);
+	CHECK(page.uFirstIndex == 50);
+
+	/* The last page, filtered by peer */
+	SXMPPArchiveQuery with = {0, ULLONG_MAX, "alice!net+irc", "", "", true, 10};
+	CHECK(Archive.Query(with, page));
+	CHECK(page.uCount == (uMessages + 2) / 3);
+	CHECK(page.vuIds.size() == 10);
+
+	std::vector<SXMPPArchivedMessage> vMessages;
+	CHECK(Archive.Read(page.vuIds, vMessages));
+	CHECK(vMessages.size() == 10);
+	for (size_t i = 0; i < vMessages.size(); i++) {
+		CHECK(page.vuIds[i] % 3 == 0);
+		CHECK(vMessages[i].sWith == "alice!net+irc");
+		CHECK(vMessages[i].uTime == 1000 + page.vuIds[i]);
+		CHECK(vMessages[i].sBody == "body\t" + CString((unsigned long long)page.vuIds[i]) + "\n");
+	}
+	CHECK(vMessages.back().sBody == "body\t" + CString((unsigned long long)(uMessages - 1) / 3 * 3) + "\n");
+
+	/* Ids from another archive are rejected */
+	query.sAfter = CString((unsigned long long)uMessages);
+	CHECK(!Archive.Query(query, page));
+
+	return 0;
+}
+
+static int TestQueryAndRead() {
+	CString sPath = TempPath();
+	CXMPPArchive Archive(sPath);
+
+	CHECK(Archive.GetSize() == 0);
+	CHECK(Fill(Archive, 0, MESSAGES));
+	CHECK(CheckContents(Archive, MESSAGES) == 0);
+
+	Remove(sPath);
+	return 0;
+}
+
+static int TestIndexPersists() {
+	CString sPath = TempPath();
+	{
+		CXMPPArchive Archive(sPath);
+		CHECK(Fill(Archive, 0, MESSAGES));
+	}
+
+	/* One fixed size record per message, reopening reads nothing else */
+	off_t iIndex = FileSize(sPath + ".idx");
+	CHECK(iIndex > 0 && iIndex % MESSAGES == 0);
+
+	CXMPPArchive Archive(sPath);
+	CHECK(CheckContents(Archive, MESSAGES) == 0);
+	CHECK(FileSize(sPath + ".idx") == iIndex);
+
+	/* Closing an idle archive and using it again */
+	Archive.Close();
+	CHECK(!Archive.IsOpen());
+	CHECK(Fill(Archive, MESSAGES, MESSAGES + 1));
+	CHECK(Archive.IsOpen());
+	CHECK(CheckContents(Archive, MESSAGES + 1) == 0);
+
+	Remove(sPath);
+	return 0;
+}
+
+static int TestRecovery() {
+	CString sPath = TempPath();
+	{
+		CXMPPArchive Archive(sPath);
+		CHECK(Fill(Archive, 0, MESSAGES));
+	}
+	off_t iIndex = FileSize(sPath + ".idx");
+	size_t uRecord = iIndex / MESSAGES;
+
+	/* A crash between writing the log and the index, in the middle of a record */
+	CHECK(truncate((sPath + ".idx").c_str(), iIndex - 2 * uRecord - 5) == 0);
+	{
+		CXMPPArchive Archive(sPath);
+		CHECK(CheckContents(Archive, MESSAGES) == 0);
+	}
+	CHECK(FileSize(sPath + ".idx") == iIndex);
+
+	/* An archive from before the index existed */
+	unlink((sPath + ".idx").c_str());
+	{
+		CXMPPArchive Archive(sPath);
+		CHECK(CheckContents(Archive, MESSAGES) == 0);
+	}
+	CHECK(FileSize(sPath + ".idx") == iIndex);
+
+	/* Half a line in the log, it is never indexed and the next message starts afresh */
+	int iFD = open(sPath.c_str(), O_WRONLY | O_APPEND);
+	CHECK(write(iFD, "99999\tcarol", 11) == 11);
+	close(iFD);
+	{
+		CXMPPArchive Archive(sPath);
+		CHECK(Archive.GetSize() == MESSAGES);
+		CHECK(Fill(Archive, MESSAGES, MESSAGES + 2));
+		CHECK(CheckContents(Archive, MESSAGES + 2) == 0);
+	}
+	{
+		CXMPPArchive Archive(sPath);
+		CHECK(CheckContents(Archive, MESSAGES + 2) == 0);
+	}
+
+	Remove(sPath);
+	return 0;
+}
+
+int main() {
+	int iFailures = 0;
+
+	RUN_TEST(TestQueryAndRead);
+	RUN_TEST(TestIndexPersists);
+	RUN_TEST(TestRecovery);
+
+	return iFailures ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * A long stream of parsed stanzas must not grow the socket's arena: each
+ * stanza's nodes, names and text go when the arena is reset after it.
+ */
+
+#include "Test.h"
+#include "Stanza.h"
+
+/* Same block size as a socket's arena */
+static const size_t ARENA_BLOCK = 8192;
+static const unsigned int STANZAS = 100000;
+
+/* Build a stanza the way the parser callbacks do, with names unique to i */
+static CXMPPStanza* ParseLike(CXMPPArena &Arena, unsigned int i, bool bAuthenticated) {
+	CString sName = "name" + CString(i);
+	CString sNamespace = "urn:test:" + CString(i);
+	auto Name = [&](const CString &sData) {
+		return bAuthenticated ? CXMPPAtom::Intern(sData.data(), sData.size(), Arena) : CXMPPAtom::Lookup(sData.data(), sData.size(), Arena);
+	};
+
+	CXMPPStanza *pStanza = Arena.New<CXMPPStanza>(Arena);
+	pStanza->SetName(CXMPPAtom::Message);
+	pStanza->SetAttribute(CXMPPAtom::To, "user@example.com/resource");
+	pStanza->SetAttribute(CXMPPAtom::Type, "chat");
+	pStanza->SetAttribute(Name(sName), "value");
+
+	CXMPPStanza &body = pStanza->NewChild((const char *)NULL);
+	body.SetName(CXMPPAtom::Body);
+	body.NewChild((const char *)NULL).SetText("hello <world> & " + CString(i));
+
+	CXMPPStanza &payload = pStanza->NewChild((const char *)NULL);
+	payload.SetName(Name(sName));
+	payload.SetNamespace(Name(sNamespace));
+
+	return pStanza;
+}
+
+static int TestArenaStaysBounded() {
+	CXMPPArena Arena(ARENA_BLOCK);
+	CString sOutput;
+
+	for (unsigned int i = 0; i < STANZAS; i++) {
+		CXMPPStanza *pStanza = ParseLike(Arena, i, false);
+
+		sOutput.clear();
+		pStanza->Serialize(sOutput);
+		CHECK(sOutput.find("<name" + CString(i) + " xmlns='urn:test:" + CString(i) + "'") != CString::npos);
+
+		pStanza->~CXMPPStanza();
+		Arena.Reset();
+		CHECK(Arena.GetBytesReserved() <= ARENA_BLOCK);
+	}
+
+	/* One oversized text run, its block must not outlive the stanza */
+	CXMPPStanza *pStanza = Arena.New<CXMPPStanza>(Arena, "message");
+	pStanza->NewChild((const char *)NULL).SetText(CString(ARENA_BLOCK * 4, 'x'));
+	CHECK(Arena.GetBytesReserved() > ARENA_BLOCK);
+	pStanza->~CXMPPStanza();
+	Arena.Reset();
+	CHECK(Arena.GetBytesReserved() <= ARENA_BLOCK);
+
+	return 0;
+}
+
+int main() {
+	int iFailures = 0;
+
+	RUN_TEST(TestArenaStaysBounded);
+
+	return iFailures ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * Names from the wire must not grow the atom table past its bound, or at
+ * all before the peer has authenticated.
+ */
+
+#include "Test.h"
+#include "Stanza.h"
+
+/* Same block size as a socket's arena */
+static const size_t ARENA_BLOCK = 8192;
+/* Matches MAX_DYNAMIC_ATOMS in Atom.cpp */
+static const size_t MAX_DYNAMIC_ATOMS = 4096;
+static const unsigned int STANZAS = 100000;
+
+/* Build a stanza the way the parser callbacks do, with names unique to i */
+static CXMPPStanza* ParseLike(CXMPPArena &Arena, unsigned int i, bool bAuthenticated) {
+	CString sName = "name" + CString(i);
+	CString sNamespace = "urn:test:" + CString(i);
+	auto Name = [&](const CString &sData) {
+		return bAuthenticated ? CXMPPAtom::Intern(sData.data(), sData.size(), Arena) : CXMPPAtom::Lookup(sData.data(), sData.size(), Arena);
+	};
+
+	CXMPPStanza *pStanza = Arena.New<CXMPPStanza>(Arena);
+	pStanza->SetName(CXMPPAtom::Message);
+	pStanza->SetAttribute(CXMPPAtom::To, "user@example.com/resource");
+	pStanza->SetAttribute(CXMPPAtom::Type, "chat");
+	pStanza->SetAttribute(Name(sName), "value");
+
+	CXMPPStanza &body = pStanza->NewChild((const char *)NULL);
+	body.SetName(CXMPPAtom::Body);
+	body.NewChild((const char *)NULL).SetText("hello <world> & " + CString(i));
+
+	CXMPPStanza &payload = pStanza->NewChild((const char *)NULL);
+	payload.SetName(Name(sName));
+	payload.SetNamespace(Name(sNamespace));
+
+	return pStanza;
+}
+
+static int TestUnauthenticatedNamesNotInterned() {
+	size_t uBefore = CXMPPAtom::GetDynamicCount();
+	CXMPPArena Arena(ARENA_BLOCK);
+
+	for (unsigned int i = 0; i < STANZAS; i++) {
+		CXMPPStanza *pStanza = ParseLike(Arena, i, false);
+
+		/* Content comparison still works for uninterned names */
+		CString sName = "name" + CString(i);
+		CHECK(pStanza->GetChildByName(sName) != NULL);
+
+		/* Nor does keeping a copy around intern them */
+		CXMPPStanza *pCopy = pStanza->Clone();
+		CHECK(!pCopy->GetFirstChild()->GetNextSibling()->GetNameAtom()->IsInterned());
+		delete pCopy;
+
+		pStanza->~CXMPPStanza();
+		Arena.Reset();
+	}
+
+	CHECK(CXMPPAtom::GetDynamicCount() == uBefore);
+	return 0;
+}
+
+static int TestAtomTableBounded() {
+	CXMPPArena Arena(ARENA_BLOCK);
+
+	for (unsigned int i = 0; i < STANZAS; i++) {
+		CXMPPStanza *pStanza = ParseLike(Arena, i, true);
+		pStanza->~CXMPPStanza();
+		Arena.Reset();
+		CHECK(CXMPPAtom::GetDynamicCount() <= MAX_DYNAMIC_ATOMS);
+	}
+
+	CHECK(CXMPPAtom::GetDynamicCount() == MAX_DYNAMIC_ATOMS);
+
+	/* Interned before the table filled up, so still pointer equal */
+	const CXMPPAtom *pFirst = CXMPPAtom::Find("name0", 5);
+	CHECK(pFirst && pFirst->IsInterned());
+	CHECK(CXMPPAtom::Intern("name0", 5, Arena) == pFirst);
+
+	/* Past the bound names are kept in the arena, and still compare by content */
+	CString sLate = "name" + CString(STANZAS - 1);
+	const CXMPPAtom *pLate = CXMPPAtom::Intern(sLate.data(), sLate.size(), Arena);
+	CHECK(!pLate->IsInterned());
+	CHECK(pLate->Equals(CXMPPAtom::Lookup(sLate.data(), sLate.size(), Arena)));
+
+	return 0;
+}
+
+int main() {
+	int iFailures = 0;
+
+	RUN_TEST(TestUnauthenticatedNamesNotInterned);
+	/* Fills the atom table, so it goes last */
+	RUN_TEST(TestAtomTableBounded);
+
+	return iFailures ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * SetAttribute, GetAttribute and HasAttribute on the attribute sets real
+ * stanzas carry: the MCString a stanza used to keep its attributes in,
+ * against the inline vector, looked up by string and by atom.
+ */
+
+#include <vector>
+
+#include "Bench.h"
+#include "Stanza.h"
+
+struct SShape {
+	const char *szName;
+	std::vector<std::pair<CString, CString>> vAttributes;
+};
+
+static const unsigned int ITERATIONS = 500000;
+
+/* What the stanzas used to do, a map node per attribute */
+class CMapAttributes {
+public:
+	void SetAttribute(const CString &sName, const CString &sValue) { m_msAttributes[sName] = sValue; }
+
+	CString GetAttribute(const CString &sName) const {
+		MCString::const_iterator it = m_msAttributes.find(sName);
+		return it == m_msAttributes.end() ? "" : it->second;
+	}
+
+	bool HasAttribute(const CString &sName) const { return m_msAttributes.find(sName) != m_msAttributes.end(); }
+
+protected:
+	MCString m_msAttributes;
+};
+
+int main() {
+	std::vector<SShape> vShapes = {
+		{"presence", {{"from", "nick!freenode+irc@znc.in"}, {"to", "user@znc.in/phone"}}},
+		{"message", {{"to", "#znc!freenode+irc@znc.in"}, {"from", "user@znc.in/phone"}, {"id", "znc_Ab3dE6gH"}, {"type", "groupchat"}}},
+		{"iq", {{"to", "users.znc.in"}, {"from", "user@znc.in/phone"}, {"id", "disco1"}, {"type", "get"}, {"xml:lang", "en"}}},
+	};
+
+	for (const SShape &shape : vShapes) {
+		std::vector<const CXMPPAtom*> vAtoms;
+		for (const auto &attribute : shape.vAttributes) {
+			vAtoms.push_back(CXMPPAtom::Find(attribute.first.data(), attribute.first.size()));
+		}
+
+		printf("%s, %u attributes, set all then get and test each plus one missing:\n", shape.szName, (unsigned int)shape.vAttributes.size());
+
+		double dBefore = Measure("MCString", ITERATIONS, [&]() {
+			CMapAttributes attributes;
+			for (const auto &attribute : shape.vAttributes) {
+				attributes.SetAttribute(attribute.first, attribute.second);
+			}
+			for (const auto &attribute : shape.vAttributes) {
+				g_uBenchSink += attributes.GetAttribute(attribute.first).size() + attributes.HasAttribute(attribute.first);
+			}
+			g_uBenchSink += attributes.HasAttribute("xmlns:stream");
+		});
+
+		CXMPPArena Arena(8192);
+		double dNames = Measure("inline vector, by name", ITERATIONS, [&]() {
+			CXMPPStanza *pStanza = Arena.New<CXMPPStanza>(Arena, shape.szName);
+			for (const auto &attribute : shape.vAttributes) {
+				pStanza->SetAttribute(attribute.first, attribute.second);
+			}
+			for (const auto &attribute : shape.vAttributes) {
+				g_uBenchSink += pStanza->GetAttribute(attribute.first).size() + pStanza->HasAttribute(attribute.first);
+			}
+			g_uBenchSink += pStanza->HasAttribute("xmlns:stream");
+
+			pStanza->~CXMPPStanza();
+			Arena.Reset();
+		});
+
+		double dAtoms = Measure("inline vector, by atom", ITERATIONS, [&]() {
+			CXMPPStanza *pStanza = Arena.New<CXMPPStanza>(Arena, shape.szName);
+			for (size_t i = 0; i < vAtoms.size(); i++) {
+				pStanza->SetAttribute(vAtoms[i], shape.vAttributes[i].second);
+			}
+			for (const CXMPPAtom *pAtom : vAtoms) {
+				g_uBenchSink += pStanza->GetAttribute(pAtom).size() + pStanza->HasAttribute(pAtom);
+			}
+			g_uBenchSink += pStanza->HasAttribute(CXMPPAtom::Node);
+
+			pStanza->~CXMPPStanza();
+			Arena.Reset();
+		});
+
+		printf("  %-44s %12.2fx\n", "speedup by name", dBefore / dNames);
+		printf("  %-44s %12.2fx\n", "speedup by atom", dBefore / dAtoms);
+	}
+
+	return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <chrono>
+#include <cstdio>
+
+/* Results are added here so the compiler cannot drop the work */
+static volatile size_t g_uBenchSink;
+
+/* Time uIterations calls of Run after one warm up call, print and return the mean in nanoseconds */
+template <typename T>
+double Measure(const char *szName, unsigned int uIterations, T Run) {
+	Run();
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < uIterations; i++) {
+		Run();
+	}
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+	double dNanoseconds = elapsed.count() / uIterations;
+	printf("  %-44s %12.0f ns\n", szName, dNanoseconds);
+	return dNanoseconds;
+}
+
+#endif
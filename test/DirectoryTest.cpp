@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/* Paging the users. directory from the nick indexes */
+
+#include <vector>
+
+#include "Test.h"
+#include "NickIndex.h"
+
+static CString Name(const SXMPPDirectoryEntry &entry) {
+	return entry.pNick->sNick + "!" + entry.sNetwork;
+}
+
+static std::vector<CString> Names(const std::vector<SXMPPDirectoryEntry> &vPage) {
+	std::vector<CString> vsNames;
+	for (const SXMPPDirectoryEntry &entry : vPage) {
+		vsNames.push_back(Name(entry));
+	}
+	return vsNames;
+}
+
+static void Fill(CXMPPNickIndex &Index, const CString &sPrefix, unsigned int uNicks) {
+	for (unsigned int i = 0; i < uNicks; i++) {
+		Index.Join(sPrefix + CString(10000 + i), "#znc");
+	}
+}
+
+static int TestForwardPages() {
+	CXMPPNickIndex efnet, freenode, oftc;
+	Fill(efnet, "e", 3);
+	Fill(freenode, "f", 700);
+	Fill(oftc, "o", 2);
+
+	/* Networks are listed by name, whatever order they were added in */
+	CXMPPNickDirectory directory;
+	directory.AddNetwork("OFTC", oftc);
+	directory.AddNetwork("freenode", freenode);
+	directory.AddNetwork("EFnet", efnet);
+	CHECK(directory.GetCount() == 705);
+
+	std::vector<SXMPPDirectoryEntry> vPage;
+	directory.PageAfter("", "", 250, vPage);
+	CHECK(vPage.size() == 250);
+	CHECK(Name(vPage[0]) == "e10000!EFnet");
+	CHECK(Name(vPage[3]) == "f10000!freenode");
+
+	/* Walking page by page covers everything exactly once */
+	std::vector<CString> vsAll = Names(vPage);
+	while (!vPage.empty()) {
+		SXMPPDirectoryEntry last = vPage.back();
+		directory.PageAfter(last.sNetwork, last.pNick->sNick, 250, vPage);
+		std::vector<CString> vsPage = Names(vPage);
+		vsAll.insert(vsAll.end(), vsPage.begin(), vsPage.end());
+	}
+	CHECK(vsAll.size() == 705);
+	CHECK(vsAll[702] == "f10699!freenode");
+	CHECK(vsAll[704] == "o10001!OFTC");
+
+	return 0;
+}
+
+static int TestBackwardPages() {
+	CXMPPNickIndex efnet, freenode;
+	Fill(efnet, "e", 3);
+	Fill(freenode, "f", 5);
+
+	CXMPPNickDirectory directory;
+	directory.AddNetwork("freenode", freenode);
+	directory.AddNetwork("EFnet", efnet);
+
+	/* The last page, in listing order */
+	std::vector<SXMPPDirectoryEntry> vPage;
+	directory.PageBefore("", "", 6, vPage);
+	CHECK(vPage.size() == 6);
+	CHECK(Name(vPage[0]) == "e10002!EFnet");
+	CHECK(Name(vPage[5]) == "f10004!freenode");
+
+	directory.PageBefore("freenode", "f10001", 10, vPage);
+	CHECK(vPage.size() == 4);
+	CHECK(Name(vPage[0]) == "e10000!EFnet");
+	CHECK(Name(vPage[3]) == "f10000!freenode");
+
+	directory.PageBefore("EFnet", "e10000", 10, vPage);
+	CHECK(vPage.empty());
+
+	return 0;
+}
+
+static int TestPositionsOutliveNicks() {
+	CXMPPNickIndex efnet, freenode;
+	Fill(efnet, "e", 3);
+	Fill(freenode, "f", 3);
+
+	CXMPPNickDirectory directory;
+	directory.AddNetwork("EFnet", efnet);
+	directory.AddNetwork("freenode", freenode);
+
+	/* The nick a client paged up to quit, and its network went away */
+	std::vector<SXMPPDirectoryEntry> vPage;
+	efnet.Quit("e10001");
+	directory.PageAfter("efnet", "E10001", 2, vPage);
+	CHECK(vPage.size() == 2);
+	CHECK(Name(vPage[0]) == "e10002!EFnet");
+	CHECK(Name(vPage[1]) == "f10000!freenode");
+
+	directory.PageAfter("dalnet", "someone", 1, vPage);
+	CHECK(vPage.size() == 1);
+	CHECK(Name(vPage[0]) == "e10000!EFnet");
+
+	directory.PageAfter("ircnet", "someone", 1, vPage);
+	CHECK(vPage.size() == 0);
+
+	/* Nicks fold the way their network says, as in the index */
+	freenode.Join("[away]", "#znc");
+	directory.PageBefore("freenode", "{AWAY}", 5, vPage);
+	CHECK(vPage.size() == 5);
+	CHECK(Name(vPage[4]) == "f10002!freenode");
+
+	return 0;
+}
+
+int main() {
+	int iFailures = 0;
+
+	RUN_TEST(TestForwardPages);
+	RUN_TEST(TestBackwardPages);
+	RUN_TEST(TestPositionsOutliveNicks);
+
+	return iFailures ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * Broadcasting a channel message to N resources: re-serializing the whole
+ * stanza per resource, as OnChanTextMessage used to, against serializing
+ * it once and rendering only to and from per resource. A sole resource
+ * is written the tree directly, as OnChanTextMessage does with no
+ * detached sessions around.
+ */
+
+#include <vector>
+
+#include "Bench.h"
+#include "Stanza.h"
+
+static const CString TEXT = "did anyone else see the build break after the last merge? it's failing in <Socket.cpp> & friends";
+
+static void Message(CXMPPStanza &Stanza) {
+	Stanza.SetAttribute(CXMPPAtom::Id, "znc_Ab3dE6gH");
+	Stanza.SetAttribute(CXMPPAtom::Type, "groupchat");
+	CXMPPStanza &body = Stanza.NewChild(CXMPPAtom::Body);
+	body.NewChild().SetText(TEXT);
+}
+
+int main() {
+	const CString sFrom = "#znc!freenode+irc@znc.in/somebody";
+
+	for (unsigned int uResources : {1, 10, 100}) {
+		std::vector<CString> vsResources;
+		for (unsigned int i = 0; i < uResources; i++) {
+			vsResources.push_back("user@znc.in/resource" + CString(i));
+		}
+
+		printf("%u resources, per message:\n", uResources);
+		unsigned int uIterations = 200000 / uResources;
+
+		double dBefore = Measure("serialize per resource", uIterations, [&]() {
+			CXMPPStanza iq(CXMPPAtom::Message);
+			Message(iq);
+
+			for (const CString &sTo : vsResources) {
+				iq.SetAttribute(CXMPPAtom::To, sTo);
+				iq.SetAttribute(CXMPPAtom::From, sFrom);
+
+				CString sOutput;
+				iq.Serialize(sOutput);
+				g_uBenchSink += sOutput.size();
+			}
+		});
+
+		double dAfter = Measure(uResources == 1 ? "write the tree to the sole resource" : "serialize once, render per resource", uIterations, [&]() {
+			CXMPPStanza iq(CXMPPAtom::Message);
+			Message(iq);
+
+			if (uResources == 1) {
+				iq.SetAttribute(CXMPPAtom::To, vsResources[0]);
+				iq.SetAttribute(CXMPPAtom::From, sFrom);
+
+				CString sOutput;
+				iq.Serialize(sOutput);
+				g_uBenchSink += sOutput.size();
+				return;
+			}
+
+			CXMPPSerializedStanza serialized(iq);
+
+			for (const CString &sTo : vsResources) {
+				CString sOutput;
+				serialized.Render(sOutput, sTo, sFrom);
+				g_uBenchSink += sOutput.size();
+			}
+		});
+
+		printf("  %-44s %12.2fx\n", "speedup", dBefore / dAfter);
+	}
+
+	return 0;
+}
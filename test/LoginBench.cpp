@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * Message latency for logged in users while 200 clients log in at once.
+ * A model of ZNC's event loop delivers a message every millisecond, and
+ * each login costs a CPU bound password check. The check either runs on
+ * the loop, as CheckPass used to, or on worker threads like a CModuleJob,
+ * which hands its result back to the loop.
+ *
+ * This is a model, not ZNC: neither CSockManager nor CZNC's job threads
+ * are involved, only the shape of the work. The worker runs are reported
+ * for several pool sizes; with fewer CPUs than workers plus the loop the
+ * threads share cores, which is what the CPU count in the output is for.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Bench.h"
+
+static const unsigned int LOGINS = 200;
+static const unsigned int CHECK_MS = 5;
+
+typedef std::chrono::steady_clock TClock;
+
+struct SEvent {
+	enum { MESSAGE, LOGIN, CHECKED, STOP } eType;
+	TClock::time_point tPosted;
+};
+
+/* Stands in for a salted, deliberately slow password hash */
+static uint64_t Hash(uint64_t uRounds) {
+	uint64_t uHash = 14695981039346656037ULL;
+	for (uint64_t i = 0; i < uRounds; i++) {
+		uHash = (uHash ^ (i & 0xff)) * 1099511628211ULL;
+	}
+	return uHash;
+}
+
+/* Rounds for one check, from the fastest of a few timed runs */
+static uint64_t Calibrate() {
+	uint64_t uRounds = 10000000;
+	double dFastest = 0;
+
+	for (unsigned int i = 0; i < 5; i++) {
+		TClock::time_point start = TClock::now();
+		g_uBenchSink += Hash(uRounds);
+		std::chrono::duration<double, std::milli> elapsed = TClock::now() - start;
+		if (!i || elapsed.count() < dFastest) {
+			dFastest = elapsed.count();
+		}
+	}
+
+	return uRounds * CHECK_MS / dFastest;
+}
+
+class CQueue {
+public:
+	void Post(const SEvent &Event) {
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_dEvents.push_back(Event);
+		m_Cond.notify_one();
+	}
+
+	SEvent Wait() {
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_Cond.wait(lock, [&]() { return !m_dEvents.empty(); });
+		SEvent event = m_dEvents.front();
+		m_dEvents.pop_front();
+		return event;
+	}
+
+protected:
+	std::mutex m_Mutex;
+	std::condition_variable m_Cond;
+	std::deque<SEvent> m_dEvents;
+};
+
+static void Run(const char *szName, unsigned int uWorkers, uint64_t uRounds) {
+	bool bThreaded = uWorkers > 0;
+	CQueue loop;
+	CQueue jobs;
+	std::vector<double> vdLatencies;
+	unsigned int uChecked = 0;
+	TClock::time_point start = TClock::now();
+	TClock::time_point done;
+
+	std::vector<std::thread> vWorkers;
+	if (bThreaded) {
+		for (unsigned int i = 0; i < uWorkers; i++) {
+			vWorkers.emplace_back([&]() {
+				while (jobs.Wait().eType != SEvent::STOP) {
+					g_uBenchSink += Hash(uRounds);
+					loop.Post({SEvent::CHECKED, TClock::now()});
+				}
+			});
+		}
+	}
+
+	/* Messages for the logged in users keep arriving throughout, each
+	 * timed from when it was due, so a starved ticker counts as a stall too */
+	std::atomic<bool> bTicking(true);
+	std::thread ticker([&]() {
+		for (TClock::time_point due = start; bTicking; due += std::chrono::milliseconds(1)) {
+			std::this_thread::sleep_until(due);
+			loop.Post({SEvent::MESSAGE, due});
+		}
+	});
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	for (unsigned int i = 0; i < LOGINS; i++) {
+		loop.Post({SEvent::LOGIN, TClock::now()});
+	}
+
+	/* The event loop */
+	for (;;) {
+		SEvent event = loop.Wait();
+		TClock::time_point now = TClock::now();
+
+		if (event.eType == SEvent::MESSAGE) {
+			vdLatencies.push_back(std::chrono::duration<double, std::milli>(now - event.tPosted).count());
+			if (uChecked == LOGINS && now - done > std::chrono::milliseconds(100)) {
+				break;
+			}
+		} else if (event.eType == SEvent::LOGIN && bThreaded) {
+			jobs.Post(event);
+		} else {
+			if (event.eType == SEvent::LOGIN) {
+				g_uBenchSink += Hash(uRounds);
+			}
+			if (++uChecked == LOGINS) {
+				done = TClock::now();
+			}
+		}
+	}
+
+	bTicking = false;
+	ticker.join();
+	for (size_t i = 0; i < vWorkers.size(); i++) {
+		jobs.Post({SEvent::STOP, TClock::now()});
+	}
+	for (std::thread &worker : vWorkers) {
+		worker.join();
+	}
+
+	std::sort(vdLatencies.begin(), vdLatencies.end());
+	printf("  %-30s p50 %6.2f ms  p99 %7.2f ms  max %7.2f ms  logins done after %5.0f ms\n", szName,
+		vdLatencies[vdLatencies.size() / 2], vdLatencies[vdLatencies.size() * 99 / 100], vdLatencies.back(),
+		std::chrono::duration<double, std::milli>(done - start).count() - 100);
+}
+
+int main() {
+	uint64_t uRounds = Calibrate();
+
+	printf("Model: %u logins at once, %u ms per password check, a message every ms, %u CPUs:\n", LOGINS, CHECK_MS, std::thread::hardware_concurrency());
+	Run("check on the event loop", 0, uRounds);
+	Run("check on 1 worker thread", 1, uRounds);
+	Run("check on 2 worker threads", 2, uRounds);
+	Run("check on 4 worker threads", 4, uRounds);
+
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * Memory regression: a client's channel membership stays at the channels
+ * it joined, however many other channels messages and presence arrive
+ * from. Looking a channel up must never add it.
+ */
+
+#include "Test.h"
+#include "Channels.h"
+
+static const unsigned int JOINED = 20;
+static const unsigned int FLOOD = 100000;
+
+static CXMPPChannel Channel(const CString &sChannel) {
+	CXMPPJID jid;
+	jid.SetUser(sChannel);
+	jid.SetDomain("znc.in");
+	jid.SetResource("me");
+	return CXMPPChannel(jid, NULL);
+}
+
+static int TestFloodFromUnjoinedChannels() {
+	CXMPPChannelKeys Keys;
+	CXMPPChannelMembership Channels(Keys);
+
+	for (unsigned int i = 0; i < JOINED; i++) {
+		CHECK(Channels.Add(Channel("#joined" + CString(i) + "!freenode+irc")) != NULL);
+	}
+	CHECK(Channels.GetChannels().size() == JOINED);
+
+	for (unsigned int i = 0; i < FLOOD; i++) {
+		CString sChannel = "#other" + CString(i) + "!freenode+irc";
+
+		/* Membership checks for a groupchat message from the channel */
+		CHECK(!Channels.Has(sChannel));
+		CHECK(Channels.Find(sChannel) == NULL);
+
+		/* The unavailable presence path: look the room up, leave it if joined */
+		CHECK(Channels.Find(sChannel) == NULL);
+		CHECK(Channels.Remove(sChannel) == NULL);
+
+		/* Joined channels are still found, whatever the case */
+		CHECK(Channels.Has("#JOINED" + CString(i % JOINED) + "!FreeNode+irc"));
+	}
+
+	CHECK(Channels.GetChannels().size() == JOINED);
+	CHECK(Keys.GetSize() == JOINED);
+
+	return 0;
+}
+
+static int TestJoinAndLeave() {
+	CXMPPChannelKeys Keys;
+	CXMPPChannelMembership Channels(Keys);
+	CXMPPChannelMembership Other(Keys);
+
+	CXMPPChannelKey Key = Channels.Add(Channel("#znc!freenode+irc"));
+	CHECK(Key != NULL);
+	/* Joining twice is no new membership */
+	CHECK(Channels.Add(Channel("#ZNC!freenode+irc")) == NULL);
+	/* Clients share the module's keys */
+	CHECK(Other.Add(Channel("#znc!freenode+irc")) == Key);
+	CHECK(Keys.GetSize() == 1);
+
+	CHECK(Channels.Remove("#Znc!freenode+irc") == Key);
+	CHECK(Channels.Remove("#znc!freenode+irc") == NULL);
+	CHECK(Channels.GetChannels().empty());
+	CHECK(Other.Has("#znc!freenode+irc"));
+
+	return 0;
+}
+
+int main() {
+	int iFailures = 0;
+
+	RUN_TEST(TestFloodFromUnjoinedChannels);
+	RUN_TEST(TestJoinAndLeave);
+
+	return iFailures ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * A connect storm: logins parsed through libxml2 with a new push parser
+ * context for every stream start and restart, as ReadData used to, against
+ * a context taken from the module's pool and reset in place on restarts.
+ */
+
+#include <cstring>
+
+#include <libxml/parser.h>
+
+#include "Bench.h"
+#include "ParserPool.h"
+
+static const unsigned int LOGINS = 20000;
+
+/* What a client sends for one login: the initial stream, the one after STARTTLS, and the one after SASL */
+static const char *STREAMS[] = {
+	"<?xml version='1.0'?><stream:stream to='znc.in' version='1.0' xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+	"<starttls xmlns='urn:ietf:params:xml:ns:xmpp-tls'/>",
+
+	"<?xml version='1.0'?><stream:stream to='znc.in' version='1.0' xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+	"<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>AHVzZXIAcGFzc3dvcmQ=</auth>",
+
+	"<?xml version='1.0'?><stream:stream to='znc.in' version='1.0' xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+	"<iq type='set' id='bind_1'><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><resource>phone</resource></bind></iq>"
+	"<iq type='set' id='sess_1'><session xmlns='urn:ietf:params:xml:ns:xmpp-session'/></iq>"
+	"<presence/>"
+	"<iq type='get' id='disco_1' to='znc.in'><query xmlns='http://jabber.org/protocol/disco#info'/></iq>",
+};
+
+static void _start_element(void *pUserData, const xmlChar *, const xmlChar *, const xmlChar *, int, const xmlChar **, int, int, const xmlChar **) {
+	(*(size_t *)pUserData)++;
+}
+
+int main() {
+	xmlSAXHandler handlers;
+	memset(&handlers, 0, sizeof(xmlSAXHandler));
+	handlers.initialized = XML_SAX2_MAGIC;
+	handlers.startElementNs = _start_element;
+
+	size_t uElements = 0;
+
+	printf("%u logins, three streams each:\n", LOGINS);
+
+	double dBefore = Measure("new context per stream", LOGINS, [&]() {
+		for (const char *szStream : STREAMS) {
+			xmlParserCtxtPtr pContext = xmlCreatePushParserCtxt(&handlers, &uElements, NULL, 0, NULL);
+			xmlParseChunk(pContext, szStream, strlen(szStream), 0);
+			xmlFreeParserCtxt(pContext);
+		}
+	});
+
+	/* What CXMPPSocket does with the module's pool */
+	CXMPPParserPool pool;
+	double dAfter = Measure("pooled context, reset on restart", LOGINS, [&]() {
+		xmlParserCtxtPtr pContext = pool.Acquire(&handlers, &uElements);
+
+		bool bFirst = true;
+		for (const char *szStream : STREAMS) {
+			if (!bFirst) {
+				CXMPPParserPool::Restart(pContext, &uElements);
+			}
+			bFirst = false;
+			xmlParseChunk(pContext, szStream, strlen(szStream), 0);
+		}
+
+		pool.Release(pContext);
+	});
+
+	printf("  %-44s %12.0f\n", "logins per second before", 1e9 / dBefore);
+	printf("  %-44s %12.0f\n", "logins per second after", 1e9 / dAfter);
+	printf("  %-44s %12.2fx\n", "speedup", dBefore / dAfter);
+
+	g_uBenchSink += uElements;
+
+	return 0;
+}
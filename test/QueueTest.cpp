@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/* Scheduling of a backlogged client's outbound queue */
+
+#include <vector>
+
+#include "Test.h"
+#include "Queue.h"
+
+static const CString ROOM = "#znc!freenode+irc@znc.in";
+
+/* What JoinChannel writes, in order, for a room with the given occupants */
+static void QueueJoin(CXMPPOutboundQueue &Queue, const std::vector<CString> &vsOccupants) {
+	for (const CString &sNick : vsOccupants) {
+		Queue.Push("occupant " + sNick, XMPP_TRAFFIC_PRESENCE, ROOM + "/" + sNick, true);
+	}
+
+	Queue.Push("self", XMPP_TRAFFIC_PRESENCE, ROOM + "/me", true);
+
+	/* History and subject come from other occupants, or people long gone */
+	Queue.Push("history 1", XMPP_TRAFFIC_GROUPCHAT, ROOM + "/" + vsOccupants[0], true);
+	Queue.Push("history 2", XMPP_TRAFFIC_GROUPCHAT, ROOM + "/somebody", true);
+	Queue.Push("subject", XMPP_TRAFFIC_GROUPCHAT, ROOM + "/topicsetter", true);
+}
+
+static std::vector<CString> Drain(CXMPPOutboundQueue &Queue) {
+	std::vector<CString> vsSent;
+	SXMPPQueuedStanza stanza;
+	while (Queue.Pop(true, stanza)) {
+		vsSent.push_back(stanza.sData);
+	}
+	return vsSent;
+}
+
+static size_t Position(const std::vector<CString> &vsSent, const CString &sData) {
+	for (size_t i = 0; i < vsSent.size(); i++) {
+		if (vsSent[i] == sData) {
+			return i;
+		}
+	}
+	return vsSent.size();
+}
+
+static int TestJoinKeepsSelfPresenceFirst() {
+	CXMPPOutboundQueue Queue;
+	std::vector<CString> vsOccupants;
+	for (unsigned int i = 0; i < 2000; i++) {
+		vsOccupants.push_back("nick" + CString(i));
+	}
+
+	QueueJoin(Queue, vsOccupants);
+	/* A private message arriving while the join is backlogged */
+	Queue.Push("direct", XMPP_TRAFFIC_DIRECT, "friend!freenode+irc@znc.in", true);
+
+	std::vector<CString> vsSent = Drain(Queue);
+	CHECK(vsSent.size() == vsOccupants.size() + 5);
+	CHECK(Queue.IsEmpty());
+	CHECK(Queue.GetBytes() == 0);
+
+	/* The direct message still overtakes the whole join */
+	CHECK(vsSent[0] == "direct");
+
+	/* But the room's own stanzas stay in the order they were written */
+	size_t uSelf = Position(vsSent, "self");
+	CHECK(Position(vsSent, "occupant nick1999") < uSelf);
+	CHECK(uSelf < Position(vsSent, "history 1"));
+	CHECK(uSelf < Position(vsSent, "history 2"));
+	CHECK(uSelf < Position(vsSent, "subject"));
+	CHECK(Position(vsSent, "history 2") < Position(vsSent, "subject"));
+
+	return 0;
+}
+
+static int TestClassesAcrossJIDs() {
+	CXMPPOutboundQueue Queue;
+
+	Queue.Push("presence a", XMPP_TRAFFIC_PRESENCE, "a@znc.in", true);
+	Queue.Push("groupchat", XMPP_TRAFFIC_GROUPCHAT, ROOM + "/b", true);
+	Queue.Push("message a", XMPP_TRAFFIC_DIRECT, "a@znc.in/resource", true);
+	Queue.Push("message c", XMPP_TRAFFIC_DIRECT, "c@znc.in", true);
+
+	std::vector<CString> vsSent = Drain(Queue);
+	CHECK(vsSent.size() == 4);
+	/* a's message has to wait for a's presence, c's does not */
+	CHECK(vsSent[0] == "presence a");
+	CHECK(vsSent[1] == "message a");
+	CHECK(vsSent[2] == "message c");
+	CHECK(vsSent[3] == "groupchat");
+
+	return 0;
+}
+
+static int TestArrivalOrder() {
+	CXMPPOutboundQueue Queue;
+	QueueJoin(Queue, {"a", "b"});
+	Queue.Push("direct", XMPP_TRAFFIC_DIRECT, "friend@znc.in", true);
+
+	std::vector<CString> vsSent;
+	SXMPPQueuedStanza stanza;
+	while (Queue.Pop(false, stanza)) {
+		vsSent.push_back(stanza.sData);
+	}
+
+	CHECK(vsSent.size() == 7);
+	CHECK(vsSent[2] == "self");
+	CHECK(vsSent[6] == "direct");
+
+	return 0;
+}
+
+static int TestPresencePolicies() {
+	CXMPPOutboundQueue Queue;
+	QueueJoin(Queue, {"a", "b"});
+	size_t uBytes = Queue.GetBytes();
+
+	CHECK(Queue.CollapsePresence(ROOM + "/a"));
+	CHECK(!Queue.CollapsePresence(ROOM + "/a"));
+	CHECK(Queue.GetStanzas() == 5);
+	CHECK(Queue.GetBytes() == uBytes - CString("occupant a").size());
+
+	/* The newer presence from a now goes after the rest of the room */
+	Queue.Push("occupant a again", XMPP_TRAFFIC_PRESENCE, ROOM + "/a", true);
+	CHECK(Queue.DropPresence());
+
+	std::vector<CString> vsSent = Drain(Queue);
+	CHECK(vsSent.size() == 5);
+	CHECK(vsSent[0] == "self");
+	CHECK(vsSent[4] == "occupant a again");
+	CHECK(Queue.GetPeakBytes() >= uBytes);
+
+	return 0;
+}
+
+static int TestPresenceStorm() {
+	CXMPPOutboundQueue Queue;
+	const unsigned int uOccupants = 20000;
+
+	/* Every occupant changes presence a few times while the client is
+	 * backlogged, with the room talking in between */
+	for (unsigned int uRound = 0; uRound < 5; uRound++) {
+		for (unsigned int i = 0; i < uOccupants; i++) {
+			CString sFrom = ROOM + "/nick" + CString(i);
+			if (uRound) {
+				CHECK(Queue.CollapsePresence(uRound % 2 ? sFrom.AsLower() : sFrom));
+			}
+			Queue.Push("presence " + CString(i) + " " + CString(uRound), XMPP_TRAFFIC_PRESENCE, sFrom, true);
+		}
+		Queue.Push("groupchat " + CString(uRound), XMPP_TRAFFIC_GROUPCHAT, ROOM + "/talker", true);
+	}
+
+	CHECK(Queue.GetStanzas() == uOccupants + 5);
+
+	std::vector<CString> vsSent = Drain(Queue);
+	CHECK(vsSent.size() == uOccupants + 5);
+	CHECK(Queue.IsEmpty());
+	CHECK(Queue.GetBytes() == 0);
+
+	/* Only the latest presence from each occupant is left, in room order */
+	for (unsigned int i = 0; i < 4; i++) {
+		CHECK(vsSent[i] == "groupchat " + CString(i));
+	}
+	for (unsigned int i = 0; i < uOccupants; i++) {
+		CHECK(vsSent[4 + i] == "presence " + CString(i) + " 4");
+	}
+	CHECK(vsSent.back() == "groupchat 4");
+
+	return 0;
+}
+
+int main() {
+	int iFailures = 0;
+
+	RUN_TEST(TestJoinKeepsSelfPresenceFirst);
+	RUN_TEST(TestClassesAcrossJIDs);
+	RUN_TEST(TestArrivalOrder);
+	RUN_TEST(TestPresencePolicies);
+	RUN_TEST(TestPresenceStorm);
+
+	return iFailures ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <cstdio>
+
+/* Each test is a function returning 0 on success, CHECK bails out of it */
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			return 1; \
+		} \
+	} while (0)
+
+#define RUN_TEST(test) do { \
+		int iFailed = test(); \
+		printf("%s %s\n", iFailed ? "FAIL" : "ok  ", #test); \
+		iFailures += iFailed; \
+	} while (0)
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2004-2012  See the AUTHORS file for details.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as published
+ * by the Free Software Foundation.
+ */
+
+/*
+ * Just enough of ZNC's CString for the parts of the module that do not
+ * need ZNC itself (the arena, atoms, stanzas and indexes), so they can be
+ * tested and benchmarked standalone.
+ */
+
+#ifndef _ZNCSTRING_H
+#define _ZNCSTRING_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <cstdlib>
+#include <strings.h>
+
+enum CaseSensitivity { CaseInsensitive, CaseSensitive };
+
+class CString : public std::string {
+public:
+	CString() {}
+	CString(const char *c) : std::string(c) {}
+	CString(const char *c, size_t l) : std::string(c, l) {}
+	CString(const std::string &s) : std::string(s) {}
+	CString(size_t n, char c) : std::string(n, c) {}
+	explicit CString(int i) : std::string(std::to_string(i)) {}
+	explicit CString(unsigned int i) : std::string(std::to_string(i)) {}
+	explicit CString(long i) : std::string(std::to_string(i)) {}
+	explicit CString(unsigned long i) : std::string(std::to_string(i)) {}
+	explicit CString(long long i) : std::string(std::to_string(i)) {}
+	explicit CString(unsigned long long i) : std::string(std::to_string(i)) {}
+
+	bool Equals(const CString &s, CaseSensitivity cs = CaseInsensitive) const {
+		if (cs == CaseSensitive) {
+			return *this == s;
+		}
+
+		return size() == s.size() && strcasecmp(c_str(), s.c_str()) == 0;
+	}
+
+	unsigned long long ToULongLong() const { return strtoull(c_str(), NULL, 10); }
+
+	CString AsLower() const {
+		CString sRet(*this);
+		for (char &c : sRet) {
+			if (c >= 'A' && c <= 'Z') {
+				c += 'a' - 'A';
+			}
+		}
+		return sRet;
+	}
+};
+
+typedef std::set<CString> SCString;
+typedef std::vector<CString> VCString;
+typedef std::map<CString, CString> MCString;
+
+#endif